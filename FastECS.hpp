@@ -44,6 +44,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __DEFINED_FASTECS_HEADER_HPP__
 
 #include <typeinfo>
+#include <type_traits>
 #include <map>
 #include <unordered_map>
 #include <assert.h>
@@ -55,7 +56,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <cstring>
 #include <atomic>
 #include <thread>
+#include <chrono>
 #include <cstdlib>
+#include <mutex>
+#include <memory>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
 
 namespace FastECS
 {
@@ -117,19 +127,35 @@ enum { MAX_EVENT_COUNT = FASTECS_MAX_EVENT_COUNT + 2 };
 enum {MAX_EVENT_COUNT = 16 };
 #endif
 
-/// maximum chunk size
+/// maximum chunk size of the default ChunkSizePolicy
 /// actual chunk size = min(MAX_ENTITY_COUNT_PER_CHUNK * entitySize, maxChunkSize)
 #ifdef FASTECS_MAX_STORAGE_CHUNK_SIZE
 enum { MAX_STORAGE_CHUNK_SIZE = FASTECS_MAX_STORAGE_CHUNK_SIZE };
 #else
-enum { MAX_STORAGE_CHUNK_SIZE = 64 * 1024 * 1024 }; // 64k
+enum { MAX_STORAGE_CHUNK_SIZE = 64 * 1024 * 1024 }; // 64MB
 #endif
 
-/// maximum EntityContext count in one ECS world
-#ifdef FASTECS_MAX_CONTEXT_COUNT
-enum { MAX_CONTEXT_COUNT = FASTECS_MAX_CONTEXT_COUNT };
+/// how many empty chunks each storage keeps without releasing their memory by default,
+/// the memory of the other empty chunks is given back to the allocator at once
+#ifdef FASTECS_SPARE_CHUNK_COUNT
+enum { DEFAULT_SPARE_CHUNK_COUNT = FASTECS_SPARE_CHUNK_COUNT };
+#else
+enum { DEFAULT_SPARE_CHUNK_COUNT = 1 };
+#endif
+
+/// how many entities the first chunk of a storage has when its chunks grow, see ChunkSizePolicy::Growing
+#ifdef FASTECS_FIRST_CHUNK_ENTITY_COUNT
+enum { DEFAULT_FIRST_CHUNK_ENTITY_COUNT = FASTECS_FIRST_CHUNK_ENTITY_COUNT };
+#else
+enum { DEFAULT_FIRST_CHUNK_ENTITY_COUNT = 16 };
+#endif
+
+/// every component column in a chunk starts at a multiple of this size,
+/// so columns written by different threads never share a cache line
+#ifdef FASTECS_CACHE_LINE_SIZE
+enum { CACHE_LINE_SIZE = FASTECS_CACHE_LINE_SIZE };
 #else
-enum { MAX_CONTEXT_COUNT = 256 };
+enum { CACHE_LINE_SIZE = 64 };
 #endif
 
 /// use this macro to control MAX_ENTITY_COUNT_PER_CHUNK
@@ -140,12 +166,82 @@ enum { MAX_BLOCK_COUNT_BITS = FASTECS_MAX_BLOCK_COUNT_BITS };
 enum { MAX_BLOCK_COUNT_BITS = 10 };
 #endif
 
-/// use this to set MAX_CHUNK_COUNT_PER_STORAGE
-enum { MAX_CHUNK_COUNT_BITS = 15 };
+/// EntityID layouts, each of them decides the type of EntityID, the type of generation ids,
+/// and how many bits each part of an EntityID takes:
+/// |<--GEN_BITS:genId-->||<--CONTEXT_BITS:contextId-->| ... |<--STORAGE_BITS:storageId-->||<--CHUNK_BITS:chunkId-->||<--MAX_BLOCK_COUNT_BITS:blockId-->|
+/// the generation id wraps after (1 << GEN_BITS) entities are created in one block.
+struct DefaultEntityIDLayout
+{
+	using ValueType = uint64_t;
+	using GenIDType = uint16_t;
+	enum { GEN_BITS = 16, CONTEXT_BITS = 8, STORAGE_BITS = 10, CHUNK_BITS = 15 };
+};
+
+/// 16M generations per block, at most 4096 chunks per storage
+struct WideGenerationEntityIDLayout
+{
+	using ValueType = uint64_t;
+	using GenIDType = uint32_t;
+	enum { GEN_BITS = 24, CONTEXT_BITS = 8, STORAGE_BITS = 10, CHUNK_BITS = 12 };
+};
+
+/// 32 bits EntityIDs for small worlds: 4 contexts, 64 archetypes and 64 chunks per storage, 256 generations per block.
+/// past those limits World::CreateContext and the ways of creating entities return null
+struct CompactEntityIDLayout
+{
+	using ValueType = uint32_t;
+	using GenIDType = uint8_t;
+	enum { GEN_BITS = 8, CONTEXT_BITS = 2, STORAGE_BITS = 6, CHUNK_BITS = 6 };
+};
+
+/// Which EntityID layout to use, the values you can specify:
+/// 0: DefaultEntityIDLayout
+/// 1: WideGenerationEntityIDLayout
+/// 2: CompactEntityIDLayout
+/// or define FASTECS_CUSTOM_ENTITY_ID_LAYOUT as your own layout type, which is written like the ones above
+#if defined(FASTECS_CUSTOM_ENTITY_ID_LAYOUT)
+using EntityIDLayout = FASTECS_CUSTOM_ENTITY_ID_LAYOUT;
+#elif defined(FASTECS_ENTITY_ID_LAYOUT) && FASTECS_ENTITY_ID_LAYOUT == 1
+using EntityIDLayout = WideGenerationEntityIDLayout;
+#elif defined(FASTECS_ENTITY_ID_LAYOUT) && FASTECS_ENTITY_ID_LAYOUT == 2
+using EntityIDLayout = CompactEntityIDLayout;
+#else
+using EntityIDLayout = DefaultEntityIDLayout;
+#endif
+
+using EntityID = EntityIDLayout::ValueType;
+using EntityGenID = EntityIDLayout::GenIDType;
+
+enum { ENTITY_ID_BITS = sizeof(EntityID) * 8 };
+enum { GEN_ID_BITS = EntityIDLayout::GEN_BITS };
+enum { CONTEXT_ID_BITS = EntityIDLayout::CONTEXT_BITS };
+
+/// the genId and the contextId are put at the top, the others at the bottom
+enum { GEN_ID_SHIFT = ENTITY_ID_BITS - GEN_ID_BITS };
+enum { CONTEXT_ID_SHIFT = GEN_ID_SHIFT - CONTEXT_ID_BITS };
 
-/// use this to control MAX_STORAGE_COUNT_PER_CONTEXT
+/// set by the EntityID layout, MAX_CHUNK_COUNT_PER_STORAGE == (1 << MAX_CHUNK_COUNT_BITS)
+enum { MAX_CHUNK_COUNT_BITS = EntityIDLayout::CHUNK_BITS };
+
+/// set by the EntityID layout, MAX_STORAGE_COUNT_PER_CONTEXT == (1 << MAX_STORAGE_COUNT_BITS)
 /// which means the maximum archetype you can define in each context
-enum { MAX_STORAGE_COUNT_BITS = 10 };
+enum { MAX_STORAGE_COUNT_BITS = EntityIDLayout::STORAGE_BITS };
+
+static_assert(MAX_STORAGE_COUNT_BITS + MAX_CHUNK_COUNT_BITS + MAX_BLOCK_COUNT_BITS <= CONTEXT_ID_SHIFT,
+	"the parts of the EntityID layout must fit in EntityID");
+static_assert(CONTEXT_ID_BITS <= 8, "contextId must fit in 8 bits");
+static_assert(GEN_ID_BITS <= sizeof(EntityGenID) * 8, "genId must fit in its type");
+static_assert(MAX_CHUNK_COUNT_BITS <= 16 && MAX_STORAGE_COUNT_BITS <= 16, "chunkId and storageId must fit in 16 bits");
+
+enum : uint64_t { GEN_ID_MASK = (1ull << GEN_ID_BITS) - 1 };
+
+/// maximum EntityContext count in one ECS world, limited by CONTEXT_ID_BITS
+#ifdef FASTECS_MAX_CONTEXT_COUNT
+enum { MAX_CONTEXT_COUNT = FASTECS_MAX_CONTEXT_COUNT };
+#else
+enum { MAX_CONTEXT_COUNT = (1 << CONTEXT_ID_BITS) };
+#endif
+static_assert(MAX_CONTEXT_COUNT <= (1 << CONTEXT_ID_BITS), "contextId must fit in the EntityID layout");
 
 enum { MAX_ENTITY_COUNT_PER_CHUNK = (1 << MAX_BLOCK_COUNT_BITS) };
 enum { MAX_CHUNK_COUNT_PER_STORAGE = (1 << MAX_CHUNK_COUNT_BITS) };
@@ -155,6 +251,10 @@ enum { BLOCK_INDEX_MASK = MAX_ENTITY_COUNT_PER_CHUNK - 1 };
 enum { CHUNK_INDEX_MASK = MAX_CHUNK_COUNT_PER_STORAGE - 1};
 enum { STORAGE_INDEX_MASK = MAX_STORAGE_COUNT_PER_CONTEXT - 1};
 
+/// chunks of a storage live in pages that are never moved, and the pages grow geometrically:
+/// page p holds the chunks [(1 << p) - 1, (1 << (p + 1)) - 1), so a storage with one chunk has a page of one chunk
+enum { MAX_CHUNK_PAGE_COUNT = MAX_CHUNK_COUNT_BITS + 1 };
+
 /// How to generate id for each component
 /// 0: generate id automatically, use DefineComponent to define component
 /// 1: generate id by specifying a value manually, use DefineComponentWithID to define component
@@ -285,6 +385,86 @@ using EventTypeID = EventHash;
 /// All component class must inheret from this class
 struct ComponentBase { };
 
+/// A component is cold if it declares:
+///		static constexpr bool cold_component = true;
+/// cold components are stored apart from the hot ones, see EntityArchetype::SetComponentCold
+template<typename T, typename = void>
+struct is_cold_component : std::false_type {};
+
+template<typename T>
+struct is_cold_component<T, std::void_t<decltype(T::cold_component)>> : std::bool_constant<T::cold_component> {};
+
+/// A component is a tag if it has no data, e.g. DefineComponent(IsEnemy) {};
+/// tags take no memory in chunks and are never constructed or destroyed,
+/// they only take part in the archetype identity and query matching
+template<typename T>
+struct is_tag_component : std::is_empty<T> {};
+
+/// A component is shared if it declares:
+///		static constexpr bool shared_component = true;
+/// its value is stored once per chunk instead of once per entity, so all the entities in a chunk
+/// have the same value and entities with different values are put in different chunks.
+/// a shared component must be comparable with operator==
+template<typename T, typename = void>
+struct is_shared_component : std::false_type {};
+
+template<typename T>
+struct is_shared_component<T, std::void_t<decltype(T::shared_component)>> : std::bool_constant<T::shared_component> {};
+
+template<typename...T>
+constexpr bool any_shared_component_v = (is_shared_component<std::decay_t<T>>::value || ...);
+
+/// A component belongs to the chunk rather than to its entities if it declares:
+///		static constexpr bool chunk_component = true;
+/// each chunk has one value of it, which is default constructed with the chunk memory and never copied or moved
+/// with the entities, e.g. the bounding volume of the chunk, see EntityComponentChunk::GetChunkComponent
+template<typename T, typename = void>
+struct is_chunk_component : std::false_type {};
+
+template<typename T>
+struct is_chunk_component<T, std::void_t<decltype(T::chunk_component)>> : std::bool_constant<T::chunk_component> {};
+
+template<typename...T>
+constexpr bool any_chunk_component_v = (is_chunk_component<std::decay_t<T>>::value || ...);
+
+/// A component is kept outside the archetypes if it declares:
+///		static constexpr bool sparse_component = true;
+/// each context keeps the values of such a type in a sparse set keyed by EntityID, see SparseComponentSet,
+/// so adding or removing it (Entity::AddSparseComponent/RemoveSparseComponent) never moves the entity
+/// to another archetype, e.g. short-lived status effects. it can't be part of an archetype
+template<typename T, typename = void>
+struct is_sparse_component : std::false_type {};
+
+template<typename T>
+struct is_sparse_component<T, std::void_t<decltype(T::sparse_component)>> : std::bool_constant<T::sparse_component> {};
+
+template<typename...T>
+constexpr bool any_sparse_component_v = (is_sparse_component<std::decay_t<T>>::value || ...);
+
+/// the largest lane component, see is_lane_component
+enum { MAX_LANE_COMPONENT_SIZE = 256 };
+
+/// A component can be laid out in lanes if all of its fields have the same type, which it declares as:
+///		using lane_field_type = float;
+/// in an archetype with a lane width (see EntityArchetype::SetLaneWidth), the values of such a component
+/// are stored field by field in groups of 'laneWidth' entities (AoSoA), e.g. x0 x1 .. x7 y0 y1 .. y7 for 8 lanes,
+/// so each field of a group can be loaded as one SIMD vector, see EntityContext::ForEachLaneGroup
+template<typename T, typename = void>
+struct is_lane_component : std::false_type {};
+
+template<typename T>
+struct is_lane_component<T, std::void_t<typename T::lane_field_type>> : std::true_type
+{
+	static_assert(std::is_trivially_copyable<T>::value && std::is_trivially_destructible<T>::value, 
+		"a lane component must be trivially copyable");
+	static_assert(sizeof(T) % sizeof(typename T::lane_field_type) == 0, "a lane component must only have fields of lane_field_type");
+	static_assert(sizeof(T) <= MAX_LANE_COMPONENT_SIZE, "the lane component is too large");
+};
+
+/// the type of the fields of a lane component
+template<typename T>
+using lane_field_t = typename std::decay_t<T>::lane_field_type;
+
 /// Any component class or event class must inhere from this
 /// this class gives each component class an id which is unique in the entire system
 /// if USE_CUSTOM_COMPONENT_TYPE_ID is set to 0: generate type_id automatically
@@ -441,20 +621,32 @@ inline void AdvancePointers(T0*& p0, T1*& p1, T2*& p2, T3*& p3, T4*& p4, T5*& p5
 	T5* p5 = (T5*)pBytes[5]; T6* p6 = (T6*)pBytes[6]; T7* p7 = (T7*)pBytes[7]; T8* p8 = (T8*)pBytes[8]; T9* p9 = (T9*)pBytes[9]; 
 
 
+/// the entities given to these two loops are all valid,
+/// empty slots are already skipped by the chunk's occupancy mask
 #define FOR_EACH_ENTITY(f, count, pEntity, ...)			\
 	for (int __i = 0; __i < count; __i++) {				\
-		if (pEntity->mValid)							\
-			f(pEntity, __VA_ARGS__);					\
+		f(pEntity, __VA_ARGS__);						\
 		FastECS::AdvancePointers(pEntity, __VA_ARGS__);	\
 	}
 
 #define FOR_EACH_ENTITY1(pArg, f, count, pEntity, ...)	\
 	for (int __i = 0; __i < count; __i++) {				\
-		if (pEntity->mValid)							\
-			f(pArg, pEntity, __VA_ARGS__);				\
+		f(pArg, pEntity, __VA_ARGS__);					\
 		FastECS::AdvancePointers(pEntity, __VA_ARGS__);	\
 	}
 
+/// get next address that is aligned according to 'alignment' parameter
+inline void* get_next_aligned_address(const void* ptr, size_t alignment)
+{
+	return (void*)(((uintptr_t)ptr + (uintptr_t)(alignment - 1)) / (uintptr_t)alignment * (uintptr_t)alignment);
+}
+
+/// round 'size' up to a multiple of 'alignment', which must be a power of two
+inline size_t align_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) & ~(alignment - 1);
+}
+
 /// if you want to design your own memory-allocate algorithm,
 /// consider defining a class that implements this interface
 class IChunkMemoryAllocator
@@ -463,6 +655,27 @@ public:
 	virtual void* Malloc(size_t sizeBytes) = 0;
 	virtual void* Realloc(void* ptr, std::size_t new_size) = 0;
 	virtual void Free(void* p) = 0;
+
+	/// allocate memory whose address is a multiple of 'alignment', which is a power of two.
+	/// the memory must be released by FreeAligned.
+	/// by default, it allocates extra bytes with Malloc and keeps the original address before the aligned one
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment)
+	{
+		byte* p = (byte*)Malloc(sizeBytes + alignment + sizeof(void*));
+		if (p == nullptr)
+			return nullptr;
+		void* pAligned = get_next_aligned_address(p + sizeof(void*), alignment);
+		reinterpret_cast<void**>(pAligned)[-1] = p;
+		return pAligned;
+	}
+
+	virtual void FreeAligned(void* p)
+	{
+		if (p != nullptr)
+			Free(reinterpret_cast<void**>(p)[-1]);
+	}
+
+	virtual ~IChunkMemoryAllocator() {}
 };
 
 /// default memory allocator, if you don't define your own
@@ -483,155 +696,765 @@ public:
 	{
 		std::free(p);
 	}
-};
-
-/// get next address that is aligned according to 'alignment' parameter
-inline void* get_next_aligned_address(const void* ptr, size_t alignment)
-{
-	return (void*)(((uintptr_t)ptr + (uintptr_t)(alignment - 1)) / (uintptr_t)alignment * (uintptr_t)alignment);
-}
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment) override
+	{
+#if defined(_MSC_VER)
+		return _aligned_malloc(sizeBytes, alignment);
+#else
+		// the size given to aligned_alloc must be a multiple of the alignment
+		return std::aligned_alloc(alignment, GetAlignedAllocationSize(sizeBytes, alignment));
+#endif
+	}
 
-/// check if pointer's address is aligned according to the 'alignment' parameter
-inline bool check_aligned_address(const void* ptr, size_t alignment)
-{
-	return (uintptr_t)ptr % (uintptr_t)alignment == 0;
-}
+	/// the bytes MallocAligned takes from the system for 'sizeBytes'.
+	/// chunks are aligned to at least ENTITY_HANDLE_ALIGNMENT, so even the smallest growing chunk takes that much
+	static size_t GetAlignedAllocationSize(size_t sizeBytes, size_t alignment)
+	{
+#if defined(_MSC_VER)
+		// _aligned_malloc keeps the original address before the aligned one
+		return sizeBytes + alignment - 1 + sizeof(void*);
+#else
+		return align_up(sizeBytes, alignment);
+#endif
+	}
+	virtual void FreeAligned(void* p) override
+	{
+#if defined(_MSC_VER)
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+};
 
-/// check if pointer's address is aligned with respect to the type 'T'
-template<typename T>
-inline bool check_aligned_address(const T* ptr)
+/// ChunkMemoryPool:
+/// World passes all the chunk memory through this pool to the chunk memory allocator.
+/// When it's enabled (see World::EnableChunkMemoryPool), the memory of released chunks is kept in size classes,
+/// and handed to the next chunk whose size falls in the same class, even if it belongs to another archetype.
+/// Sizes are rounded up to a power of two, or to a multiple of 'sizeClassStep' if it isn't zero.
+/// When it's disabled, all the memory goes straight to the allocator.
+class ChunkMemoryPool : public IChunkMemoryAllocator
 {
-	return (uintptr_t)ptr % (uintptr_t)std::alignment_of_v<T> == 0;
-}
+public:
+	struct Stats
+	{
+		size_t		hitCount = 0;			/// chunks served by the pool
+		size_t		missCount = 0;			/// chunks allocated from the allocator while the pool is enabled
+		size_t		pooledBlockCount = 0;	/// blocks waiting in the pool
+		size_t		pooledBytes = 0;		/// bytes of the blocks waiting in the pool
+	};
 
-struct DummyEntityClass {};
+	explicit ChunkMemoryPool(IChunkMemoryAllocator* pAllocator)
+		: m_pAllocator(pAllocator)
+	{
 
-struct EntityClassBase {};
+	}
 
-/// define an entity class by inheriting this one
-/// for example: 
-///		struct S : public EntityClass<A, B, C> {}
-/// A, B, C are all component classes. S is an entity class that includes A, B, C
-/// By this, you can create archetype in a different way
-/// pWorld->CreateArchetype<S>() equals to pWorld->CreateArchetype<A,B,C>();
-template<typename...ComponentTypes>
-struct EntityClass;
+	ChunkMemoryPool(const ChunkMemoryPool&) = delete;
+	ChunkMemoryPool& operator=(const ChunkMemoryPool&) = delete;
 
-template<typename T, typename...U>
-struct EntityClass<T, U...> : public EntityClassBase
-{
-	constexpr static const uint32_t hashCode = sum_component_hashcodes_v<T, U...>;
-	static constexpr uint32_t hash_code() { return hashCode; }
-	using type = T;
-	using next_type = EntityClass<U...>;
-};
+	virtual ~ChunkMemoryPool()
+	{
+		Flush();
+	}
 
-template<>
-struct EntityClass<> : public EntityClassBase
-{
-	constexpr static const uint32_t hashCode = 0;
-	using type = DummyEntityClass;
-	//using next_type = EntityClass<U...>;
-};
+	void Enable(size_t sizeClassStep, size_t maxPooledBytes)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mEnabled = true;
+		mSizeClassStep = sizeClassStep;
+		mMaxPooledBytes = maxPooledBytes;
+	}
 
-class World;
+	// the pooled memory is given back to the allocator
+	void Disable()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mEnabled = false;
+		}
+		Flush();
+	}
 
-using ArchetypeID = uint32_t;
+	bool IsEnabled() const { return mEnabled; }
 
-using ComponentConstructor = std::function<void(void*)>;
-using ComponentDestructor = std::function<void(void*)>;
-using ComponentAssignment = std::function<void(void*, const void*)>;
+	// replace the allocator, the pooled memory is given back to the current one first
+	void SetAllocator(IChunkMemoryAllocator* pAllocator)
+	{
+		Flush();
+		std::lock_guard<std::mutex> lock(mMutex);
+		m_pAllocator = pAllocator;
+	}
 
-/// meta data that describles a component class
-struct ComponentMeta
-{
-	const char*				name;
-	ComponentHash			hashCode;
-	ComponentTypeID			typeId;
-	size_t					size;			/// the component size, which means sizeof(C)
-	size_t					alignment;		/// the component's alignment, calculated by std::alignment
-	ComponentConstructor	constructor = nullptr; /// constructor of component class, which means C();
-	ComponentDestructor		destructor = nullptr; /// destructor of component class, which means ~C();
-	ComponentAssignment		assignment = nullptr; /// assignment operator, which means operator==(); 
-};
+	// give all the pooled memory back to the allocator
+	void Flush()
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		for (auto& it : mPooledBlocks) {
+			for (void* p : it.second) {
+				mBlockKeys.erase(p);
+				m_pAllocator->FreeAligned(p);
+			}
+		}
+		mPooledBlocks.clear();
+		mPooledBytes = 0;
+		mPooledBlockCount = 0;
+		mTrackedBlockCount.store(mBlockKeys.size());
+	}
 
-using ComponentMetaMap = std::map<ComponentTypeID, ComponentMeta*>;
+	virtual void* Malloc(size_t sizeBytes) override
+	{
+		return m_pAllocator->Malloc(sizeBytes);
+	}
+	virtual void* Realloc(void* ptr, std::size_t new_size) override
+	{
+		return m_pAllocator->Realloc(ptr, new_size);
+	}
+	virtual void Free(void* p) override
+	{
+		m_pAllocator->Free(p);
+	}
 
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment) override
+	{
+		if (!mEnabled)
+			return m_pAllocator->MallocAligned(sizeBytes, alignment);
 
-/// Following is three component index tables, 
-/// whose function is to return an index of this table after you give a componentID
+		std::lock_guard<std::mutex> lock(mMutex);
+		BlockKey key(GetSizeClass(sizeBytes), alignment);
+		auto it = mPooledBlocks.find(key);
+		if (it != mPooledBlocks.end() && !it->second.empty()) {
+			void* p = it->second.back();
+			it->second.pop_back();
+			mPooledBytes -= key.first;
+			mPooledBlockCount -= 1;
+			mHitCount += 1;
+			return p;
+		}
 
-/// LinearComponentIndexTable: use sequential array, the search speed is log(n), n is the number of components that the current entity has
-template<int MaxCount> 
-class LinearComponentIndexTable
-{
-public:
-	int Add(ComponentTypeID id) 
-	{
-		auto count = mComponentCount;
-		mComponentTypeIds[mComponentCount++] = id; 
-		return count;
+		// the whole size class is allocated, so the block can serve any size in the class later
+		mMissCount += 1;
+		void* p = m_pAllocator->MallocAligned(key.first, alignment);
+		if (p != nullptr) {
+			mBlockKeys[p] = key;
+			mTrackedBlockCount.store(mBlockKeys.size());
+		}
+		return p;
 	}
-	template<typename T> int Add() { return Add(std::decay_t<T>::type_id()); }
-	int Get(ComponentTypeID id) const
+
+	virtual void FreeAligned(void* p) override
 	{
-		for (int i = 0; i < mComponentCount; i++) {
-			if (mComponentTypeIds[i] == id)
-				return i;
+		if (p == nullptr)
+			return;
+		// nothing has been allocated by the pool
+		if (mTrackedBlockCount.load() == 0) {
+			m_pAllocator->FreeAligned(p);
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mBlockKeys.find(p);
+		if (it == mBlockKeys.end()) {
+			m_pAllocator->FreeAligned(p);
+			return;
+		}
+		const BlockKey& key = it->second;
+		if (mEnabled && mPooledBytes + key.first <= mMaxPooledBytes) {
+			mPooledBlocks[key].push_back(p);
+			mPooledBytes += key.first;
+			mPooledBlockCount += 1;
+		}
+		else {
+			mBlockKeys.erase(it);
+			mTrackedBlockCount.store(mBlockKeys.size());
+			m_pAllocator->FreeAligned(p);
 		}
-		return INVALID_COMPONENT_INDEX;
 	}
-	template<typename T>
-	int Get() const { return Get(std::decay_t<T>::type_id()); }
-private:
-	int					mComponentCount = 0;
-	ComponentTypeID		mComponentTypeIds[MaxCount] = { 0 };
-};
 
-//// HashMapComponentIndexTable: use hashmap as a container, with the same search speed as std::unordered_map
-class HashMapComponentIndexTable
-{
-public:
-	int Add(ComponentTypeID id)
+	Stats GetStats() const
 	{
-		FASTECS_ASSERT(mIndexMap.size() == mComponentCount);
-		FASTECS_ASSERT(mIndexMap.find(id) == mIndexMap.end());
-		auto count = mComponentCount;
-		mIndexMap.insert({ id, mComponentCount });
-		mComponentCount += 1;
-		return count;
+		std::lock_guard<std::mutex> lock(mMutex);
+		Stats stats;
+		stats.hitCount = mHitCount;
+		stats.missCount = mMissCount;
+		stats.pooledBlockCount = mPooledBlockCount;
+		stats.pooledBytes = mPooledBytes;
+		return stats;
 	}
-	template<typename T> int Add() { return Add(std::decay_t<T>::type_id()); }
-	int Get(ComponentTypeID id) const
+
+	// the size class that 'sizeBytes' falls in
+	size_t GetSizeClass(size_t sizeBytes) const
 	{
-		auto it = mIndexMap.find(id);
-		if (it == mIndexMap.end())
-			return INVALID_COMPONENT_INDEX;
-		return it->second;
+		if (mSizeClassStep != 0)
+			return (sizeBytes + mSizeClassStep - 1) / mSizeClassStep * mSizeClassStep;
+		size_t sizeClass = 1;
+		while (sizeClass < sizeBytes)
+			sizeClass <<= 1;
+		return sizeClass;
 	}
-	template<typename T> int Get() const { return Get(std::decay_t<T>::type_id()); }
+
 private:
-	int					mComponentCount = 0;
-	std::unordered_map<ComponentTypeID, int>	mIndexMap;
+	// (size class, alignment) of a block
+	using BlockKey = std::pair<size_t, size_t>;
+
+	IChunkMemoryAllocator*						m_pAllocator;
+	std::atomic<bool>							mEnabled{ false };
+	size_t										mSizeClassStep = 0;
+	size_t										mMaxPooledBytes = 0;
+
+	std::map<BlockKey, std::vector<void*>>		mPooledBlocks;
+	// all the blocks allocated by the pool, in use or pooled
+	std::unordered_map<void*, BlockKey>			mBlockKeys;
+	std::atomic<size_t>							mTrackedBlockCount{ 0 };
+	size_t										mPooledBytes = 0;
+	size_t										mPooledBlockCount = 0;
+	size_t										mHitCount = 0;
+	size_t										mMissCount = 0;
+	mutable std::mutex							mMutex;
 };
 
-// DirectComponentIndexTable: use direct array, the search speed is log(1), but remember to give the component and unique id using DefineComponentWithID
-//	  instead of DefineComponent when you define your own component, and make sure this id doesn't excceed
-//    FASTECS_MAX_COMPONENT_COUNT whose default value is 128.
-template<int MaxCount>
-class DirectComponentIndexTable
+/// Serves chunks out of large arenas, and caches released chunks in the thread that released them,
+/// so the next chunk of the same size allocated by that thread is taken without any lock.
+/// When a thread caches too many blocks of one size, half of them are handed back to a shared pool,
+/// which the other threads refill their caches from. With one context per worker thread,
+/// chunk allocation never contends after warmup.
+/// The blocks cached by a thread that has exited are only reclaimed when the allocator is destroyed.
+/// Each thread's cache is registered with the allocator, which empties them all when it's destroyed;
+/// a thread drops the emptied caches the next time it starts caching for another allocator, or when it exits.
+/// Other allocations, such as the chunk arrays of storages, are served by malloc.
+class ThreadCachingChunkMemoryAllocator : public IChunkMemoryAllocator
 {
 public:
-	DirectComponentIndexTable() 
+	struct Stats
+	{
+		size_t		arenaCount = 0;			/// arenas allocated from the system
+		size_t		arenaBytes = 0;			/// bytes of all the arenas
+		size_t		sharedBlockCount = 0;	/// blocks waiting in the shared pool
+		size_t		threadCacheHits = 0;	/// allocations served by the calling thread's cache, without locking
+		size_t		sharedPoolRefills = 0;	/// allocations that locked the shared pool
+		size_t		surplusBlockCount = 0;	/// blocks handed back to the shared pool by the threads
+		size_t		threadCacheCount = 0;	/// caches registered by the threads, including exited ones not pruned yet
+	};
+
+	explicit ThreadCachingChunkMemoryAllocator(size_t arenaSize = 16 * 1024 * 1024, size_t maxCachedBlockCount = 16)
+		: mArenaSize(arenaSize)
+		, mMaxCachedBlockCount(std::max<size_t>(maxCachedBlockCount, 2))
+		, mAllocatorId(GenAllocatorId())
 	{
-		for (int i = 0; i < MaxCount; i++) {
-			mIndexTable[i] = INVALID_COMPONENT_INDEX;
-		}
+
 	}
-	int Add(ComponentTypeID id)
+
+	ThreadCachingChunkMemoryAllocator(const ThreadCachingChunkMemoryAllocator&) = delete;
+	ThreadCachingChunkMemoryAllocator& operator=(const ThreadCachingChunkMemoryAllocator&) = delete;
+
+	virtual ~ThreadCachingChunkMemoryAllocator()
 	{
-		FASTECS_ASSERT(mIndexTable[id] == INVALID_COMPONENT_INDEX);
-		mIndexTable[id] = mComponentCount;
+		// no thread uses this allocator any more, so their caches can be emptied here
+		for (auto& pCache : mThreadCaches) {
+			pCache->blocks.clear();
+			pCache->bAllocatorDestroyed.store(true, std::memory_order_release);
+		}
+		mThreadCaches.clear();
+		for (byte* pArena : mArenas) {
+			std::free(pArena);
+		}
+	}
+
+	virtual void* Malloc(size_t sizeBytes) override
+	{
+		return std::malloc(sizeBytes);
+	}
+	virtual void* Realloc(void* ptr, std::size_t new_size) override
+	{
+		return std::realloc(ptr, new_size);
+	}
+	virtual void Free(void* p) override
+	{
+		std::free(p);
+	}
+
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment) override
+	{
+		alignment = std::max(alignment, std::alignment_of_v<BlockKey>);
+		BlockKey key(align_up(sizeBytes, alignment), alignment);
+		std::vector<void*>& cachedBlocks = GetThreadCache()[key];
+		if (!cachedBlocks.empty()) {
+			void* p = cachedBlocks.back();
+			cachedBlocks.pop_back();
+			mThreadCacheHits.fetch_add(1, std::memory_order_relaxed);
+			return p;
+		}
+
+		std::lock_guard<std::mutex> lock(mMutex);
+		mSharedPoolRefills.fetch_add(1, std::memory_order_relaxed);
+
+		// take a few blocks from the shared pool, or carve a new one out of the arena
+		std::vector<void*>& sharedBlocks = mSharedBlocks[key];
+		if (!sharedBlocks.empty()) {
+			void* p = sharedBlocks.back();
+			sharedBlocks.pop_back();
+			size_t refillCount = std::min(sharedBlocks.size(), mMaxCachedBlockCount / 2);
+			cachedBlocks.insert(cachedBlocks.end(), sharedBlocks.end() - refillCount, sharedBlocks.end());
+			sharedBlocks.resize(sharedBlocks.size() - refillCount);
+			return p;
+		}
+		return Carve(key);
+	}
+
+	virtual void FreeAligned(void* p) override
+	{
+		if (p == nullptr)
+			return;
+		const BlockKey& key = reinterpret_cast<BlockKey*>(p)[-1];
+		std::vector<void*>& cachedBlocks = GetThreadCache()[key];
+		cachedBlocks.push_back(p);
+		if (cachedBlocks.size() <= mMaxCachedBlockCount)
+			return;
+
+		// hand the surplus back to the shared pool
+		size_t surplusCount = cachedBlocks.size() / 2;
+		std::lock_guard<std::mutex> lock(mMutex);
+		std::vector<void*>& sharedBlocks = mSharedBlocks[key];
+		sharedBlocks.insert(sharedBlocks.end(), cachedBlocks.end() - surplusCount, cachedBlocks.end());
+		cachedBlocks.resize(cachedBlocks.size() - surplusCount);
+		mSurplusBlockCount.fetch_add(surplusCount, std::memory_order_relaxed);
+	}
+
+	Stats GetStats() const
+	{
+		Stats stats;
+		std::lock_guard<std::mutex> lock(mMutex);
+		stats.arenaCount = mArenas.size();
+		stats.arenaBytes = mArenaBytes;
+		for (auto& it : mSharedBlocks) {
+			stats.sharedBlockCount += it.second.size();
+		}
+		stats.threadCacheHits = mThreadCacheHits.load(std::memory_order_relaxed);
+		stats.sharedPoolRefills = mSharedPoolRefills.load(std::memory_order_relaxed);
+		stats.surplusBlockCount = mSurplusBlockCount.load(std::memory_order_relaxed);
+		stats.threadCacheCount = mThreadCaches.size();
+		return stats;
+	}
+
+	// the count of the allocators the calling thread keeps caches for, including destroyed ones not dropped yet
+	static size_t GetCallingThreadCacheCount()
+	{
+		return GetThreadCaches().size();
+	}
+
+private:
+	// (size, alignment) of a block, it's also stored right before each block
+	using BlockKey = std::pair<size_t, size_t>;
+	using BlockCache = std::map<BlockKey, std::vector<void*>>;
+
+	static uint64_t GenAllocatorId()
+	{
+		static std::atomic<uint64_t> sAllocatorId(0);
+		return ++sAllocatorId;
+	}
+
+	// a thread's cache of one allocator, shared by the thread and the allocator's registry
+	struct ThreadCache
+	{
+		BlockCache				blocks;
+		std::atomic<bool>		bAllocatorDestroyed{ false };
+	};
+	using ThreadCaches = std::unordered_map<uint64_t, std::shared_ptr<ThreadCache>>;
+
+	// the caches of the calling thread by allocator id, the ids are never reused
+	static ThreadCaches& GetThreadCaches()
+	{
+		thread_local ThreadCaches tCaches;
+		return tCaches;
+	}
+
+	// the calling thread's cache of this allocator
+	BlockCache& GetThreadCache()
+	{
+		ThreadCaches& caches = GetThreadCaches();
+		auto it = caches.find(mAllocatorId);
+		if (it != caches.end())
+			return it->second->blocks;
+
+		// the first use in this thread, drop the caches of the destroyed allocators
+		for (auto iter = caches.begin(); iter != caches.end();) {
+			if (iter->second->bAllocatorDestroyed.load(std::memory_order_acquire))
+				iter = caches.erase(iter);
+			else
+				++iter;
+		}
+		// and register the new one, dropping the ones of the exited threads
+		std::shared_ptr<ThreadCache> pCache = std::make_shared<ThreadCache>();
+		{
+			std::lock_guard<std::mutex> lock(mMutex);
+			mThreadCaches.erase(std::remove_if(mThreadCaches.begin(), mThreadCaches.end(),
+				[](const std::shared_ptr<ThreadCache>& p) { return p.use_count() == 1; }), mThreadCaches.end());
+			mThreadCaches.push_back(pCache);
+		}
+		caches.emplace(mAllocatorId, pCache);
+		return pCache->blocks;
+	}
+
+	// carve a block out of the current arena, mMutex must be locked
+	void* Carve(const BlockKey& key)
+	{
+		size_t headerSize = align_up(sizeof(BlockKey), key.second);
+		byte* p = mArenaCursor ? (byte*)get_next_aligned_address(mArenaCursor + headerSize, key.second) : nullptr;
+		if (p == nullptr || p + key.first > mArenaEnd) {
+			size_t arenaSize = std::max(mArenaSize, headerSize + key.first + key.second);
+			byte* pArena = (byte*)std::malloc(arenaSize);
+			if (pArena == nullptr)
+				return nullptr;
+			mArenas.push_back(pArena);
+			mArenaBytes += arenaSize;
+			mArenaEnd = pArena + arenaSize;
+			p = (byte*)get_next_aligned_address(pArena + headerSize, key.second);
+		}
+		mArenaCursor = p + key.first;
+		reinterpret_cast<BlockKey*>(p)[-1] = key;
+		return p;
+	}
+
+	size_t									mArenaSize;
+	size_t									mMaxCachedBlockCount;
+	uint64_t								mAllocatorId;
+
+	std::vector<byte*>						mArenas;
+	size_t									mArenaBytes = 0;
+	byte*									mArenaCursor = nullptr;
+	byte*									mArenaEnd = nullptr;
+	BlockCache								mSharedBlocks;
+	// the caches of all the threads that have used this allocator
+	std::vector<std::shared_ptr<ThreadCache>>	mThreadCaches;
+	mutable std::mutex						mMutex;
+
+	std::atomic<size_t>						mThreadCacheHits{ 0 };
+	std::atomic<size_t>						mSharedPoolRefills{ 0 };
+	std::atomic<size_t>						mSurplusBlockCount{ 0 };
+};
+
+#if defined(__linux__)
+/// Linux only: serves chunks out of large mmap regions backed by huge pages,
+/// so that iterating lots of entities causes much less TLB misses.
+/// It tries MAP_HUGETLB first, which needs huge pages reserved by the system (vm.nr_hugepages),
+/// and falls back to normal pages advised with MADV_HUGEPAGE, for transparent huge pages.
+/// The memory of a released chunk is kept for the next chunk of the same size,
+/// the regions are unmapped when the allocator is destroyed.
+/// Other allocations, such as the chunk arrays of storages, are served by malloc.
+class HugePageChunkMemoryAllocator : public IChunkMemoryAllocator
+{
+public:
+	enum { HUGE_PAGE_SIZE = 2 * 1024 * 1024 };
+
+	explicit HugePageChunkMemoryAllocator(size_t regionSize = 32 * HUGE_PAGE_SIZE)
+		: mRegionSize(align_up(regionSize, HUGE_PAGE_SIZE))
+	{
+
+	}
+
+	HugePageChunkMemoryAllocator(const HugePageChunkMemoryAllocator&) = delete;
+	HugePageChunkMemoryAllocator& operator=(const HugePageChunkMemoryAllocator&) = delete;
+
+	virtual ~HugePageChunkMemoryAllocator()
+	{
+		for (Region& region : mRegions) {
+			munmap(region.pBase, region.size);
+		}
+	}
+
+	virtual void* Malloc(size_t sizeBytes) override
+	{
+		return std::malloc(sizeBytes);
+	}
+	virtual void* Realloc(void* ptr, std::size_t new_size) override
+	{
+		return std::realloc(ptr, new_size);
+	}
+	virtual void Free(void* p) override
+	{
+		std::free(p);
+	}
+
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment) override
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		BlockKey key(align_up(sizeBytes, alignment), alignment);
+
+		// reuse a released block with the same size
+		auto it = mFreeBlocks.find(key);
+		if (it != mFreeBlocks.end() && !it->second.empty()) {
+			void* p = it->second.back();
+			it->second.pop_back();
+			return p;
+		}
+
+		// carve it out of the last region, or a new one if there is no enough space
+		if (mRegions.empty() || !CanCarve(mRegions.back(), key.first, alignment)) {
+			if (!MapRegion(std::max<size_t>(mRegionSize, align_up(key.first + alignment, HUGE_PAGE_SIZE))))
+				return nullptr;
+		}
+		Region& region = mRegions.back();
+		byte* p = (byte*)get_next_aligned_address(region.pBase + region.usedSize, alignment);
+		region.usedSize = (size_t)(p - region.pBase) + key.first;
+		mBlockKeys[p] = key;
+		return p;
+	}
+
+	virtual void FreeAligned(void* p) override
+	{
+		if (p == nullptr)
+			return;
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mBlockKeys.find(p);
+		FASTECS_ASSERT(it != mBlockKeys.end());
+		mFreeBlocks[it->second].push_back(p);
+	}
+
+	/// bytes of all the mapped regions
+	size_t GetMappedBytes() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		size_t size = 0;
+		for (const Region& region : mRegions) {
+			size += region.size;
+		}
+		return size;
+	}
+
+	/// if any region is backed by MAP_HUGETLB, rather than transparent huge pages
+	bool IsHugeTLBUsed() const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		return std::any_of(mRegions.begin(), mRegions.end(), [](const Region& region) { return region.bHugeTLB; });
+	}
+
+private:
+	struct Region
+	{
+		byte*		pBase;
+		size_t		size;
+		size_t		usedSize;
+		bool		bHugeTLB;
+	};
+
+	// (size, alignment) of a block
+	using BlockKey = std::pair<size_t, size_t>;
+
+	static bool CanCarve(const Region& region, size_t sizeBytes, size_t alignment)
+	{
+		byte* p = (byte*)get_next_aligned_address(region.pBase + region.usedSize, alignment);
+		return p + sizeBytes <= region.pBase + region.size;
+	}
+
+	bool MapRegion(size_t size)
+	{
+		void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+		p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+		bool bHugeTLB = (p != MAP_FAILED);
+		if (!bHugeTLB) {
+			// map one more huge page, and unmap the parts out of the aligned range,
+			// transparent huge pages only back the ranges aligned to HUGE_PAGE_SIZE
+			byte* pMapped = (byte*)mmap(nullptr, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (pMapped == MAP_FAILED)
+				return false;
+			byte* pAligned = (byte*)get_next_aligned_address(pMapped, HUGE_PAGE_SIZE);
+			if (pAligned > pMapped)
+				munmap(pMapped, pAligned - pMapped);
+			if (pMapped + HUGE_PAGE_SIZE > pAligned)
+				munmap(pAligned + size, pMapped + HUGE_PAGE_SIZE - pAligned);
+#ifdef MADV_HUGEPAGE
+			madvise(pAligned, size, MADV_HUGEPAGE);
+#endif
+			p = pAligned;
+		}
+		mRegions.push_back({ (byte*)p, size, 0, bHugeTLB });
+		return true;
+	}
+
+	size_t										mRegionSize;
+	std::vector<Region>							mRegions;
+	std::map<BlockKey, std::vector<void*>>		mFreeBlocks;
+	std::unordered_map<void*, BlockKey>			mBlockKeys;
+	mutable std::mutex							mMutex;
+};
+#endif
+
+/// return the index of the lowest set bit, 'x' must not be zero
+inline int count_trailing_zeros(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return (int)index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+/// return the count of zero bits above the highest set bit, 'x' must not be zero
+inline int count_leading_zeros(uint64_t x)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return 63 - (int)index;
+#else
+	return __builtin_clzll(x);
+#endif
+}
+
+/// check if pointer's address is aligned according to the 'alignment' parameter
+inline bool check_aligned_address(const void* ptr, size_t alignment)
+{
+	return (uintptr_t)ptr % (uintptr_t)alignment == 0;
+}
+
+/// check if pointer's address is aligned with respect to the type 'T'
+template<typename T>
+inline bool check_aligned_address(const T* ptr)
+{
+	return (uintptr_t)ptr % (uintptr_t)std::alignment_of_v<T> == 0;
+}
+
+struct DummyEntityClass {};
+
+struct EntityClassBase {};
+
+/// define an entity class by inheriting this one
+/// for example: 
+///		struct S : public EntityClass<A, B, C> {}
+/// A, B, C are all component classes. S is an entity class that includes A, B, C
+/// By this, you can create archetype in a different way
+/// pWorld->CreateArchetype<S>() equals to pWorld->CreateArchetype<A,B,C>();
+template<typename...ComponentTypes>
+struct EntityClass;
+
+template<typename T, typename...U>
+struct EntityClass<T, U...> : public EntityClassBase
+{
+	constexpr static const uint32_t hashCode = sum_component_hashcodes_v<T, U...>;
+	static constexpr uint32_t hash_code() { return hashCode; }
+	using type = T;
+	using next_type = EntityClass<U...>;
+};
+
+template<>
+struct EntityClass<> : public EntityClassBase
+{
+	constexpr static const uint32_t hashCode = 0;
+	using type = DummyEntityClass;
+	//using next_type = EntityClass<U...>;
+};
+
+class World;
+
+using ArchetypeID = uint32_t;
+
+using ComponentConstructor = std::function<void(void*)>;
+using ComponentDestructor = std::function<void(void*)>;
+using ComponentAssignment = std::function<void(void*, const void*)>;
+using ComponentMove = std::function<void(void*, void*)>;
+using ComponentEqual = std::function<bool(const void*, const void*)>;
+
+/// meta data that describles a component class
+struct ComponentMeta
+{
+	const char*				name;
+	ComponentHash			hashCode;
+	ComponentTypeID			typeId;
+	size_t					size;			/// the component size, which means sizeof(C)
+	size_t					alignment;		/// the component's alignment, calculated by std::alignment
+	ComponentConstructor	constructor = nullptr; /// constructor of component class, which means C();
+	ComponentDestructor		destructor = nullptr; /// destructor of component class, which means ~C();
+	ComponentAssignment		assignment = nullptr; /// assignment operator, which means operator==(); 
+	ComponentMove			move = nullptr; /// move the component to another place and destroy the source one
+	bool					cold = false;	/// if it's rarely accessed, see is_cold_component
+	bool					tag = false;	/// if it has no data, see is_tag_component
+	bool					shared = false;	/// if it's stored once per chunk, see is_shared_component
+	bool					chunk = false;	/// if it belongs to the chunk, see is_chunk_component
+	size_t					fieldSize = 0;	/// sizeof(lane_field_type), only for lane components
+	ComponentEqual			equal = nullptr; /// operator==(), only for shared components
+};
+
+using ComponentMetaMap = std::map<ComponentTypeID, ComponentMeta*>;
+
+
+/// Following is three component index tables, 
+/// whose function is to return an index of this table after you give a componentID
+
+/// LinearComponentIndexTable: use sequential array, the search speed is log(n), n is the number of components that the current entity has
+template<int MaxCount> 
+class LinearComponentIndexTable
+{
+public:
+	int Add(ComponentTypeID id) 
+	{
+		auto count = mComponentCount;
+		mComponentTypeIds[mComponentCount++] = id; 
+		return count;
+	}
+	template<typename T> int Add() { return Add(std::decay_t<T>::type_id()); }
+	int Get(ComponentTypeID id) const
+	{
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mComponentTypeIds[i] == id)
+				return i;
+		}
+		return INVALID_COMPONENT_INDEX;
+	}
+	template<typename T>
+	int Get() const { return Get(std::decay_t<T>::type_id()); }
+private:
+	int					mComponentCount = 0;
+	ComponentTypeID		mComponentTypeIds[MaxCount] = { 0 };
+};
+
+//// HashMapComponentIndexTable: use hashmap as a container, with the same search speed as std::unordered_map
+class HashMapComponentIndexTable
+{
+public:
+	int Add(ComponentTypeID id)
+	{
+		FASTECS_ASSERT(mIndexMap.size() == mComponentCount);
+		FASTECS_ASSERT(mIndexMap.find(id) == mIndexMap.end());
+		auto count = mComponentCount;
+		mIndexMap.insert({ id, mComponentCount });
+		mComponentCount += 1;
+		return count;
+	}
+	template<typename T> int Add() { return Add(std::decay_t<T>::type_id()); }
+	int Get(ComponentTypeID id) const
+	{
+		auto it = mIndexMap.find(id);
+		if (it == mIndexMap.end())
+			return INVALID_COMPONENT_INDEX;
+		return it->second;
+	}
+	template<typename T> int Get() const { return Get(std::decay_t<T>::type_id()); }
+private:
+	int					mComponentCount = 0;
+	std::unordered_map<ComponentTypeID, int>	mIndexMap;
+};
+
+// DirectComponentIndexTable: use direct array, the search speed is log(1), but remember to give the component and unique id using DefineComponentWithID
+//	  instead of DefineComponent when you define your own component, and make sure this id doesn't excceed
+//    FASTECS_MAX_COMPONENT_COUNT whose default value is 128.
+template<int MaxCount>
+class DirectComponentIndexTable
+{
+public:
+	DirectComponentIndexTable() 
+	{
+		for (int i = 0; i < MaxCount; i++) {
+			mIndexTable[i] = INVALID_COMPONENT_INDEX;
+		}
+	}
+	int Add(ComponentTypeID id)
+	{
+		FASTECS_ASSERT(mIndexTable[id] == INVALID_COMPONENT_INDEX);
+		mIndexTable[id] = mComponentCount;
 		auto count = mComponentCount;
 		mComponentCount += 1;
 		return count;
@@ -687,6 +1510,73 @@ class EntityComponentStorage;
 class EntityContext;
 class EntityComponentChunk;
 
+/// How the entities of an archetype are placed inside their storages
+enum class EntityStorageMode
+{
+	/// a released entity leaves a hole in its chunk, which is reused by the next new entity
+	Default,
+	/// a released entity is replaced by the last entity of the storage,
+	/// so that all the chunks except the last one are always full.
+	/// NOTE: an Entity pointer of this archetype may be invalid after any other entity is released,
+	/// store EntityID instead, which keeps pointing to the moved entity.
+	Packed,
+	/// a new entity is put in the fullest chunk that isn't full, so the entities gather in as few chunks as possible,
+	/// and the chunks left empty are released without defragmenting the storage.
+	/// not for the archetypes with shared components, which choose chunks by their values
+	FullestFirst,
+};
+
+/// How many entities are put in each chunk of a storage.
+/// Set it on World for all the archetypes, or on an archetype to override it.
+/// The count is never larger than MAX_ENTITY_COUNT_PER_CHUNK, since the block index is encoded in EntityID,
+/// and a storage can't have more than MAX_CHUNK_COUNT_PER_STORAGE chunks, so small chunks mean less entities per storage.
+struct ChunkSizePolicy
+{
+	enum class Type
+	{
+		Bytes,			/// each chunk is no larger than 'value' bytes
+		EntityCount,	/// each chunk has 'value' entities
+	};
+
+	Type		type = Type::Bytes;
+	size_t		value = MAX_STORAGE_CHUNK_SIZE;
+	/// if not 0, the first chunk of a storage has this many entities, and each next chunk twice as many
+	/// until they reach the size given above, so a rarely used archetype takes little memory
+	size_t		firstChunkEntityCount = 0;
+
+	/// chunks are no larger than 'bytes', e.g. 16 KB for L1 residency
+	static ChunkSizePolicy Bytes(size_t bytes)
+	{
+		ChunkSizePolicy policy;
+		policy.type = Type::Bytes;
+		policy.value = bytes;
+		return policy;
+	}
+
+	/// chunks take 'fraction' of a cache of 'cacheBytes', e.g. a quarter of L2
+	static ChunkSizePolicy CacheFraction(size_t cacheBytes, float fraction)
+	{
+		return Bytes((size_t)(cacheBytes * fraction));
+	}
+
+	/// each chunk has 'count' entities
+	static ChunkSizePolicy EntityCount(size_t count)
+	{
+		ChunkSizePolicy policy;
+		policy.type = Type::EntityCount;
+		policy.value = count;
+		return policy;
+	}
+
+	/// the same policy, but the chunks of a storage grow geometrically from 'firstCount' entities
+	ChunkSizePolicy Growing(size_t firstCount = DEFAULT_FIRST_CHUNK_ENTITY_COUNT) const
+	{
+		ChunkSizePolicy policy = *this;
+		policy.firstChunkEntityCount = firstCount;
+		return policy;
+	}
+};
+
 /// EntityArchetype:
 /// defines an entity class that contains a specific list of components
 /// Entities that contain the same component classes belong to the same EntityArchetype
@@ -704,7 +1594,6 @@ public:
 	{
 		mComponentCount = (int)metaMap.size();
 		int i = 0;
-		size_t currentOffset = 0;
 		for (auto it : metaMap) 
 		{
 			ComponentMeta* meta = it.second;
@@ -713,16 +1602,24 @@ public:
 			mComponentTypeIds[i] = meta->typeId;
 			mComponentSizes[i] = meta->size;
 			mComponentAlignments[i] = meta->alignment;
-			mComponentOffsets[i] = currentOffset;
 
 			mComponentConstructors[i] = &meta->constructor;
 			mComponentDestructors[i] = &meta->destructor;
 			mComponentAssignments[i] = &meta->assignment;
+			mComponentMoves[i] = &meta->move;
+			mComponentColds[i] = meta->cold;
+			mComponentTags[i] = meta->tag;
+			mComponentShareds[i] = meta->shared;
+			mComponentChunks[i] = meta->chunk;
+			mComponentFieldSizes[i] = meta->fieldSize;
+			mComponentEquals[i] = &meta->equal;
+			if (meta->shared)
+				mSharedComponentCount += 1;
 
 			mComponentIndexTable.Add(meta->typeId);
-			currentOffset += meta->size;
 			i += 1;
 		}
+		UpdateRowLayout();
 	}
 
 	EntityArchetype(const EntityArchetype&) = delete;
@@ -746,6 +1643,17 @@ public:
 		return ContainComponentsHelperClass<ComponentTypes...>::Any(mComponentIndexTable);
 	}
 
+	/// if ForEach, ForEachBatch and ParallelJob visit this archetype when iterating ComponentTypes:
+	/// it has all of them and none of them is laid out in lanes, the laned ones have no address per entity
+	/// and are only iterated by EntityContext::ForEachLaneGroup, see SetLaneWidth
+	template<typename... ComponentTypes>
+	bool CanIterateComponents() const
+	{
+		if (!ContainAllComponents<ComponentTypes...>())
+			return false;
+		return mLaneWidth == 0 || (!mComponentLaned[GetComponentIndex<std::decay_t<ComponentTypes>>()] && ...);
+	}
+
 	/// Get an index that indicates the component's position in this archetype
 	template<typename ComponentType>
 	int GetComponentIndex() const
@@ -753,15 +1661,128 @@ public:
 		return mComponentIndexTable.Get<ComponentType>();
 	}
 
-	/// Get an index that indicates the component's position in this archetype
-	int GetComponentIndex(ComponentTypeID componentTypeID) const
+	/// Get an index that indicates the component's position in this archetype
+	int GetComponentIndex(ComponentTypeID componentTypeID) const
+	{
+		return mComponentIndexTable.Get(componentTypeID);
+	}
+
+	ArchetypeID GetID() const {
+		return mArchetypeId;
+	}
+
+	/// Set how the entities of this archetype are placed in the storages.
+	/// must be called before any entity of this archetype is created
+	void SetStorageMode(EntityStorageMode mode)
+	{
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		mStorageMode = mode;
+	}
+
+	EntityStorageMode GetStorageMode() const { return mStorageMode; }
+
+	/// Override the chunk size policy of World for this archetype.
+	/// must be called before any entity of this archetype is created
+	void SetChunkSizePolicy(const ChunkSizePolicy& policy)
+	{
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		mChunkSizePolicy = policy;
+		mHasChunkSizePolicy = true;
+	}
+
+	/// Use the chunk size policy of World again
+	void ResetChunkSizePolicy()
+	{
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		mHasChunkSizePolicy = false;
+	}
+
+	/// return null if the archetype uses the policy of World
+	const ChunkSizePolicy* GetChunkSizePolicy() const { return mHasChunkSizePolicy ? &mChunkSizePolicy : nullptr; }
+
+	/// Mark a component as cold (or hot) in this archetype only, overriding is_cold_component.
+	/// Cold components are put in a separate memory block of each chunk, 
+	/// so that more entities fit in a chunk and iterating the hot components never touches them.
+	/// must be called before any entity of this archetype is created
+	template<typename ComponentType>
+	void SetComponentCold(bool bCold = true)
+	{
+		SetComponentCold(ComponentType::type_id(), bCold);
+	}
+
+	void SetComponentCold(ComponentTypeID componentTypeID, bool bCold = true)
+	{
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		int index = GetComponentIndex(componentTypeID);
+		FASTECS_ASSERT(index != INVALID_COMPONENT_INDEX);
+		mComponentColds[index] = bCold;
+		UpdateRowLayout();
+	}
+
+	template<typename ComponentType>
+	bool IsComponentCold() const
+	{
+		int index = GetComponentIndex<ComponentType>();
+		return index != INVALID_COMPONENT_INDEX && mComponentColds[index];
+	}
+
+	/// if the component at 'index' is a tag, which has no data and no lifecycle calls
+	bool IsComponentTag(int index) const { return mComponentTags[index]; }
+
+	/// if the component at 'index' is stored once per chunk, see is_shared_component
+	bool IsComponentShared(int index) const { return mComponentShareds[index]; }
+
+	int GetSharedComponentCount() const { return mSharedComponentCount; }
+
+	/// if the component at 'index' belongs to the chunk, see is_chunk_component
+	bool IsChunkComponent(int index) const { return mComponentChunks[index]; }
+
+	/// lay out the lane components of this archetype field by field in groups of 'laneWidth' entities (AoSoA),
+	/// 'laneWidth' can be 4, 8 or 16, or 0 to store them as usual. see is_lane_component.
+	/// the laned components are then skipped by ForEach, ForEachBatch and ParallelJob, and GetComponent returns null
+	/// for them, they are iterated by EntityContext::ForEachLaneGroup and read by Entity::LoadComponent.
+	/// call it before any entity of the archetype is created
+	void SetLaneWidth(int laneWidth)
+	{
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		FASTECS_ASSERT(laneWidth == 0 || laneWidth == 4 || laneWidth == 8 || laneWidth == 16);
+		mLaneWidth = laneWidth;
+		for (int i = 0; i < mComponentCount; i++)
+			mComponentLaned[i] = (laneWidth > 0 && mComponentFieldSizes[i] > 0);
+		UpdateRowLayout();
+	}
+
+	int GetLaneWidth() const { return mLaneWidth; }
+
+	/// if the component at 'index' is laid out in lanes, see SetLaneWidth
+	bool IsComponentLaned(int index) const { return mComponentLaned[index]; }
+
+	/// lay out the hot components of this archetype row by row (AoS) instead of column by column,
+	/// so all the components of an entity are next to each other, which suits the archetypes
+	/// mostly accessed by EntityID on many components at once.
+	/// ForEach still works but calls back one entity at a time, and ForEachBatch gets batches of one entity.
+	/// cold and laned components keep their own columns.
+	/// call it before any entity of the archetype is created
+	void SetRowLayout(bool bRowLayout = true)
 	{
-		return mComponentIndexTable.Get(componentTypeID);
+		FASTECS_ASSERT(std::all_of(mStoragesInContext, mStoragesInContext + MAX_CONTEXT_COUNT,
+			[](EntityComponentStorage* pStorage) { return pStorage == nullptr; }));
+		mRowLayout = bRowLayout;
+		UpdateRowLayout();
 	}
 
-	ArchetypeID GetID() const {
-		return mArchetypeId;
-	}
+	bool IsRowLayout() const { return mRowLayout; }
+
+	/// if the component at 'index' is in the row of its entity, see SetRowLayout
+	bool IsComponentInRow(int index) const { return mComponentRowed[index]; }
+
+	/// bytes of the row of an entity, 0 if there is no row
+	size_t GetRowSize() const { return mRowSize; }
 
 	/// Extend an existing archetype with a list of component types
 	/// to create a new archtype
@@ -769,6 +1790,32 @@ public:
 	inline EntityArchetype* Extend();
 
 private:
+	// place the components in a row and update the strides, whenever what goes in the row changes
+	void UpdateRowLayout()
+	{
+		size_t rowOffset = 0;
+		mRowAlignment = 1;
+		for (int i = 0; i < mComponentCount; i++)
+		{
+			// tags, shared and chunk components have no data in the blocks
+			bool bData = !(mComponentTags[i] || mComponentShareds[i] || mComponentChunks[i]);
+			mComponentStrides[i] = bData ? mComponentSizes[i] : 0;
+			mComponentRowed[i] = mRowLayout && bData && !mComponentColds[i] && !mComponentLaned[i];
+			mComponentOffsets[i] = 0;
+			if (!mComponentRowed[i])
+				continue;
+			rowOffset = align_up(rowOffset, mComponentAlignments[i]);
+			mComponentOffsets[i] = rowOffset;
+			rowOffset += mComponentSizes[i];
+			mRowAlignment = std::max(mRowAlignment, mComponentAlignments[i]);
+		}
+		mRowSize = align_up(rowOffset, mRowAlignment);
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mComponentRowed[i])
+				mComponentStrides[i] = mRowSize;
+		}
+	}
+
 	EntityArchetypeManager*		mArchetypeManager = nullptr;
 	ArchetypeID			mArchetypeId = 0;
 	ComponentMetaMap	mComponentMetaMap;
@@ -778,11 +1825,31 @@ private:
 	ComponentTypeID		mComponentHashes[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
 	ComponentHash		mComponentTypeIds[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
 	size_t				mComponentSizes[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	size_t				mComponentStrides[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 }; /// distance between the values of two blocks
 	size_t				mComponentAlignments[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
-	size_t				mComponentOffsets[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	size_t				mComponentOffsets[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 }; /// offset in the row, see SetRowLayout
 	ComponentConstructor*	mComponentConstructors[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
 	ComponentDestructor*	mComponentDestructors[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
 	ComponentAssignment*	mComponentAssignments[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	ComponentMove*			mComponentMoves[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mComponentColds[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mComponentTags[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mComponentShareds[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mComponentChunks[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	size_t				mComponentFieldSizes[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mComponentLaned[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	int					mLaneWidth = 0;
+	bool				mComponentRowed[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	bool				mRowLayout = false;
+	size_t				mRowSize = 0;
+	size_t				mRowAlignment = 1;
+	ComponentEqual*		mComponentEquals[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	int					mSharedComponentCount = 0;
+
+	EntityStorageMode	mStorageMode = EntityStorageMode::Default;
+
+	ChunkSizePolicy		mChunkSizePolicy;
+	bool				mHasChunkSizePolicy = false;
 
 	ComponentIndexTable	mComponentIndexTable;
 
@@ -883,6 +1950,15 @@ public:
 		meta->typeId = ComponentType::type_id();;
 		meta->size = sizeof(ComponentType);
 		meta->alignment = std::alignment_of<ComponentType>::value;
+		meta->cold = is_cold_component<ComponentType>::value;
+		meta->tag = is_tag_component<ComponentType>::value;
+		meta->shared = is_shared_component<ComponentType>::value;
+		meta->chunk = is_chunk_component<ComponentType>::value;
+		if constexpr (is_lane_component<ComponentType>::value)
+			meta->fieldSize = sizeof(lane_field_t<ComponentType>);
+		static_assert(!(is_shared_component<ComponentType>::value && is_chunk_component<ComponentType>::value),
+			"a component can't be both shared and a chunk component");
+		static_assert(!is_sparse_component<ComponentType>::value, "a sparse component can't be part of an archetype");
 		meta->constructor = [](void* pMem) {
 			new (pMem) ComponentType();
 		};
@@ -895,6 +1971,16 @@ public:
 			const ComponentType* pSrcComponent = reinterpret_cast<const ComponentType*>(pSrc);
 			new (pDst) ComponentType(*pSrcComponent);
 		};
+		meta->move = [](void* pDst, void* pSrc) {
+			ComponentType* pSrcComponent = reinterpret_cast<ComponentType*>(pSrc);
+			new (pDst) ComponentType(std::move(*pSrcComponent));
+			pSrcComponent->~ComponentType();
+		};
+		if constexpr (is_shared_component<ComponentType>::value) {
+			meta->equal = [](const void* pA, const void* pB) {
+				return *reinterpret_cast<const ComponentType*>(pA) == *reinterpret_cast<const ComponentType*>(pB);
+			};
+		}
 
 		mComponentMetas.insert({ hashcode, meta });
 		return meta;
@@ -1057,26 +2143,33 @@ inline EntityArchetype* EntityArchetype::Extend()
 	return mArchetypeManager->AddComponents<ComponentTypes...>(this);
 }
 
-using EntityID = uint64_t;
+// if genId 'a' is newer than 'b', the wrap-around of GEN_ID_BITS is handled
+inline bool is_newer_gen_id(EntityGenID a, EntityGenID b)
+{
+	uint64_t distance = ((uint64_t)a - (uint64_t)b) & GEN_ID_MASK;
+	return distance != 0 && distance <= (GEN_ID_MASK >> 1);
+}
 
+/// Entity:
+/// a handle of the entity in a block of a chunk, it holds no data itself.
+/// The handles of a chunk sit right after a pointer to the chunk, at the beginning of the chunk memory,
+/// which is aligned to ENTITY_HANDLE_ALIGNMENT. So a handle finds its chunk by clearing the low bits of its address,
+/// and its block index from its offset. The generation ids are kept in their own column of the chunk,
+/// and the validity is the block's bit in the occupancy mask.
 class Entity
 {
 	friend class EntityComponentChunk;
 	friend class EntityComponentStorage;
 	friend class EntityContext;
 public:
-	Entity() : mValid(false), mGenID(0)
-	{
-
-	}
+	Entity() = default;
+	Entity(const Entity&) = delete;
+	Entity& operator=(const Entity&) = delete;
 
 	// check if two entity objects are the same
 	bool operator==(const Entity& ent) const
 	{
-		return mChunkIndex == ent.mChunkIndex
-			&& mBlockIndex == ent.mBlockIndex
-			&& mGenID == ent.mGenID
-			&& mStorage == ent.mStorage;
+		return this == &ent;
 	}
 
 	// Get EntityID of this entity.
@@ -1086,15 +2179,19 @@ public:
 
 	inline EntityContext* GetContext();
 
-	inline static void ParseEntityID(EntityID eid, uint16_t* genid, 
+	inline static void ParseEntityID(EntityID eid, EntityGenID* genid, 
 		uint8_t* contextId, uint16_t* storageIndex,
 		uint16_t* chunkIndex, uint16_t* blockIndex);
 
 	inline static uint8_t ExtractContextIdFromEntityID(EntityID eid);
 
+	inline static EntityID ComposeEntityID(EntityGenID genid, uint8_t contextId,
+		uint16_t storageIndex, uint16_t chunkIndex, uint16_t blockIndex);
+
 	inline void Release();
-	bool IsValid() const { return mValid; }
+	inline bool IsValid() const;
 
+	// null if the entity doesn't have the component, or if it's laid out in lanes, see LoadComponent
 	template<typename ComponentType>
 	inline ComponentType* GetComponent();
 
@@ -1130,6 +2227,42 @@ public:
 	template<typename ComponentType>
 	inline bool SetComponent(ComponentType&& component);
 
+	// copy the value of a lane component into 'pValue', it works whether the component is laid out in lanes or not.
+	// return false if the entity doesn't have the component. see is_lane_component
+	template<typename ComponentType>
+	inline bool LoadComponent(ComponentType* pValue) const;
+
+	// give the entity a sparse component constructed from 'args', or replace the one it has, see is_sparse_component.
+	// the entity stays where it is. the pointer returned is invalid after another one of ComponentType is added or removed
+	template<typename ComponentType, typename...Args>
+	inline ComponentType* AddSparseComponent(Args&&... args);
+
+	// return false if the entity doesn't have the sparse component
+	template<typename ComponentType>
+	inline bool RemoveSparseComponent();
+
+	// exclude the entity from ForEach, ForEachBatch, ParallelJob and the other iterations, or include it again.
+	// a single bit of its chunk is written, the entity isn't moved and is still valid and found by its EntityID.
+	// it's kept when the entity is cloned, extended or moved. not to be called while other threads are iterating its chunk
+	inline void SetEnabled(bool bEnabled);
+	inline bool IsEnabled() const;
+
+	// exclude the entity from the iterations over ComponentType only, or include it again, like SetEnabled.
+	// return false if the entity doesn't have the component
+	template<typename ComponentType>
+	inline bool SetEnabled(bool bEnabled);
+
+	// false if the entity doesn't have the component or it's disabled, whether the entity itself is enabled or not
+	template<typename ComponentType>
+	inline bool IsEnabled() const;
+
+	// change the value of a shared component, see is_shared_component.
+	// the entity is moved into a chunk holding the new value, the EntityID isn't changed.
+	// return the entity at its new place, or null if it doesn't have the component
+	// or the value needs a new chunk and the storage is full (the entity is left unchanged then)
+	template<typename ComponentType>
+	inline Entity* SetSharedComponent(const ComponentType& component);
+
 	inline EntityArchetype* GetArchetype();
 	inline const EntityArchetype* GetArchetype() const;
 
@@ -1155,15 +2288,45 @@ public:
 	template<typename...ComponentTypes>
 	inline Entity* Remove() const;
 
+	// add components to current entity, which moves it to the archetype with them, like SetSharedComponent.
+	// current entity is released, and the entity is returned at its new place, or null if it has the components already.
+	// with stable EntityIDs (see EntityContext::EnableStableEntityIDs) the EntityID isn't changed, 
+	// otherwise the returned entity has a new one
+	template<typename...ComponentTypes>
+	inline Entity* AddComponents(ComponentTypes&&... args);
+
+	template<typename...ComponentTypes>
+	inline Entity* AddComponents();
+
+	// remove components from current entity, which moves it to the archetype without them, see AddComponents
+	template<typename...ComponentTypes>
+	inline Entity* RemoveComponents();
+
 
 private:
-	bool					mValid;
-	uint16_t				mGenID; // an 16 bit id generated automatically, to do validation check
-	uint16_t				mChunkIndex = 0; // the chunkIndex inside a storage
-	uint16_t				mBlockIndex = 0; // block index inside a chunk
-	EntityComponentStorage*	mStorage = nullptr;
+	// all of them are derived from the address of the handle
+	inline EntityComponentChunk* GetChunk() const;
+	inline uint16_t GetBlockIndex() const;
+	inline uint16_t GetChunkIndex() const; // the chunkIndex inside a storage
+	inline EntityGenID GetGenID() const; // an id of GEN_ID_BITS generated automatically, to do validation check
+	inline EntityComponentStorage* GetStorage() const;
 };
 
+static_assert(sizeof(Entity) == 1, "an entity handle must be a single byte");
+
+/// the handles of a chunk start after the pointer to the chunk
+enum { ENTITY_HANDLES_OFFSET = sizeof(void*) };
+
+/// the smallest power of two that holds the pointer to the chunk and all the handles
+constexpr size_t CalculateEntityHandleAlignment()
+{
+	size_t alignment = 1;
+	while (alignment < ENTITY_HANDLES_OFFSET + sizeof(Entity) * MAX_ENTITY_COUNT_PER_CHUNK)
+		alignment <<= 1;
+	return alignment;
+}
+enum { ENTITY_HANDLE_ALIGNMENT = CalculateEntityHandleAlignment() };
+
 
 template<typename...ComponentTypes>
 struct GetComponentIndexesHelperClass;
@@ -1184,42 +2347,92 @@ struct GetComponentIndexesHelperClass<>
 	static void Call(EntityArchetype* pArchetype, int* indexArray, int currentIndex) {}
 };
 
+/// ChunkLayout:
+/// where each part of a chunk is placed, all the offsets are relative to the chunk memory,
+/// except the cold components', which are relative to the cold memory.
+/// Both memory blocks are allocated with 'alignment'
+struct ChunkLayout
+{
+	size_t		blockCount = 0;
+	size_t		alignment = ENTITY_HANDLE_ALIGNMENT;
+	size_t		occupancyMaskOffset = 0;
+	size_t		enabledMasksOffset = 0;
+	size_t		freeListOffset = 0;
+	size_t		genIdsOffset = 0;
+	size_t		idSlotsOffset = 0;	/// 0 if the context doesn't use stable EntityIDs, see EntityIDTable
+	size_t		componentOffsets[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	size_t		chunkSize = 0;		/// bytes of the chunk memory, including all the padding
+	size_t		coldChunkSize = 0;	/// bytes of the cold components' memory, 0 if there is no cold component
+};
+
 /// EntityComponentChunk:
 /// is a chunk of memory that contains N entities with (components)
 /// Memory Layout:
+/// pointer to the chunk | entity1 | entity2 | ...... | entity N | (one byte handles, see Entity)
+/// OccupancyMask (one bit per block)
+/// EnabledMasks (one bit per block, for the entity and each component, see Entity::SetEnabled)
 /// FreeList
-/// entity1 | entity2 | ...... | entity N |
+/// genId1 | genId2 | ...... | genId N |
+/// idSlot1 | idSlot2 | ...... | idSlot N | (only with stable EntityIDs)
 /// component1 | component1 | ...... | component1 |
 /// component2 | component2 | ...... | component2 |
+/// or, if the archetype is laid out in rows (see EntityArchetype::SetRowLayout):
+/// component1 component2 | component1 component2 | ...... | component1 component2 |
+/// the generation ids and each component column start at a cache line, see ChunkLayout
 class EntityComponentChunk
 {
 public:
 	EntityComponentChunk(uint16_t chunkId, EntityComponentStorage* pStorage, 
 		EntityArchetype* pArchetype,
-		size_t n, size_t chunkSize)
+		const ChunkLayout* pLayout, EntityGenID genBase)
 		: mChunkId(chunkId)
 		, mEntityComponentStorage(pStorage)
 		, mArchetype(pArchetype)
-		, mBlockCount((uint16_t)n)
-		, mChunkSize(chunkSize)
+		, mBlockCount((uint16_t)pLayout->blockCount)
+		, mLayout(pLayout)
 		, mComponentCount((int)pArchetype->mComponentCount)
 		, mUsedCount(0)
+		, mHighWaterMark(0)
+		, mGenBase(genBase)
+	{
+		AllocateMemory();
+	}
+
+	// allocate the memory of a new chunk, or a chunk whose memory has been released
+	void AllocateMemory()
 	{
-		//mMem = (byte*)malloc(mBlockCount * mBlockSize);
-		void* pMem = GetMemoryAllocator()->Malloc(mChunkSize);
+		FASTECS_ASSERT(mMem == nullptr);
+		mMem = (byte*)GetMemoryAllocator()->MallocAligned(mLayout->chunkSize, mLayout->alignment);
+		FASTECS_ASSERT(check_aligned_address(mMem, ENTITY_HANDLE_ALIGNMENT));
+
+		// the handles find this chunk through the pointer before them
+		*reinterpret_cast<EntityComponentChunk**>(mMem) = this;
+		mEntitiesBuffer = reinterpret_cast<Entity*>(mMem + ENTITY_HANDLES_OFFSET);
+
+		// all the blocks are empty at first
+		mOccupancyMask = reinterpret_cast<std::atomic<uint64_t>*>(mMem + mLayout->occupancyMaskOffset);
+		for (size_t i = 0; i < CalculateOccupancyMaskSize(mBlockCount) / sizeof(uint64_t); i++)
+			new (&mOccupancyMask[i]) std::atomic<uint64_t>(0);
 
-		mFreeList = reinterpret_cast<uint16_t*>(pMem);
-		//mEntitiesBuffer = reinterpret_cast<Entity*>(mFreeList + mBlockCount);
-		void* pEntityBufferAddress = get_next_aligned_address(mFreeList + mBlockCount, std::alignment_of_v<Entity>);
-		mEntitiesBuffer = reinterpret_cast<Entity*>(pEntityBufferAddress);
+		// and everything is enabled
+		mEnabledMasks = reinterpret_cast<uint64_t*>(mMem + mLayout->enabledMasksOffset);
+		memset(mEnabledMasks, 0xFF, CalculateOccupancyMaskSize(mBlockCount) * (mComponentCount + 1));
+		mDisabledBitCount = 0;
 
-		//mComponentsBuffer = reinterpret_cast<byte*>(mEntitiesBuffer + mBlockCount);
-		byte* pComponentBufferAddress = (byte*)(mEntitiesBuffer + mBlockCount);
+		mFreeList = reinterpret_cast<uint16_t*>(mMem + mLayout->freeListOffset);
+		mGenIDs = reinterpret_cast<EntityGenID*>(mMem + mLayout->genIdsOffset);
+		mIDSlots = (mLayout->idSlotsOffset != 0) ? reinterpret_cast<uint32_t*>(mMem + mLayout->idSlotsOffset) : nullptr;
+
+		// cold components are in their own memory block
+		if (mLayout->coldChunkSize > 0)
+			mColdMem = (byte*)GetMemoryAllocator()->MallocAligned(mLayout->coldChunkSize, mLayout->alignment);
 		for (int i = 0; i < mComponentCount; i++) {
-			size_t componentAlignment = pArchetype->mComponentAlignments[i];
-			size_t componentSize = pArchetype->mComponentSizes[i];
-			mComponentBuffers[i] = (byte*)get_next_aligned_address(pComponentBufferAddress, componentAlignment);
-			pComponentBufferAddress = mComponentBuffers[i] + mBlockCount * componentSize;
+			byte* pMem = mArchetype->mComponentColds[i] ? mColdMem : mMem;
+			if (mArchetype->mComponentShareds[i] || mArchetype->mComponentChunks[i])
+				pMem = mMem;
+			mComponentBuffers[i] = mArchetype->mComponentTags[i] ? sTagMemory : pMem + mLayout->componentOffsets[i];
+			if (mArchetype->mComponentChunks[i])
+				(*mArchetype->mComponentConstructors[i])(mComponentBuffers[i]);
 		}
 
 		// init free list
@@ -1229,14 +2442,57 @@ public:
 		mFreeHead = 0;
 		mFreeTail = mBlockCount;
 
+		// the generation ids continue from the ones used before the memory was released,
+		// so the EntityIDs given out before are never resolved to new entities
+		for (uint16_t i = 0; i < mBlockCount; i++) {
+			mGenIDs[i] = mGenBase;
+		}
+	}
+
+	// give the memory of an empty chunk back to the allocator, the chunk itself is kept
+	void ReleaseMemory()
+	{
+		FASTECS_ASSERT(IsEmpty() && mMem != nullptr);
+		DestructSharedComponents();
+		DestructChunkComponents();
+		mGenBase = GetNextGenBase();
+		GetMemoryAllocator()->FreeAligned(mMem);
+		if (mColdMem)
+			GetMemoryAllocator()->FreeAligned(mColdMem);
+		mMem = nullptr;
+		mColdMem = nullptr;
+		mOccupancyMask = nullptr;
+		mEnabledMasks = nullptr;
+		mFreeList = nullptr;
+		mEntitiesBuffer = nullptr;
+		mGenIDs = nullptr;
+		mIDSlots = nullptr;
+		memset(mComponentBuffers, 0, sizeof(mComponentBuffers));
+	}
+
+	// if the memory has been given back to the allocator
+	bool IsMemoryReleased() const { return mMem == nullptr; }
+
+	// the memory of the entities and hot components
+	const byte* GetMemory() const { return mMem; }
+
+	// how many entities the chunk holds, see ChunkSizePolicy::Growing
+	uint16_t GetBlockCount() const { return mBlockCount; }
+
+	// bytes of the chunk memory
+	size_t GetMemorySize() const { return mLayout->chunkSize; }
+
+	// a generation id greater than all the ones used in this chunk
+	EntityGenID GetNextGenBase() const
+	{
+		if (mMem == nullptr)
+			return mGenBase;
+		EntityGenID genBase = mGenBase;
 		for (uint16_t i = 0; i < mBlockCount; i++) {
-			Entity* pEntity = &mEntitiesBuffer[i];
-			pEntity->mValid = false;
-			pEntity->mGenID = 0;
-			pEntity->mBlockIndex = i;
-			pEntity->mChunkIndex = mChunkId;
-			pEntity->mStorage = mEntityComponentStorage;
+			if (is_newer_gen_id(mGenIDs[i], genBase))
+				genBase = mGenIDs[i];
 		}
+		return genBase;
 	}
 
 	inline IChunkMemoryAllocator* GetMemoryAllocator();
@@ -1247,9 +2503,12 @@ public:
 		uint16_t head = mFreeHead;
 		mFreeHead = mFreeList[head];
 		Entity* pEntity = &mEntitiesBuffer[head];
-		pEntity->mValid = true;
-		pEntity->mGenID = (pEntity->mGenID + 1) & 0x0000FFFF; // mGenID just has 16 bits
-		FASTECS_ASSERT(pEntity->mBlockIndex == head);
+		IncreaseGenID(head);
+		FASTECS_ASSERT(pEntity->GetBlockIndex() == head);
+		// publish the block after its generation id, for GetEntity on other threads
+		SetOccupancyWord(head >> 6, GetOccupancyWord(head >> 6) | (1ull << (head & 63)), std::memory_order_release);
+		if (head >= mHighWaterMark)
+			mHighWaterMark = head + 1;
 		// construct components
 		if (bCallConstruct)
 			ConstructComponents(pEntity);
@@ -1261,6 +2520,12 @@ public:
 	void ConstructComponents(Entity* pEntity)
 	{
 		for (int i = 0; i < mComponentCount; i++) {
+			if (mArchetype->mComponentStrides[i] == 0)
+				continue;
+			if (mArchetype->mComponentLaned[i]) {
+				ConstructLaneComponent(pEntity, i);
+				continue;
+			}
 			byte* pMem = GetComponentByIndex(pEntity, i);
 			ComponentConstructor* constructor = mArchetype->mComponentConstructors[i];
 			(*constructor)(pMem);
@@ -1271,25 +2536,158 @@ public:
 	// bCallDestructor: if need to call its components' destructors
 	void Deallocate(Entity* pEntity, bool bCallDestructor)
 	{
-		FASTECS_ASSERT(pEntity->mChunkIndex == mChunkId);
+		FASTECS_ASSERT(pEntity->GetChunk() == this);
 		if (bCallDestructor)
 			DestructComponents(pEntity);
-		mFreeList[pEntity->mBlockIndex] = mFreeHead;
-		mFreeHead = pEntity->mBlockIndex;
-		pEntity->mValid = false;
+		uint16_t blockIndex = pEntity->GetBlockIndex();
+		ResetEnabledBits(blockIndex);
+		mFreeList[blockIndex] = mFreeHead;
+		mFreeHead = blockIndex;
+		SetOccupancyWord(blockIndex >> 6, GetOccupancyWord(blockIndex >> 6) & ~(1ull << (blockIndex & 63)), std::memory_order_relaxed);
 		mUsedCount--;
+
+		// the last used block is released, search downwards for the new one
+		if (blockIndex + 1 == mHighWaterMark)
+		{
+			int word = blockIndex >> 6;
+			while (word >= 0 && GetOccupancyWord(word) == 0)
+				word--;
+			mHighWaterMark = (word < 0) ? 0 : (uint16_t)((word << 6) + 64 - count_leading_zeros(GetOccupancyWord(word)));
+		}
 	}
 
 	// Destroy an entity by calling its components' destructors.
 	void DestructComponents(Entity* pEntity)
 	{
 		for (int i = 0; i < mComponentCount; i++) {
+			// lane components are trivially destructible
+			if (mArchetype->mComponentStrides[i] == 0 || mArchetype->mComponentLaned[i])
+				continue;
 			byte* pMem = GetComponentByIndex(pEntity, i);
 			ComponentDestructor* destructor = mArchetype->mComponentDestructors[i];
 			(*destructor)(pMem);
 		}
 	}
 
+	// point values[i] to the value of each shared component in this chunk, others are set to null
+	void GetSharedComponents(const void* values[]) const
+	{
+		for (int i = 0; i < mComponentCount; i++)
+			values[i] = mArchetype->mComponentShareds[i] ? mComponentBuffers[i] : nullptr;
+	}
+
+	// if the shared components of this chunk equal to 'values', indexed by component index
+	bool MatchSharedComponents(const void* const values[]) const
+	{
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mArchetype->mComponentShareds[i] && !(*mArchetype->mComponentEquals[i])(mComponentBuffers[i], values[i]))
+				return false;
+		}
+		return true;
+	}
+
+	// copy 'values' into the shared components of this empty chunk, the old ones are destroyed
+	void SetSharedComponents(const void* const values[])
+	{
+		FASTECS_ASSERT(IsEmpty() && mMem != nullptr);
+		DestructSharedComponents();
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mArchetype->mComponentShareds[i])
+				(*mArchetype->mComponentAssignments[i])(mComponentBuffers[i], values[i]);
+		}
+		mHasSharedComponents = true;
+	}
+
+	void DestructSharedComponents()
+	{
+		if (!mHasSharedComponents)
+			return;
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mArchetype->mComponentShareds[i])
+				(*mArchetype->mComponentDestructors[i])(mComponentBuffers[i]);
+		}
+		mHasSharedComponents = false;
+	}
+
+	// the chunk components are constructed with the memory, and destroyed before it's released
+	void DestructChunkComponents()
+	{
+		for (int i = 0; i < mComponentCount; i++) {
+			if (mArchetype->mComponentChunks[i])
+				(*mArchetype->mComponentDestructors[i])(mComponentBuffers[i]);
+		}
+	}
+
+	// the value of a chunk component of this chunk, null if the archetype doesn't have it
+	template<typename ComponentType>
+	ComponentType* GetChunkComponent()
+	{
+		static_assert(is_chunk_component<ComponentType>::value, "not a chunk component");
+		int index = mArchetype->GetComponentIndex<ComponentType>();
+		if (index == INVALID_COMPONENT_INDEX)
+			return nullptr;
+		return reinterpret_cast<ComponentType*>(mComponentBuffers[index]);
+	}
+
+	template<typename ComponentType>
+	const ComponentType* GetChunkComponent() const
+	{
+		return const_cast<EntityComponentChunk*>(this)->GetChunkComponent<ComponentType>();
+	}
+
+	// the first block of the group of lanes 'blockIndex' is in, for the laned component at 'index'
+	byte* GetLaneGroup(int index, int blockIndex) const
+	{
+		size_t laneWidth = (size_t)mArchetype->mLaneWidth;
+		return mComponentBuffers[index] + (blockIndex / laneWidth) * laneWidth * mArchetype->mComponentSizes[index];
+	}
+
+	// copy the value of a lane component out of the block, whether it's laid out in lanes or not
+	void LoadLaneComponent(uint16_t blockIndex, int index, void* pValue) const
+	{
+		size_t size = mArchetype->mComponentSizes[index];
+		if (!mArchetype->mComponentLaned[index]) {
+			memcpy(pValue, mComponentBuffers[index] + blockIndex * mArchetype->mComponentStrides[index], size);
+			return;
+		}
+		size_t fieldSize = mArchetype->mComponentFieldSizes[index];
+		size_t laneWidth = (size_t)mArchetype->mLaneWidth;
+		const byte* pField = GetLaneGroup(index, blockIndex) + (blockIndex % laneWidth) * fieldSize;
+		for (size_t offset = 0; offset < size; offset += fieldSize, pField += laneWidth * fieldSize)
+			memcpy((byte*)pValue + offset, pField, fieldSize);
+	}
+
+	// copy the value of a lane component into the block, whether it's laid out in lanes or not
+	void StoreLaneComponent(uint16_t blockIndex, int index, const void* pValue)
+	{
+		size_t size = mArchetype->mComponentSizes[index];
+		if (!mArchetype->mComponentLaned[index]) {
+			memcpy(mComponentBuffers[index] + blockIndex * mArchetype->mComponentStrides[index], pValue, size);
+			return;
+		}
+		size_t fieldSize = mArchetype->mComponentFieldSizes[index];
+		size_t laneWidth = (size_t)mArchetype->mLaneWidth;
+		byte* pField = GetLaneGroup(index, blockIndex) + (blockIndex % laneWidth) * fieldSize;
+		for (size_t offset = 0; offset < size; offset += fieldSize, pField += laneWidth * fieldSize)
+			memcpy(pField, (const byte*)pValue + offset, fieldSize);
+	}
+
+	// give the laned component at 'index' its default value
+	void ConstructLaneComponent(Entity* pEntity, int index)
+	{
+		alignas(CACHE_LINE_SIZE) byte value[MAX_LANE_COMPONENT_SIZE];
+		(*mArchetype->mComponentConstructors[index])(value);
+		StoreLaneComponent(pEntity->GetBlockIndex(), index, value);
+	}
+
+	// copy a lane component from another entity, either of them can be laid out in lanes
+	void CopyLaneComponent(Entity* pDstEntity, int dstIndex, const Entity* pSrcEntity, int srcIndex)
+	{
+		alignas(CACHE_LINE_SIZE) byte value[MAX_LANE_COMPONENT_SIZE];
+		pSrcEntity->GetChunk()->LoadLaneComponent(pSrcEntity->GetBlockIndex(), srcIndex, value);
+		StoreLaneComponent(pDstEntity->GetBlockIndex(), dstIndex, value);
+	}
+
 	// if there is no empty space
 	bool IsFull() const 
 	{
@@ -1302,27 +2700,294 @@ public:
 		return &mEntitiesBuffer[blockIndex];
 	}
 
-	static size_t CalculateBlockSize(EntityArchetype* pArchetype)
+	// if the block holds a valid entity.
+	// the occupancy words are atomic, since GetEntity reads them on other threads while this chunk allocates
+	bool IsOccupied(uint16_t blockIndex) const
+	{
+		return mOccupancyMask != nullptr 
+			&& (mOccupancyMask[blockIndex >> 6].load(std::memory_order_acquire) & (1ull << (blockIndex & 63))) != 0;
+	}
+
+	// a word of the occupancy mask, only for the thread that owns this chunk
+	uint64_t GetOccupancyWord(int word) const
+	{
+		return mOccupancyMask[word].load(std::memory_order_relaxed);
+	}
+
+	void SetOccupancyWord(int word, uint64_t bits, std::memory_order order)
+	{
+		mOccupancyMask[word].store(bits, order);
+	}
+
+	// the enabled mask of the entities (maskIndex 0) or of the component at 'maskIndex - 1', 
+	// one bit for each block, set if the entity or its component is enabled
+	uint64_t* GetEnabledMask(int maskIndex) const
+	{
+		return mEnabledMasks + maskIndex * ((mBlockCount + 63) >> 6);
+	}
+
+	bool IsEnabled(uint16_t blockIndex, int maskIndex) const
+	{
+		return (GetEnabledMask(maskIndex)[blockIndex >> 6] & (1ull << (blockIndex & 63))) != 0;
+	}
+
+	// a single bit is flipped, and the count of disabled bits tells the iterations if the masks must be read at all
+	void SetEnabled(uint16_t blockIndex, int maskIndex, bool bEnabled)
+	{
+		uint64_t& word = GetEnabledMask(maskIndex)[blockIndex >> 6];
+		uint64_t bit = 1ull << (blockIndex & 63);
+		if (((word & bit) != 0) == bEnabled)
+			return;
+		word ^= bit;
+		if (bEnabled)
+			mDisabledBitCount--;
+		else
+			mDisabledBitCount++;
+	}
+
+	// enable the entity in the block and all of its components, before the block is released
+	void ResetEnabledBits(uint16_t blockIndex)
+	{
+		for (int i = 0; mDisabledBitCount > 0 && i <= mComponentCount; i++)
+			SetEnabled(blockIndex, i, true);
+	}
+
+	// copy the enabled bits of an entity in a chunk of the same archetype
+	void CopyEnabledBits(uint16_t dstBlockIndex, const EntityComponentChunk* pSrcChunk, uint16_t srcBlockIndex)
+	{
+		if (mDisabledBitCount == 0 && pSrcChunk->mDisabledBitCount == 0)
+			return;
+		for (int i = 0; i <= mComponentCount; i++)
+			SetEnabled(dstBlockIndex, i, pSrcChunk->IsEnabled(srcBlockIndex, i));
+	}
+
+	EntityGenID GetGenID(uint16_t blockIndex) const { return mGenIDs[blockIndex]; }
+
+	// the EntityIDs given out for this block before are never resolved again
+	void IncreaseGenID(uint16_t blockIndex)
+	{
+		mGenIDs[blockIndex] = (EntityGenID)((mGenIDs[blockIndex] + 1) & GEN_ID_MASK); // genId just has GEN_ID_BITS
+	}
+
+	// the slot in the EntityIDTable of the entity in the block
+	uint32_t GetIDSlot(uint16_t blockIndex) const { return mIDSlots[blockIndex]; }
+	void SetIDSlot(uint16_t blockIndex, uint32_t slot) { mIDSlots[blockIndex] = slot; }
+
+	uint16_t GetChunkId() const { return mChunkId; }
+
+	EntityComponentStorage* GetStorage() const { return mEntityComponentStorage; }
+
+	// bIDSlots: if the blocks keep their slots in the EntityIDTable
+	static size_t CalculateBlockSize(EntityArchetype* pArchetype, bool bIDSlots = false)
 	{
 		int n = (int)pArchetype->mComponentCount;
 		size_t blockSize = 0;
 		blockSize += sizeof(uint16_t); // freeList
-		blockSize += sizeof(Entity); // entity
-		// all components
+		blockSize += sizeof(Entity); // entity handle
+		blockSize += sizeof(EntityGenID); // genId
+		if (bIDSlots)
+			blockSize += sizeof(uint32_t); // idSlot
+		// all hot components
+		blockSize += pArchetype->mRowSize;
 		for (int i = 0; i < n; i++) {
-			blockSize += pArchetype->mComponentSizes[i];
+			if (!pArchetype->mComponentColds[i] && !pArchetype->mComponentRowed[i])
+				blockSize += pArchetype->mComponentStrides[i];
 		}
 		return blockSize;
 	}
 
+	// calculate where each part is placed in a chunk with 'blockCount' blocks
+	static void CalculateLayout(EntityArchetype* pArchetype, size_t blockCount, ChunkLayout* pLayout, bool bIDSlots = false)
+	{
+		int n = (int)pArchetype->mComponentCount;
+		pLayout->blockCount = blockCount;
+		pLayout->alignment = std::max<size_t>(CACHE_LINE_SIZE, ENTITY_HANDLE_ALIGNMENT);
+		for (int i = 0; i < n; i++) {
+			pLayout->alignment = std::max(pLayout->alignment, pArchetype->mComponentAlignments[i]);
+		}
+
+		size_t offset = ENTITY_HANDLES_OFFSET + sizeof(Entity) * blockCount;
+		offset = align_up(offset, alignof(uint64_t));
+		pLayout->occupancyMaskOffset = offset;
+		offset += CalculateOccupancyMaskSize(blockCount);
+		pLayout->enabledMasksOffset = offset;
+		offset += CalculateOccupancyMaskSize(blockCount) * (n + 1);
+		pLayout->freeListOffset = offset;
+		offset += sizeof(uint16_t) * blockCount;
+		offset = align_up(offset, CACHE_LINE_SIZE);
+		pLayout->genIdsOffset = offset;
+		offset += sizeof(EntityGenID) * blockCount;
+		pLayout->idSlotsOffset = 0;
+		if (bIDSlots) {
+			offset = align_up(offset, alignof(uint32_t));
+			pLayout->idSlotsOffset = offset;
+			offset += sizeof(uint32_t) * blockCount;
+		}
+
+		// the rows of the components laid out row by row, see EntityArchetype::SetRowLayout
+		size_t rowsOffset = 0;
+		if (pArchetype->mRowSize > 0) {
+			offset = align_up(offset, std::max<size_t>(CACHE_LINE_SIZE, pArchetype->mRowAlignment));
+			rowsOffset = offset;
+			offset += pArchetype->mRowSize * blockCount;
+		}
+
+		size_t coldOffset = 0;
+		for (int i = 0; i < n; i++) {
+			pLayout->componentOffsets[i] = 0;
+			if (pArchetype->mComponentStrides[i] == 0)
+				continue;
+			if (pArchetype->mComponentRowed[i]) {
+				pLayout->componentOffsets[i] = rowsOffset + pArchetype->mComponentOffsets[i];
+				continue;
+			}
+			size_t& currentOffset = pArchetype->mComponentColds[i] ? coldOffset : offset;
+			size_t columnAlignment = std::max<size_t>(CACHE_LINE_SIZE, pArchetype->mComponentAlignments[i]);
+			size_t columnBlockCount = blockCount;
+			// a laned column holds whole groups, and each field of a group is aligned as a vector
+			if (pArchetype->mComponentLaned[i]) {
+				columnAlignment = std::max<size_t>(columnAlignment, pArchetype->mComponentFieldSizes[i] * pArchetype->mLaneWidth);
+				columnBlockCount = align_up(blockCount, (size_t)pArchetype->mLaneWidth);
+			}
+			currentOffset = align_up(currentOffset, columnAlignment);
+			pLayout->componentOffsets[i] = currentOffset;
+			currentOffset += pArchetype->mComponentSizes[i] * columnBlockCount;
+		}
+
+		// a single value of each shared or chunk component, after all the columns
+		for (int i = 0; i < n; i++) {
+			if (!pArchetype->mComponentShareds[i] && !pArchetype->mComponentChunks[i])
+				continue;
+			offset = align_up(offset, pArchetype->mComponentAlignments[i]);
+			pLayout->componentOffsets[i] = offset;
+			offset += pArchetype->mComponentSizes[i];
+		}
+		pLayout->chunkSize = offset;
+		pLayout->coldChunkSize = coldOffset;
+	}
+
+	// bytes of the occupancy mask for a chunk with 'blockCount' blocks
+	static size_t CalculateOccupancyMaskSize(size_t blockCount)
+	{
+		return (blockCount + 63) / 64 * sizeof(uint64_t);
+	}
+
+	// one past the last used block, blocks after it are all empty
+	int GetHighWaterMark() const { return mHighWaterMark; }
+
+	// the count of valid entities in this chunk
+	int GetUsedCount() const { return mUsedCount; }
+
+	// call g(rangeStart, rangeEnd) for each run of consecutive valid entities in [startBlockIndex, endBlockIndex)
+	// empty 64-block words are skipped as a whole, and the search stops at the high-water mark
+	template<typename G>
+	void ForEachOccupiedRange(int startBlockIndex, int endBlockIndex, G&& g)
+	{
+		ForEachSetRange([this](int word) { return GetOccupancyWord(word); }, startBlockIndex, endBlockIndex, std::forward<G>(g));
+	}
+
+	// like ForEachOccupiedRange, but the blocks are the bits set in 'getWord(word)', which are a subset of the occupancy mask
+	template<typename W, typename G>
+	void ForEachSetRange(W&& getWord, int startBlockIndex, int endBlockIndex, G&& g)
+	{
+		if (endBlockIndex > mHighWaterMark)
+			endBlockIndex = mHighWaterMark;
+
+		int blockIndex = startBlockIndex;
+		while (blockIndex < endBlockIndex)
+		{
+			int word = blockIndex >> 6;
+			uint64_t bits = getWord(word) & (~0ull << (blockIndex & 63));
+			if (bits == 0) {
+				blockIndex = (word + 1) << 6;
+				continue;
+			}
+			int rangeStart = (word << 6) + count_trailing_zeros(bits);
+			if (rangeStart >= endBlockIndex)
+				break;
+
+			// find the first empty block after rangeStart, full words are crossed directly
+			uint64_t holes = ~bits & (~0ull << (rangeStart & 63));
+			while (holes == 0 && ((word + 1) << 6) < endBlockIndex) {
+				word += 1;
+				holes = ~getWord(word);
+			}
+			int rangeEnd = (holes == 0) ? ((word + 1) << 6) : ((word << 6) + count_trailing_zeros(holes));
+			if (rangeEnd > endBlockIndex)
+				rangeEnd = endBlockIndex;
+
+			g(rangeStart, rangeEnd);
+			blockIndex = rangeEnd;
+		}
+	}
+
+	// like ForEachOccupiedRange, but the given components are arrays over each run passed to g,
+	// so the runs are split into single entities if any of the components is in a row, see EntityArchetype::SetRowLayout.
+	// the disabled entities and the ones with any of the components disabled are skipped, see Entity::SetEnabled
+	template<typename G>
+	void ForEachArrayRange(const int* componentIndexes, int n, int startBlockIndex, int endBlockIndex, G&& g)
+	{
+		bool bRowed = false;
+		for (int i = 0; i < n; i++)
+			bRowed |= mArchetype->mComponentRowed[componentIndexes[i]];
+		const uint64_t* masks[MAX_COMPONENT_COUNT_PER_ENTITY + 1];
+		int maskCount = GetEnabledMasks(componentIndexes, n, masks);
+		if (!bRowed && maskCount == 0) {
+			ForEachOccupiedRange(startBlockIndex, endBlockIndex, std::forward<G>(g));
+			return;
+		}
+		auto getWord = [&](int word) { return GetEnabledWord(masks, maskCount, word); };
+		ForEachSetRange(getWord, startBlockIndex, endBlockIndex, [&](int rangeStart, int rangeEnd) {
+			if (!bRowed) {
+				g(rangeStart, rangeEnd);
+				return;
+			}
+			for (int blockIndex = rangeStart; blockIndex < rangeEnd; blockIndex++)
+				g(blockIndex, blockIndex + 1);
+		});
+	}
+
+	// the enabled masks an iteration over the given components must read, none if nothing is disabled in this chunk
+	int GetEnabledMasks(const int* componentIndexes, int n, const uint64_t* masks[]) const
+	{
+		if (mDisabledBitCount == 0)
+			return 0;
+		masks[0] = GetEnabledMask(0);
+		for (int i = 0; i < n; i++)
+			masks[i + 1] = GetEnabledMask(componentIndexes[i] + 1);
+		return n + 1;
+	}
+
+	// a word of the occupancy mask without the blocks disabled in 'masks'
+	uint64_t GetEnabledWord(const uint64_t* const masks[], int maskCount, int word) const
+	{
+		uint64_t bits = GetOccupancyWord(word);
+		for (int i = 0; i < maskCount; i++)
+			bits &= masks[i][word];
+		return bits;
+	}
+
+	// get the start addresses of the given components at 'blockIndex'
+	void GetComponentsBytes(const int* componentIndexes, int n, int blockIndex, byte* componentsBytes[])
+	{
+		for (int i = 0; i < n; i++) {
+			int index = componentIndexes[i];
+			// the laned ones can only be iterated by ForEachLaneGroup
+			FASTECS_ASSERT(!mArchetype->mComponentLaned[index]);
+			size_t componentStride = mArchetype->mComponentStrides[index];
+			componentsBytes[i] = mComponentBuffers[index] + blockIndex * componentStride;
+		}
+	}
+
+	// null for a component laid out in lanes, whose value must be read by Entity::LoadComponent
 	template<typename ComponentType>
 	ComponentType* GetComponent(Entity* pEntity)
 	{
 		int index = mArchetype->GetComponentIndex<ComponentType>();
-		if (index == INVALID_COMPONENT_INDEX)
+		if (index == INVALID_COMPONENT_INDEX || mArchetype->mComponentLaned[index])
 			return nullptr;
-		size_t size = mArchetype->mComponentSizes[index];
-		auto pComponent = reinterpret_cast<ComponentType*>(mComponentBuffers[index] + (size * pEntity->mBlockIndex));
+		size_t stride = mArchetype->mComponentStrides[index];
+		auto pComponent = reinterpret_cast<ComponentType*>(mComponentBuffers[index] + (stride * pEntity->GetBlockIndex()));
 		FASTECS_ASSERT(check_aligned_address(pComponent));
 		return pComponent;
 	}
@@ -1331,10 +2996,10 @@ public:
 	const ComponentType* GetComponent(const Entity* pEntity) const
 	{
 		int index = mArchetype->GetComponentIndex<ComponentType>();
-		if (index == INVALID_COMPONENT_INDEX)
+		if (index == INVALID_COMPONENT_INDEX || mArchetype->mComponentLaned[index])
 			return nullptr;
-		size_t size = mArchetype->mComponentSizes[index];
-		auto pComponent = reinterpret_cast<const ComponentType*>(mComponentBuffers[index] + (size * pEntity->mBlockIndex));
+		size_t stride = mArchetype->mComponentStrides[index];
+		auto pComponent = reinterpret_cast<const ComponentType*>(mComponentBuffers[index] + (stride * pEntity->GetBlockIndex()));
 		FASTECS_ASSERT(check_aligned_address(pComponent));
 		return pComponent;
 	}
@@ -1342,9 +3007,9 @@ public:
 	template<typename T = byte>
 	T* GetComponentByIndex(Entity* pEntity, int index)
 	{
-		FASTECS_ASSERT(index < mComponentCount);
-		size_t size = mArchetype->mComponentSizes[index];
-		T* pComponent = reinterpret_cast<T*>(mComponentBuffers[index] + (size * pEntity->mBlockIndex));
+		FASTECS_ASSERT(index < mComponentCount && !mArchetype->mComponentLaned[index]);
+		size_t stride = mArchetype->mComponentStrides[index];
+		T* pComponent = reinterpret_cast<T*>(mComponentBuffers[index] + (stride * pEntity->GetBlockIndex()));
 		FASTECS_ASSERT(check_aligned_address(pComponent, mArchetype->mComponentAlignments[index]));
 		return pComponent;
 	}
@@ -1352,9 +3017,9 @@ public:
 	template<typename T = byte>
 	const T* GetComponentByIndex(const Entity* pEntity, int index) const
 	{
-		FASTECS_ASSERT(index < mComponentCount);
-		size_t size = mArchetype->mComponentSizes[index];
-		const T* pComponent = reinterpret_cast<const T*>(mComponentBuffers[index] + (size * pEntity->mBlockIndex));
+		FASTECS_ASSERT(index < mComponentCount && !mArchetype->mComponentLaned[index]);
+		size_t stride = mArchetype->mComponentStrides[index];
+		const T* pComponent = reinterpret_cast<const T*>(mComponentBuffers[index] + (stride * pEntity->GetBlockIndex()));
 		FASTECS_ASSERT(check_aligned_address(pComponent, mArchetype->mComponentAlignments[index]));
 		return pComponent;
 	}
@@ -1566,9 +3231,7 @@ public:
 		GetComponentsTupleHelperClass<ComponentTuple, 2, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
 
 		for (int i = 0; i < count; i++) {
-			if (pEntity->IsValid()) {
-				std::apply(std::forward<F>(f), componentTuple);
-			}
+			std::apply(std::forward<F>(f), componentTuple);
 			AdvanceComponentsTuple<2, n + 1>(componentTuple);
 			pEntity++;
 			std::get<1>(componentTuple) = pEntity;
@@ -1585,9 +3248,7 @@ public:
 		GetComponentsTupleHelperClass<ComponentTuple, 1, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
 
 		for (int i = 0; i < count; i++) {
-			if (pEntity->IsValid()) {
-				std::apply(std::forward<F>(f), componentTuple);
-			}
+			std::apply(std::forward<F>(f), componentTuple);
 			AdvanceComponentsTuple<1, n>(componentTuple);
 			pEntity++;
 			std::get<0>(componentTuple) = pEntity;
@@ -1597,223 +3258,210 @@ public:
 	template<typename...ComponentTypes, typename F, typename RuntimeArg>
 	void ForEach(F&& f, RuntimeArg* pArg, int startBlockIndex, int endBlockIndex)
 	{
-		//using ComponentTuple = std::tuple<RuntimeArg*, Entity*, std::decay_t<ComponentTypes>*...>;
 		constexpr int n = sizeof...(ComponentTypes);
 		int componentIndexes[n];
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
-		Entity* pEntity = &mEntitiesBuffer[startBlockIndex];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			size_t componentSize = mArchetype->mComponentSizes[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset + startBlockIndex * componentSize;
-			componentsBytes[i] = mComponentBuffers[index] + startBlockIndex * componentSize;
-		}
-
-		if constexpr (n <= 10)
-		{
-			_DoForEach<ComponentTypes...>(std::forward<F>(f), pArg, endBlockIndex - startBlockIndex, pEntity, componentsBytes);
-		}
-		else
-		{
-			_DoForEach_WithTooManyComponents< ComponentTypes...>(std::forward<F>(f), pArg, endBlockIndex - startBlockIndex, pEntity, componentsBytes);
-		}
+		ForEachInRange<ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes, startBlockIndex, endBlockIndex);
 	}
 
 	template<typename...ComponentTypes, typename F>
 	void ForEach(F&& f, int startBlockIndex, int endBlockIndex)
 	{
-		//using ComponentTuple = std::tuple<Entity*, std::decay_t<ComponentTypes>*...>;
 		constexpr int n = sizeof...(ComponentTypes);
 		int componentIndexes[n];
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
-		Entity* pEntity = &mEntitiesBuffer[startBlockIndex];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			size_t componentSize = mArchetype->mComponentSizes[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset + startBlockIndex * componentSize;
-			componentsBytes[i] = mComponentBuffers[index] + startBlockIndex * componentSize;
-		}
-
-		if constexpr (n <= 10)
-		{
-			_DoForEach<ComponentTypes...>(std::forward<F>(f), endBlockIndex - startBlockIndex, pEntity, componentsBytes);
-		}
-		else
-		{
-			_DoForEach_WithTooManyComponents< ComponentTypes...>(std::forward<F>(f), endBlockIndex - startBlockIndex, pEntity, componentsBytes);
-		}
+		ForEachInRange<ComponentTypes...>(std::forward<F>(f), componentIndexes, startBlockIndex, endBlockIndex);
 	}
 
-	template<typename F, typename...ComponentTypes>
-	void ForEach(F&& f, int* componentIndexes)
-	{
-		//using ComponentTuple = std::tuple<Entity*, std::decay_t<ComponentTypes>*...>;
-		constexpr int n = sizeof...(ComponentTypes);
-		Entity* pEntity = &mEntitiesBuffer[0];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset;
-			componentsBytes[i] = mComponentBuffers[index];
-		}
-
-		if constexpr (n <= 10)
-		{
-			_DoForEach<ComponentTypes...>(std::forward<F>(f), mBlockCount, pEntity, componentsBytes);
-		}
-		else
-		{
-			_DoForEach_WithTooManyComponents< ComponentTypes...>(std::forward<F>(f), mBlockCount, pEntity, componentsBytes);
-		}
+	template<typename F, typename...ComponentTypes>
+	void ForEach(F&& f, int* componentIndexes)
+	{
+		ForEachInRange<ComponentTypes...>(std::forward<F>(f), componentIndexes, 0, mHighWaterMark);
 	}
 
 	template<typename F, typename RuntimeArg, typename...ComponentTypes>
 	void ForEach(F&& f, RuntimeArg* pArg, int* componentIndexes)
 	{
-		//using ComponentTuple = std::tuple<Entity*, std::decay_t<ComponentTypes>*...>;
-		constexpr int n = sizeof...(ComponentTypes);
-		Entity* pEntity = &mEntitiesBuffer[0];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset;
-			componentsBytes[i] = mComponentBuffers[index];
-		}
-
-		if constexpr (n <= 10)
-		{
-			_DoForEach<ComponentTypes...>(std::forward<F>(f), pArg, mBlockCount, pEntity, componentsBytes);
-		}
-		else
-		{
-			_DoForEach_WithTooManyComponents< ComponentTypes...>(std::forward<F>(f), pArg, mBlockCount, pEntity, componentsBytes);
-		}
+		ForEachInRange<ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes, 0, mHighWaterMark);
 	}
 
 	template<typename F, typename...ComponentTypes>
 	void ForEachBatch(F&& f, int* componentIndexes)
 	{
-		using ComponentTuple = std::tuple<Entity*, int, std::decay_t<ComponentTypes> *...>;
-		constexpr int n = sizeof...(ComponentTypes);
-		Entity* pEntity = &mEntitiesBuffer[0];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset;
-			componentsBytes[i] = mComponentBuffers[index];
-		}
-
-		ComponentTuple componentTuple;
-		std::get<0>(componentTuple) = pEntity;
-		std::get<1>(componentTuple) = mBlockCount;
-		GetComponentsTupleHelperClass<ComponentTuple, 2, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
-		std::apply(std::forward<F>(f), componentTuple);
+		ForEachBatchInRange<ComponentTypes...>(std::forward<F>(f), componentIndexes, 0, mHighWaterMark);
 	}
 
 	template<typename F, typename RuntimeArg, typename...ComponentTypes>
 	void ForEachBatch(F&& f, RuntimeArg* pArg, int* componentIndexes)
 	{
-		using ComponentTuple = std::tuple<RuntimeArg*, Entity*, int, std::decay_t<ComponentTypes> *...>;
-		constexpr int n = sizeof...(ComponentTypes);
-		Entity* pEntity = &mEntitiesBuffer[0];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset;
-			componentsBytes[i] = mComponentBuffers[index];
-		}
-
-		ComponentTuple componentTuple;
-		std::get<0>(componentTuple) = pArg;
-		std::get<1>(componentTuple) = pEntity;
-		std::get<2>(componentTuple) = mBlockCount;
-		GetComponentsTupleHelperClass<ComponentTuple, 3, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
-		std::apply(std::forward<F>(f), componentTuple);
+		ForEachBatchInRange<ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes, 0, mHighWaterMark);
 	}
 
 	template<typename...ComponentTypes, typename F>
 	void ForEachBatch(F&& f, int startBlockIndex, int endBlockIndex)
 	{
-		using ComponentTuple = std::tuple<Entity*, int, std::decay_t<ComponentTypes>*...>;
 		constexpr int n = sizeof...(ComponentTypes);
 		int componentIndexes[n];
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
-		Entity* pEntity = &mEntitiesBuffer[startBlockIndex];
-
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			size_t componentSize = mArchetype->mComponentSizes[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset + startBlockIndex * componentSize;
-			componentsBytes[i] = mComponentBuffers[index] + startBlockIndex * componentSize;
-		}
-
-		ComponentTuple componentTuple;
-		std::get<0>(componentTuple) = pEntity;
-		std::get<1>(componentTuple) = endBlockIndex - startBlockIndex;
-		GetComponentsTupleHelperClass<ComponentTuple, 2, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
-		std::apply(std::forward<F>(f), componentTuple);
+		ForEachBatchInRange<ComponentTypes...>(std::forward<F>(f), componentIndexes, startBlockIndex, endBlockIndex);
 	}
 
 	template<typename...ComponentTypes, typename F, typename RuntimeArg>
 	void ForEachBatch(F&& f, RuntimeArg* pArg, int startBlockIndex, int endBlockIndex)
 	{
-		using ComponentTuple = std::tuple<RuntimeArg*, Entity*, int, std::decay_t<ComponentTypes> *...>;
 		constexpr int n = sizeof...(ComponentTypes);
 		int componentIndexes[n];
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
-		Entity* pEntity = &mEntitiesBuffer[startBlockIndex];
+		ForEachBatchInRange<ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes, startBlockIndex, endBlockIndex);
+	}
 
-		byte* componentsBytes[n] = { 0 };
-		for (int i = 0; i < n; i++) {
-			int index = componentIndexes[i];
-			//size_t offset = mArchetype->mComponentOffsets[index];
-			size_t componentSize = mArchetype->mComponentSizes[index];
-			//componentsBytes[i] = mComponentsBuffer + mBlockCount * offset + startBlockIndex * componentSize;
-			componentsBytes[i] = mComponentBuffers[index] + startBlockIndex * componentSize;
+private:
+	// call 'f' for each valid entity in [startBlockIndex, endBlockIndex)
+	template<typename...ComponentTypes, typename F>
+	void ForEachInRange(F&& f, const int* componentIndexes, int startBlockIndex, int endBlockIndex)
+	{
+		static_assert(!any_shared_component_v<ComponentTypes...> && !any_chunk_component_v<ComponentTypes...>,
+			"shared and chunk components can only be iterated by ForEachBatch");
+		static_assert(!any_sparse_component_v<ComponentTypes...>, "sparse components can only be iterated by EntityContext::ForEach");
+		constexpr int n = sizeof...(ComponentTypes);
+		ForEachArrayRange(componentIndexes, n, startBlockIndex, endBlockIndex, [&](int rangeStart, int rangeEnd) {
+			Entity* pEntity = &mEntitiesBuffer[rangeStart];
+			byte* componentsBytes[n] = { 0 };
+			GetComponentsBytes(componentIndexes, n, rangeStart, componentsBytes);
+
+			if constexpr (n <= 10)
+			{
+				_DoForEach<ComponentTypes...>(f, rangeEnd - rangeStart, pEntity, componentsBytes);
+			}
+			else
+			{
+				_DoForEach_WithTooManyComponents<ComponentTypes...>(f, rangeEnd - rangeStart, pEntity, componentsBytes);
+			}
+		});
+	}
+
+	template<typename...ComponentTypes, typename F, typename RuntimeArg>
+	void ForEachInRange(F&& f, RuntimeArg* pArg, const int* componentIndexes, int startBlockIndex, int endBlockIndex)
+	{
+		static_assert(!any_shared_component_v<ComponentTypes...> && !any_chunk_component_v<ComponentTypes...>,
+			"shared and chunk components can only be iterated by ForEachBatch");
+		static_assert(!any_sparse_component_v<ComponentTypes...>, "sparse components can only be iterated by EntityContext::ForEach");
+		constexpr int n = sizeof...(ComponentTypes);
+		ForEachArrayRange(componentIndexes, n, startBlockIndex, endBlockIndex, [&](int rangeStart, int rangeEnd) {
+			Entity* pEntity = &mEntitiesBuffer[rangeStart];
+			byte* componentsBytes[n] = { 0 };
+			GetComponentsBytes(componentIndexes, n, rangeStart, componentsBytes);
+
+			if constexpr (n <= 10)
+			{
+				_DoForEach<ComponentTypes...>(f, pArg, rangeEnd - rangeStart, pEntity, componentsBytes);
+			}
+			else
+			{
+				_DoForEach_WithTooManyComponents<ComponentTypes...>(f, pArg, rangeEnd - rangeStart, pEntity, componentsBytes);
+			}
+		});
+	}
+
+	// each batch is a run of consecutive valid entities in [startBlockIndex, endBlockIndex),
+	// a shared or chunk component is passed as a pointer to the single value of the whole batch
+	template<typename...ComponentTypes, typename F>
+	void ForEachBatchInRange(F&& f, const int* componentIndexes, int startBlockIndex, int endBlockIndex)
+	{
+		static_assert(!any_sparse_component_v<ComponentTypes...>, "sparse components can only be iterated by EntityContext::ForEach");
+		using ComponentTuple = std::tuple<Entity*, int, std::decay_t<ComponentTypes>*...>;
+		constexpr int n = sizeof...(ComponentTypes);
+		ForEachArrayRange(componentIndexes, n, startBlockIndex, endBlockIndex, [&](int rangeStart, int rangeEnd) {
+			byte* componentsBytes[n] = { 0 };
+			GetComponentsBytes(componentIndexes, n, rangeStart, componentsBytes);
+
+			ComponentTuple componentTuple;
+			std::get<0>(componentTuple) = &mEntitiesBuffer[rangeStart];
+			std::get<1>(componentTuple) = rangeEnd - rangeStart;
+			GetComponentsTupleHelperClass<ComponentTuple, 2, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
+			std::apply(f, componentTuple);
+		});
+	}
+
+	template<typename...ComponentTypes, typename F, typename RuntimeArg>
+	void ForEachBatchInRange(F&& f, RuntimeArg* pArg, const int* componentIndexes, int startBlockIndex, int endBlockIndex)
+	{
+		static_assert(!any_sparse_component_v<ComponentTypes...>, "sparse components can only be iterated by EntityContext::ForEach");
+		using ComponentTuple = std::tuple<RuntimeArg*, Entity*, int, std::decay_t<ComponentTypes>*...>;
+		constexpr int n = sizeof...(ComponentTypes);
+		ForEachArrayRange(componentIndexes, n, startBlockIndex, endBlockIndex, [&](int rangeStart, int rangeEnd) {
+			byte* componentsBytes[n] = { 0 };
+			GetComponentsBytes(componentIndexes, n, rangeStart, componentsBytes);
+
+			ComponentTuple componentTuple;
+			std::get<0>(componentTuple) = pArg;
+			std::get<1>(componentTuple) = &mEntitiesBuffer[rangeStart];
+			std::get<2>(componentTuple) = rangeEnd - rangeStart;
+			GetComponentsTupleHelperClass<ComponentTuple, 3, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
+			std::apply(f, componentTuple);
+		});
+	}
+
+public:
+	// call f(Entity* pEntities, uint32_t laneMask, lane_field_t<ComponentTypes>*...) for each group of lanes
+	// with valid entities, see EntityArchetype::SetLaneWidth. pEntities is the first entity of the group,
+	// bit i of laneMask is set if the entity in lane i is valid and enabled, and each pointer is the start of a component's group,
+	// where field k of lane i is at [k * laneWidth + i], aligned to a vector of 'laneWidth' fields
+	template<typename...ComponentTypes, typename F>
+	void ForEachLaneGroup(F&& f, const int* componentIndexes)
+	{
+		constexpr int n = sizeof...(ComponentTypes);
+		int laneWidth = mArchetype->mLaneWidth;
+		uint32_t fullMask = (uint32_t)((1ull << laneWidth) - 1);
+		const uint64_t* masks[MAX_COMPONENT_COUNT_PER_ENTITY + 1];
+		int maskCount = GetEnabledMasks(componentIndexes, n, masks);
+		for (int blockIndex = 0; blockIndex < mHighWaterMark; blockIndex += laneWidth)
+		{
+			// a group never crosses a word of the occupancy mask
+			uint32_t laneMask = (uint32_t)(GetEnabledWord(masks, maskCount, blockIndex >> 6) >> (blockIndex & 63)) & fullMask;
+			if (laneMask == 0)
+				continue;
+			byte* groups[n] = { 0 };
+			for (int i = 0; i < n; i++)
+				groups[i] = GetLaneGroup(componentIndexes[i], blockIndex);
+			CallLaneGroup<ComponentTypes...>(f, &mEntitiesBuffer[blockIndex], laneMask, groups, std::index_sequence_for<ComponentTypes...>{});
 		}
+	}
 
-		ComponentTuple componentTuple;
-		std::get<0>(componentTuple) = pArg;
-		std::get<1>(componentTuple) = pEntity;
-		std::get<2>(componentTuple) = endBlockIndex - startBlockIndex;
-		GetComponentsTupleHelperClass<ComponentTuple, 3, 0, std::decay_t<ComponentTypes>...>::Call(componentTuple, componentsBytes);
-		std::apply(std::forward<F>(f), componentTuple);
+private:
+	template<typename...ComponentTypes, typename F, size_t...I>
+	static void CallLaneGroup(F& f, Entity* pEntities, uint32_t laneMask, byte* groups[], std::index_sequence<I...>)
+	{
+		f(pEntities, laneMask, reinterpret_cast<lane_field_t<ComponentTypes>*>(groups[I])...);
 	}
 
+public:
 	bool IsEmpty() const { return mUsedCount == 0; }
 
 	~EntityComponentChunk()
 	{
-		// release all entities
-		for (int i = 0; i < mBlockCount; i++)
+		// release all entities from the last one, so a packed storage never moves entities here.
+		// the storage may release the memory when the last one is gone
+		while (mUsedCount > 0)
 		{
-			Entity* pEntity = &mEntitiesBuffer[i];
-			if (pEntity->IsValid())
-			{
-				pEntity->Release();
-			}
+			mEntitiesBuffer[mHighWaterMark - 1].Release();
 		}
 
-		if (mFreeList) {
-			GetMemoryAllocator()->Free(mFreeList);
+		if (mColdMem) {
+			GetMemoryAllocator()->FreeAligned(mColdMem);
+			mColdMem = nullptr;
+		}
+		if (mMem) {
+			DestructSharedComponents();
+			DestructChunkComponents();
+			GetMemoryAllocator()->FreeAligned(mMem);
+			mMem = nullptr;
+			mOccupancyMask = nullptr;
+			mEnabledMasks = nullptr;
 			mFreeList = nullptr;
 			mEntitiesBuffer = nullptr;
+			mGenIDs = nullptr;
+			mIDSlots = nullptr;
 			//mComponentsBuffer = nullptr;
 		}
 	}
@@ -1823,22 +3471,268 @@ private:
 	EntityArchetype*	mArchetype;
 	uint16_t			mBlockCount;
 	//size_t				mBlockSize;
-	size_t				mChunkSize;
+	const ChunkLayout*	mLayout;
 	int					mComponentCount;
 	uint16_t			mUsedCount = 0;
 
 	uint16_t			mFreeHead;
 	uint16_t			mFreeTail;
 
+	// one past the last used block
+	uint16_t			mHighWaterMark = 0;
+
+	// if the values of the shared components have been constructed
+	bool				mHasSharedComponents = false;
+
+	// the generation id that all the blocks start with when the memory is allocated
+	EntityGenID			mGenBase = 0;
+
+	byte*				mMem = nullptr;
+
+	// the memory of cold components, null if there is no cold component
+	byte*				mColdMem = nullptr;
+
+	// one bit for each block, set if the entity in it is valid
+	std::atomic<uint64_t>*	mOccupancyMask = nullptr;
+
+	// the enabled masks of the entities and of each component, see GetEnabledMask
+	uint64_t*			mEnabledMasks = nullptr;
+
+	// how many bits of the enabled masks are cleared, the iterations don't read the masks when it's 0
+	uint32_t			mDisabledBitCount = 0;
+
 	// FreeList is a linked list that indicates those empty slots of memory
 	// Each element in freelist points to the next empty element's index
 	uint16_t*			mFreeList = nullptr;
 	Entity*				mEntitiesBuffer = nullptr;
+	// the generation id of each block
+	EntityGenID*		mGenIDs = nullptr;
+	// the slot of each entity in the EntityIDTable, null if there is no table
+	uint32_t*			mIDSlots = nullptr;
 	//byte*				mComponentsBuffer = nullptr;
 	byte*				mComponentBuffers[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
-	//byte*				mMem = nullptr;
+
+	// the column of every tag component in every chunk, tags are never read or written,
+	// it just keeps the pointers handed out for them valid when iterated with a stride of 1
+	alignas(CACHE_LINE_SIZE) static inline byte sTagMemory[MAX_ENTITY_COUNT_PER_CHUNK + 1] = { 0 };
+};
+
+
+/// EntityIDTable:
+/// maps the stable EntityIDs of a context to its entities, see EntityContext::EnableStableEntityIDs.
+/// A stable EntityID holds a slot of this table instead of the location of the entity,
+/// |<-----G:GenID----->||<--C:contextID-->||<-------------slot------------->|
+/// so entities can be moved between blocks without changing their EntityIDs,
+/// and looking one up costs one more load than looking up a location.
+/// The table grows while entities are created, so it must not be read by other threads at the same time.
+class EntityIDTable
+{
+public:
+	enum : uint64_t { MAX_SLOT_COUNT = (CONTEXT_ID_SHIFT >= 32) ? 0xFFFFFFFFull : ((1ull << CONTEXT_ID_SHIFT) - 1) };
+
+	// give a free slot to a new entity
+	uint32_t Acquire(Entity* pEntity)
+	{
+		uint32_t slot;
+		if (!mFreeSlots.empty()) {
+			slot = mFreeSlots.back();
+			mFreeSlots.pop_back();
+		}
+		else {
+			FASTECS_ASSERT(mSlots.size() < MAX_SLOT_COUNT);
+			slot = (uint32_t)mSlots.size();
+			mSlots.push_back(Slot());
+		}
+		mSlots[slot].pEntity = pEntity;
+		return slot;
+	}
+
+	// the EntityIDs given out for this slot before are never resolved again
+	void Release(uint32_t slot)
+	{
+		FASTECS_ASSERT(mSlots[slot].pEntity != nullptr);
+		mSlots[slot].pEntity = nullptr;
+		mSlots[slot].genId = (EntityGenID)((mSlots[slot].genId + 1) & GEN_ID_MASK);
+		mFreeSlots.push_back(slot);
+	}
+
+	// the entity of the slot has been moved to 'pEntity'
+	void Update(uint32_t slot, Entity* pEntity)
+	{
+		FASTECS_ASSERT(mSlots[slot].pEntity != nullptr);
+		mSlots[slot].pEntity = pEntity;
+	}
+
+	// return the entity identified by 'eid', or null if it has been released
+	Entity* Find(EntityID eid) const
+	{
+		uint64_t slot = (uint64_t)eid & MAX_SLOT_COUNT;
+		if (slot >= mSlots.size())
+			return nullptr;
+		const Slot& entry = mSlots[(size_t)slot];
+		EntityGenID genid = (EntityGenID)(((uint64_t)eid >> GEN_ID_SHIFT) & GEN_ID_MASK);
+		if (entry.pEntity == nullptr || entry.genId != genid)
+			return nullptr;
+		return entry.pEntity;
+	}
+
+	EntityID GetEntityID(uint32_t slot, uint8_t contextId) const
+	{
+		return (EntityID)((((uint64_t)mSlots[slot].genId & GEN_ID_MASK) << GEN_ID_SHIFT)
+			| ((uint64_t)contextId << CONTEXT_ID_SHIFT)
+			| (uint64_t)slot);
+	}
+
+	// the count of the slots used by entities
+	size_t GetUsedCount() const { return mSlots.size() - mFreeSlots.size(); }
+
+	// make room for 'count' more entities without growing the table
+	void Reserve(size_t count)
+	{
+		if (count > mFreeSlots.size())
+			mSlots.reserve(mSlots.size() + count - mFreeSlots.size());
+	}
+
+private:
+	struct Slot
+	{
+		Entity*			pEntity = nullptr;
+		EntityGenID		genId = 0;
+	};
+
+	std::vector<Slot>		mSlots;
+	std::vector<uint32_t>	mFreeSlots;
+};
+
+// EntityRelocationMap:
+// records the entities that have been moved to another block inside a storage.
+// The EntityID of an entity encodes the block where it was created, 
+// so the moved ones must be looked up here to keep their EntityIDs resolvable.
+// GetEntity looks up moved entities on other threads while the storage moves or releases others,
+// so the maps are guarded by a mutex, which is only taken once any entity has been moved.
+class EntityRelocationMap
+{
+public:
+	// (chunkIndex << MAX_BLOCK_COUNT_BITS) | blockIndex
+	using BlockLocation = uint32_t;
+
+	bool Empty() const { return mCount.load(std::memory_order_acquire) == 0; }
+
+	// find the current block of a moved entity
+	bool FindLocation(EntityID eid, BlockLocation* pLocation) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mLocations.find(eid);
+		if (it == mLocations.end())
+			return false;
+		*pLocation = it->second;
+		return true;
+	}
+
+	// find the EntityID of the moved entity that is currently in this block
+	bool FindEntityID(BlockLocation location, EntityID* pEntityID) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mEntityIDs.find(location);
+		if (it == mEntityIDs.end())
+			return false;
+		*pEntityID = it->second;
+		return true;
+	}
+
+	// the entity with 'eid' is moved from one block to another
+	void Move(EntityID eid, BlockLocation from, BlockLocation to)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		mEntityIDs.erase(from);
+		mLocations[eid] = to;
+		mEntityIDs[to] = eid;
+		mCount.store(mLocations.size(), std::memory_order_release);
+	}
+
+	// the entity in this block is released
+	void Remove(BlockLocation location)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+		auto it = mEntityIDs.find(location);
+		if (it != mEntityIDs.end()) {
+			mLocations.erase(it->second);
+			mEntityIDs.erase(it);
+			mCount.store(mLocations.size(), std::memory_order_release);
+		}
+	}
+
+private:
+	std::unordered_map<EntityID, BlockLocation>		mLocations;
+	std::unordered_map<BlockLocation, EntityID>		mEntityIDs;
+	std::atomic<size_t>								mCount = { 0 };
+	mutable std::mutex								mMutex;
 };
 
+// ChunkOccupancyBuckets:
+// the partially filled chunks of a storage, bucket k links the chunks with k empty blocks,
+// and a bit mask tells the buckets that aren't empty, so the fullest chunk is found by scanning the mask.
+// see EntityStorageMode::FullestFirst
+class ChunkOccupancyBuckets
+{
+public:
+	enum : uint32_t { INVALID_CHUNK_INDEX = UINT32_MAX };
+
+	ChunkOccupancyBuckets()
+		: mHeads(MAX_ENTITY_COUNT_PER_CHUNK + 1, INVALID_CHUNK_INDEX)
+		, mNonEmptyMask((MAX_ENTITY_COUNT_PER_CHUNK + 64) / 64, 0)
+	{
+	}
+
+	// a chunk with 'emptyBlockCount' empty blocks, neither empty nor full
+	void Insert(uint32_t chunkIndex, int emptyBlockCount)
+	{
+		if (chunkIndex >= mLinks.size())
+			mLinks.resize(chunkIndex + 1);
+		uint32_t head = mHeads[emptyBlockCount];
+		mLinks[chunkIndex].prev = INVALID_CHUNK_INDEX;
+		mLinks[chunkIndex].next = head;
+		if (head != INVALID_CHUNK_INDEX)
+			mLinks[head].prev = chunkIndex;
+		mHeads[emptyBlockCount] = chunkIndex;
+		mNonEmptyMask[emptyBlockCount >> 6] |= (1ull << (emptyBlockCount & 63));
+	}
+
+	// 'emptyBlockCount' must be the one the chunk was inserted with
+	void Remove(uint32_t chunkIndex, int emptyBlockCount)
+	{
+		Link& link = mLinks[chunkIndex];
+		if (link.prev != INVALID_CHUNK_INDEX)
+			mLinks[link.prev].next = link.next;
+		else
+			mHeads[emptyBlockCount] = link.next;
+		if (link.next != INVALID_CHUNK_INDEX)
+			mLinks[link.next].prev = link.prev;
+		if (mHeads[emptyBlockCount] == INVALID_CHUNK_INDEX)
+			mNonEmptyMask[emptyBlockCount >> 6] &= ~(1ull << (emptyBlockCount & 63));
+	}
+
+	// the chunk with the least empty blocks, INVALID_CHUNK_INDEX if there is no partially filled chunk
+	uint32_t FindFullest() const
+	{
+		for (size_t word = 0; word < mNonEmptyMask.size(); word++) {
+			if (mNonEmptyMask[word] != 0)
+				return mHeads[(word << 6) + count_trailing_zeros(mNonEmptyMask[word])];
+		}
+		return INVALID_CHUNK_INDEX;
+	}
+
+private:
+	struct Link
+	{
+		uint32_t	prev = INVALID_CHUNK_INDEX;
+		uint32_t	next = INVALID_CHUNK_INDEX;
+	};
+
+	std::vector<uint32_t>	mHeads;
+	std::vector<uint64_t>	mNonEmptyMask;
+	std::vector<Link>		mLinks;
+};
 
 // EntityComponentStorage:
 // A container that has multiple chunks related to the same archetype
@@ -1856,99 +3750,320 @@ public:
 		, mArchetype(pArchetype)
 		, mChunkArrayCapacity(16)
 	{
+		mEntityIDTable = GetContextEntityIDTable();
+		bool bIDSlots = (mEntityIDTable != nullptr);
 		mComponentCountPerEntity = (int)pArchetype->mComponentCount;
-		size_t entityBlockSize = EntityComponentChunk::CalculateBlockSize(pArchetype);
+		mPacked = (pArchetype->mStorageMode == EntityStorageMode::Packed);
+		if (pArchetype->mStorageMode == EntityStorageMode::FullestFirst) {
+			FASTECS_ASSERT(pArchetype->mSharedComponentCount == 0);
+			mOccupancyBuckets.reset(new ChunkOccupancyBuckets());
+		}
+		const ChunkSizePolicy* pPolicy = pArchetype->GetChunkSizePolicy();
+		if (pPolicy == nullptr)
+			pPolicy = &GetWorldChunkSizePolicy();
 
-		mChunkSize = MAX_STORAGE_CHUNK_SIZE;
-		mEntityCountPerChunk = mChunkSize / entityBlockSize - 1;
-		if (mEntityCountPerChunk > MAX_ENTITY_COUNT_PER_CHUNK)
+		ChunkLayout fullLayout;
+		if (pPolicy->type == ChunkSizePolicy::Type::EntityCount)
+		{
+			mEntityCountPerChunk = std::min<size_t>(std::max<size_t>(pPolicy->value, 1), MAX_ENTITY_COUNT_PER_CHUNK);
+			EntityComponentChunk::CalculateLayout(pArchetype, mEntityCountPerChunk, &fullLayout, bIDSlots);
+		}
+		else
 		{
-			mEntityCountPerChunk = MAX_ENTITY_COUNT_PER_CHUNK;
-			// allocate one extra block, for memory alignment
-			mChunkSize = (MAX_ENTITY_COUNT_PER_CHUNK + 1) * entityBlockSize;
+			// put as many entities as the chunk holds, 
+			// and remove a few if the padding of the columns doesn't fit
+			size_t entityBlockSize = EntityComponentChunk::CalculateBlockSize(pArchetype, bIDSlots);
+			mEntityCountPerChunk = std::min<size_t>(std::max<size_t>(pPolicy->value / entityBlockSize, 1), MAX_ENTITY_COUNT_PER_CHUNK);
+			EntityComponentChunk::CalculateLayout(pArchetype, mEntityCountPerChunk, &fullLayout, bIDSlots);
+			while (fullLayout.chunkSize > pPolicy->value && mEntityCountPerChunk > 1)
+			{
+				mEntityCountPerChunk -= 1;
+				EntityComponentChunk::CalculateLayout(pArchetype, mEntityCountPerChunk, &fullLayout, bIDSlots);
+			}
+		}
+
+		// the growing chunks come first, each twice as large as the one before, 
+		// and all the chunks after them are full sized
+		if (pPolicy->firstChunkEntityCount > 0) {
+			for (size_t count = pPolicy->firstChunkEntityCount; count < mEntityCountPerChunk; count *= 2) {
+				mChunkLayouts.emplace_back();
+				EntityComponentChunk::CalculateLayout(pArchetype, count, &mChunkLayouts.back(), bIDSlots);
+			}
 		}
+		mChunkLayouts.push_back(fullLayout);
+		mChunkLayouts.shrink_to_fit();
 
 		//mChunkFreeList = (uint16_t*)malloc(sizeof(uint16_t) * mChunkArrayCapacity);
-		//mChunks = (EntityComponentChunk*)malloc(sizeof(EntityComponentChunk) * mChunkArrayCapacity);
 		mChunkFreeList = (uint16_t*)GetChunkMemoryAllocator()->Malloc(sizeof(uint16_t) * mChunkArrayCapacity);
-		mChunks = (EntityComponentChunk*)GetChunkMemoryAllocator()->Malloc(sizeof(EntityComponentChunk) * mChunkArrayCapacity);
 		
 		memset(mChunkFreeList, 0, sizeof(sizeof(uint16_t) * mChunkArrayCapacity));
-		memset(mChunks, 0, sizeof(EntityComponentChunk) * mChunkArrayCapacity);
-		mChunkFreeHead = mChunkCount = 0;
-
+		for (int i = 0; i < MAX_CHUNK_PAGE_COUNT; i++)
+			mChunkPages[i].store(nullptr, std::memory_order_relaxed);
+		mChunkFreeHead = 0;
+		mChunkCount.store(0, std::memory_order_release);
+
+		// the values of shared components that are not given when entities are created
+		FASTECS_ASSERT(!mPacked || pArchetype->mSharedComponentCount == 0);
+		for (int i = 0; i < mComponentCountPerEntity; i++) {
+			if (pArchetype->mComponentShareds[i]) {
+				mDefaultSharedComponents[i] = (byte*)GetChunkMemoryAllocator()->MallocAligned(
+					pArchetype->mComponentSizes[i], pArchetype->mComponentAlignments[i]);
+				(*pArchetype->mComponentConstructors[i])(mDefaultSharedComponents[i]);
+			}
+		}
 	}
 
-	Entity* Allocate(bool bCallConstructor)
+	// sharedValues: the values of the shared components indexed by component index, 
+	// the default values are used if it's null or for its null elements.
+	// return null if the entity needs a new chunk and the storage has MAX_CHUNK_COUNT_PER_STORAGE chunks
+	Entity* Allocate(bool bCallConstructor, const void* const sharedValues[] = nullptr)
 	{
-		// find chunk that is not full
-		//uint16_t freeChunkIndex = -1;
-		if (mChunkFreeHead == mChunkCount) // free list is full
-		{
-			// don't have enough capacity
-			if (mChunkCount >= mChunkArrayCapacity) {
-				IncreaseCapacity();
-			}
-			EntityComponentChunk* pChunk = &mChunks[mChunkCount];
-			//pChunk->EntityComponentChunk::EntityComponentChunk(mChunkCount, this, mArchetype, mEntityCountPerChunk, mEntityBlockSize);
-			new (pChunk) EntityComponentChunk(mChunkCount, this, mArchetype, mEntityCountPerChunk, mChunkSize);
-			mChunkCount += 1;
-			mChunkFreeList[mChunkFreeHead] = mChunkCount;
+		Entity* pEntity;
+		if (mPacked) {
+			pEntity = AllocatePacked(bCallConstructor);
 		}
-		EntityComponentChunk* pChunk = &mChunks[mChunkFreeHead];
-		Entity* pEntity = pChunk->Allocate(bCallConstructor);
-		if (pChunk->IsFull()) {
-			mChunkFreeHead = mChunkFreeList[mChunkFreeHead];
+		else if (mArchetype->mSharedComponentCount > 0) {
+			pEntity = AllocateShared(bCallConstructor, sharedValues);
 		}
+		else if (mOccupancyBuckets) {
+			pEntity = AllocateFullestFirst(bCallConstructor);
+		}
+		else {
+			// find chunk that is not full
+			//uint16_t freeChunkIndex = -1;
+			if (mChunkFreeHead == mChunkCount) // free list is full
+			{
+				EntityComponentChunk* pNewChunk = CreateChunk();
+				if (pNewChunk == nullptr)
+					return nullptr;
+				mChunkFreeList[mChunkFreeHead] = pNewChunk->GetChunkId() + 1;
+			}
+			EntityComponentChunk* pChunk = &ChunkAt(mChunkFreeHead);
+			pEntity = AllocateInChunk(pChunk, bCallConstructor);
+			if (pChunk->IsFull()) {
+				mChunkFreeHead = mChunkFreeList[mChunkFreeHead];
+			}
+		}
+
+		if (pEntity == nullptr)
+			return nullptr;
+		if (mEntityIDTable != nullptr)
+			pEntity->GetChunk()->SetIDSlot(pEntity->GetBlockIndex(), mEntityIDTable->Acquire(pEntity));
 		return pEntity;
 	}
 
 	void Deallocate(Entity* pEntity, bool bCallDestructor)
 	{
-		EntityComponentChunk* pChunk = &mChunks[pEntity->mChunkIndex];
+		if (!mRelocationMap.Empty())
+			mRelocationMap.Remove(GetBlockLocation(pEntity));
+		if (mEntityIDTable != nullptr)
+			mEntityIDTable->Release(pEntity->GetChunk()->GetIDSlot(pEntity->GetBlockIndex()));
+
+		if (mPacked) {
+			DeallocatePacked(pEntity, bCallDestructor);
+			return;
+		}
+
+		EntityComponentChunk* pChunk = pEntity->GetChunk();
+		uint16_t chunkIndex = pChunk->GetChunkId();
 		bool bFull = pChunk->IsFull();
-		pChunk->Deallocate(pEntity, bCallDestructor);
-		if (bFull) {
-			mChunkFreeList[pEntity->mChunkIndex] = mChunkFreeHead;
-			mChunkFreeHead = pEntity->mChunkIndex;
+		DeallocateInChunk(pChunk, pEntity, bCallDestructor);
+		if (bFull && !mOccupancyBuckets) {
+			mChunkFreeList[chunkIndex] = mChunkFreeHead;
+			mChunkFreeHead = chunkIndex;
 		}
 	}
 
-	Entity* GetEntity(uint16_t chunkIndex, uint16_t blockIndex)
+	// return the valid entity identified by 'eid', or null if it has been released.
+	// it can run on other threads while this storage creates or releases other entities:
+	// the occupancy words are atomic, and the relocation map of the moved entities has its own lock.
+	// the entity itself must not be created, released or moved at the same time,
+	// which excludes packed storages, where releasing an entity moves another one into its block
+	// (and Defragment, which is never called while the storage is used anyway)
+	Entity* GetEntity(EntityID eid)
 	{
-		if (chunkIndex >= mChunkCount)
+		EntityGenID genid;
+		uint8_t contextId;
+		uint16_t chunkIndex, blockIndex, storageIndex;
+		Entity::ParseEntityID(eid, &genid, &contextId, &storageIndex, &chunkIndex, &blockIndex);
+
+		// the entity might have been moved to another block
+		EntityRelocationMap::BlockLocation location;
+		if (!mRelocationMap.Empty() && mRelocationMap.FindLocation(eid, &location)) {
+			return ChunkAt(location >> MAX_BLOCK_COUNT_BITS).GetEntity(location & BLOCK_INDEX_MASK);
+		}
+
+		if (chunkIndex >= mChunkCount.load(std::memory_order_acquire))
 			return nullptr;
 
-		Entity* pEntity = mChunks[chunkIndex].GetEntity(blockIndex);
-		if (!pEntity->mValid)
+		EntityComponentChunk& chunk = ChunkAt(chunkIndex);
+		if (!chunk.IsOccupied(blockIndex) || chunk.GetGenID(blockIndex) != genid)
 			return nullptr;
-		return pEntity;
+		return chunk.GetEntity(blockIndex);
+	}
+
+	// move entities from the emptiest chunks into the fullest ones, 
+	// until no more chunk can be emptied or 'budgetMicroseconds' runs out.
+	// return true if the storage has been compacted.
+	// moved entities keep their EntityIDs, but the Entity pointers to them are changed,
+	// so never call it while iterating this storage.
+	bool Defragment(uint32_t budgetMicroseconds)
+	{
+		return DefragmentUntil(std::chrono::steady_clock::now() + std::chrono::microseconds(budgetMicroseconds));
+	}
+
+	// same as Defragment, but stops at 'deadline'
+	bool DefragmentUntil(std::chrono::steady_clock::time_point deadline)
+	{
+		if (mPacked)
+			return true;
+		bool bShared = (mArchetype->mSharedComponentCount > 0);
+
+		// the chunks that are neither empty nor full, from the emptiest to the fullest
+		std::vector<uint16_t> chunkIndexes;
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			if (!ChunkAt(i).IsEmpty() && !ChunkAt(i).IsFull())
+				chunkIndexes.push_back(i);
+		}
+		std::sort(chunkIndexes.begin(), chunkIndexes.end(), [this](uint16_t a, uint16_t b) {
+			return ChunkAt(a).GetUsedCount() < ChunkAt(b).GetUsedCount();
+		});
+
+		int lo = 0;
+		int hi = (int)chunkIndexes.size() - 1;
+		int movedCount = 0;
+		while (lo < hi)
+		{
+			// reading the clock is not free, check it every 32 moves
+			if ((movedCount & 31) == 0 && std::chrono::steady_clock::now() >= deadline)
+				break;
+
+			EntityComponentChunk* pSrcChunk = &ChunkAt(chunkIndexes[lo]);
+			// entities are only moved between chunks with the same shared components
+			int dst = hi;
+			if (bShared) {
+				const void* values[MAX_COMPONENT_COUNT_PER_ENTITY];
+				pSrcChunk->GetSharedComponents(values);
+				while (dst > lo && !ChunkAt(chunkIndexes[dst]).MatchSharedComponents(values))
+					dst -= 1;
+				if (dst == lo) {
+					lo += 1;
+					continue;
+				}
+			}
+			EntityComponentChunk* pDstChunk = &ChunkAt(chunkIndexes[dst]);
+			// always move the last one, so the high-water mark of the source chunk goes down
+			Entity* pEntity = pSrcChunk->GetEntity((uint16_t)(pSrcChunk->GetHighWaterMark() - 1));
+			MoveEntity(pEntity, pDstChunk);
+			movedCount += 1;
+
+			if (pDstChunk->IsFull()) {
+				chunkIndexes.erase(chunkIndexes.begin() + dst);
+				hi -= 1;
+			}
+			if (pSrcChunk->IsEmpty())
+				lo += 1;
+		}
+
+		if (movedCount > 0)
+			RebuildChunkFreeList();
+		return lo >= hi;
+	}
+
+	// if the entities could be put into fewer chunks
+	bool IsFragmented() const
+	{
+		if (mPacked)
+			return false;
+
+		// a chunk can be emptied if the other chunks have enough empty blocks for its entities,
+		// and the smallest chunk is the easiest one, chunks may have different sizes
+		size_t emptyBlockCount = 0;
+		size_t minBlockCount = 0;
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			if (!ChunkAt(i).IsEmpty()) {
+				size_t blockCount = ChunkAt(i).GetBlockCount();
+				emptyBlockCount += blockCount - ChunkAt(i).GetUsedCount();
+				if (minBlockCount == 0 || blockCount < minBlockCount)
+					minBlockCount = blockCount;
+			}
+		}
+		return minBlockCount > 0 && emptyBlockCount >= minBlockCount;
+	}
+
+	// the EntityID of a moved entity is still the one given out before it was moved
+	EntityID GetEntityID(const Entity* pEntity) const
+	{
+		if (mEntityIDTable != nullptr)
+			return mEntityIDTable->GetEntityID(pEntity->GetChunk()->GetIDSlot(pEntity->GetBlockIndex()), (uint8_t)GetContextId());
+
+		EntityID eid;
+		if (!mRelocationMap.Empty() && mRelocationMap.FindEntityID(GetBlockLocation(pEntity), &eid))
+			return eid;
+		return Entity::ComposeEntityID(pEntity->GetGenID(), (uint8_t)GetContextId(), mIndex, 
+			pEntity->GetChunkIndex(), pEntity->GetBlockIndex());
 	}
 
 	Entity* CloneEntity(const Entity* pEntity)
 	{
 		FASTECS_ASSERT(mArchetype == pEntity->GetArchetype());
-		Entity* pClonedEntity = Allocate(false);
+		const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY];
+		pEntity->GetChunk()->GetSharedComponents(sharedValues);
+		Entity* pClonedEntity = Allocate(false, sharedValues);
+		if (pClonedEntity == nullptr)
+			return nullptr;
 		for (int i = 0; i < mComponentCountPerEntity; i++)
 		{
+			if (mArchetype->mComponentStrides[i] == 0)
+				continue;
+			if (mArchetype->mComponentLaned[i]) {
+				pClonedEntity->GetChunk()->CopyLaneComponent(pClonedEntity, i, pEntity, i);
+				continue;
+			}
 			const byte* pSrcMem = GetComponentByIndex(pEntity, i);
 			byte* pDstMem = GetComponentByIndex(pClonedEntity, i);
 			ComponentAssignment* pAssignment = mArchetype->mComponentAssignments[i];
 			(*pAssignment)(pDstMem, pSrcMem);
 		}
+		pClonedEntity->GetChunk()->CopyEnabledBits(pClonedEntity->GetBlockIndex(), pEntity->GetChunk(), pEntity->GetBlockIndex());
 		return pClonedEntity;
 	}
 
 	~EntityComponentStorage()
 	{
-		for (uint16_t i = 0; i < mChunkCount; i++)
+		// destroy from the last chunk, so a packed storage never moves entities here
+		for (int i = (int)mChunkCount - 1; i >= 0; i--)
 		{
-			mChunks[i].~EntityComponentChunk();
+			ChunkAt(i).~EntityComponentChunk();
 		}
 		//free(mChunkFreeList);
-		//free(mChunks);
 		GetChunkMemoryAllocator()->Free(mChunkFreeList);
-		GetChunkMemoryAllocator()->Free(mChunks);
+		FreeChunkPages(0);
+
+		for (int i = 0; i < mComponentCountPerEntity; i++) {
+			if (mDefaultSharedComponents[i]) {
+				(*mArchetype->mComponentDestructors[i])(mDefaultSharedComponents[i]);
+				GetChunkMemoryAllocator()->FreeAligned(mDefaultSharedComponents[i]);
+			}
+		}
+	}
+
+	// change the value of a shared component of an entity, which moves it into a chunk holding the new value.
+	// the EntityID isn't changed, but the entity is returned at its new place.
+	// return null if it needs a new chunk and the storage is full, the entity is left unchanged then
+	Entity* SetSharedComponent(Entity* pEntity, int index, const void* pValue)
+	{
+		FASTECS_ASSERT(mArchetype->mComponentShareds[index]);
+		EntityComponentChunk* pChunk = pEntity->GetChunk();
+		const void* values[MAX_COMPONENT_COUNT_PER_ENTITY];
+		pChunk->GetSharedComponents(values);
+		values[index] = pValue;
+		if (pChunk->MatchSharedComponents(values))
+			return pEntity;
+		EntityComponentChunk* pDstChunk = FindSharedChunk(values);
+		if (pDstChunk == nullptr)
+			return nullptr;
+		return MoveEntity(pEntity, pDstChunk, values);
 	}
 
 	EntityArchetype* GetArchetype() { return mArchetype; }
@@ -1957,38 +4072,38 @@ public:
 	template<typename ComponentType>
 	ComponentType* GetComponent(Entity* pEntity)
 	{
-		return mChunks[pEntity->mChunkIndex].GetComponent<ComponentType>(pEntity);
+		return pEntity->GetChunk()->GetComponent<ComponentType>(pEntity);
 	}
 
 	template<typename ComponentType>
 	const ComponentType* GetComponent(const Entity* pEntity) const
 	{
-		const EntityComponentChunk* pChunk = &mChunks[pEntity->mChunkIndex];
+		const EntityComponentChunk* pChunk = pEntity->GetChunk();
 		return pChunk->GetComponent<ComponentType>(pEntity);
 	}
 
 	template<typename T = byte>
 	T* GetComponentByIndex(Entity* pEntity, int index)
 	{
-		return mChunks[pEntity->mChunkIndex].GetComponentByIndex<T>(pEntity, index);
+		return pEntity->GetChunk()->GetComponentByIndex<T>(pEntity, index);
 	}
 
 	template<typename T = byte>
 	const T* GetComponentByIndex(const Entity* pEntity, int index) const
 	{
-		return mChunks[pEntity->mChunkIndex].GetComponentByIndex<T>(pEntity, index);
+		return pEntity->GetChunk()->GetComponentByIndex<T>(pEntity, index);
 	}
 
 	template<typename T = byte>
 	T* GetComponentByTypeID(Entity* pEntity, ComponentTypeID componentTypeID)
 	{
-		return mChunks[pEntity->mChunkIndex].GetComponentByTypeID<T>(pEntity, componentTypeID);
+		return pEntity->GetChunk()->GetComponentByTypeID<T>(pEntity, componentTypeID);
 	}
 
 	template<typename T = byte>
 	const T* GetComponentByTypeID(const Entity* pEntity, ComponentTypeID componentTypeID) const
 	{
-		return mChunks[pEntity->mChunkIndex].GetComponentByTypeID<T>(pEntity, componentTypeID);
+		return pEntity->GetChunk()->GetComponentByTypeID<T>(pEntity, componentTypeID);
 	}
 
 	uint16_t GetIndex() const { return mIndex; }
@@ -2001,8 +4116,8 @@ public:
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
 
 		for (int i = 0; i < mChunkCount; i++) {
-			if (!mChunks[i].IsEmpty()) {
-				mChunks[i].ForEach<F, ComponentTypes...>(std::forward<F>(f), componentIndexes);
+			if (!ChunkAt(i).IsEmpty()) {
+				ChunkAt(i).ForEach<F, ComponentTypes...>(std::forward<F>(f), componentIndexes);
 			}
 		}
 	}
@@ -2015,8 +4130,8 @@ public:
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
 
 		for (int i = 0; i < mChunkCount; i++) {
-			if (!mChunks[i].IsEmpty()) {
-				mChunks[i].ForEach<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes);
+			if (!ChunkAt(i).IsEmpty()) {
+				ChunkAt(i).ForEach<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes);
 			}
 		}
 	}
@@ -2029,8 +4144,8 @@ public:
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
 
 		for (int i = 0; i < mChunkCount; i++) {
-			if (!mChunks[i].IsEmpty()) {
-				mChunks[i].ForEachBatch<F, ComponentTypes...>(std::forward<F>(f), componentIndexes);
+			if (!ChunkAt(i).IsEmpty()) {
+				ChunkAt(i).ForEachBatch<F, ComponentTypes...>(std::forward<F>(f), componentIndexes);
 			}
 		}
 	}
@@ -2043,28 +4158,466 @@ public:
 		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
 
 		for (int i = 0; i < mChunkCount; i++) {
-			if (!mChunks[i].IsEmpty()) {
-				mChunks[i].ForEachBatch<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes);
+			if (!ChunkAt(i).IsEmpty()) {
+				ChunkAt(i).ForEachBatch<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg, componentIndexes);
+			}
+		}
+	}
+
+	// same as ForEachBatch, but the chunks for which 'filter(const EntityComponentChunk*)' returns false
+	// are skipped before any of their entities is touched
+	template<typename F, typename Filter, typename...ComponentTypes>
+	void ForEachBatchFiltered(Filter&& filter, F&& f)
+	{
+		constexpr int n = sizeof...(ComponentTypes);
+		int componentIndexes[n];
+		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
+
+		for (int i = 0; i < mChunkCount; i++) {
+			if (!ChunkAt(i).IsEmpty() && filter((const EntityComponentChunk*)&ChunkAt(i))) {
+				ChunkAt(i).ForEachBatch<F, ComponentTypes...>(std::forward<F>(f), componentIndexes);
+			}
+		}
+	}
+
+	// all of ComponentTypes must be laid out in lanes, see EntityComponentChunk::ForEachLaneGroup
+	template<typename F, typename...ComponentTypes>
+	void ForEachLaneGroup(F&& f)
+	{
+		constexpr int n = sizeof...(ComponentTypes);
+		int componentIndexes[n];
+		GetComponentIndexesHelperClass<ComponentTypes...>::Call(mArchetype, componentIndexes, 0);
+		for (int i = 0; i < n; i++)
+			FASTECS_ASSERT(mArchetype->mComponentLaned[componentIndexes[i]]);
+
+		for (int i = 0; i < mChunkCount; i++) {
+			if (!ChunkAt(i).IsEmpty()) {
+				ChunkAt(i).ForEachLaneGroup<ComponentTypes...>(std::forward<F>(f), componentIndexes);
 			}
 		}
 	}
 
+	// the chunk keeps its address until it's removed by Trim
 	EntityComponentChunk* GetChunk(int index) 
 	{
-		return &mChunks[index];
+		return &ChunkAt(index);
+	}
+
+	uint16_t GetChunkCount() const { return mChunkCount; }
+
+	// bytes of each full sized chunk's memory, and of its cold components' memory
+	size_t GetChunkSize() const { return mChunkLayouts.back().chunkSize; }
+	size_t GetColdChunkSize() const { return mChunkLayouts.back().coldChunkSize; }
+	// entities of a full sized chunk, the growing chunks before them have less, see ChunkSizePolicy::Growing
+	size_t GetEntityCountPerChunk() const { return mEntityCountPerChunk; }
+
+	// where each part of the chunk at 'chunkIndex' is placed, the chunks at the same index always have the same layout
+	const ChunkLayout& GetChunkLayout(uint32_t chunkIndex) const
+	{
+		return mChunkLayouts[std::min<size_t>(chunkIndex, mChunkLayouts.size() - 1)];
+	}
+
+	// the count of different layouts, the growing chunks' and the full sized one
+	size_t GetChunkLayoutCount() const { return mChunkLayouts.size(); }
+
+	// the count of chunks whose memory is allocated
+	uint16_t GetAllocatedChunkCount() const
+	{
+		uint16_t count = 0;
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			if (!ChunkAt(i).IsMemoryReleased())
+				count += 1;
+		}
+		return count;
+	}
+
+	// how many empty chunks are kept without releasing their memory, DEFAULT_SPARE_CHUNK_COUNT by default
+	void SetSpareChunkCount(uint16_t count)
+	{
+		mSpareChunkCount = count;
+		for (uint16_t i = 0; i < mChunkCount && mEmptyChunkCount > mSpareChunkCount; i++) {
+			if (ChunkAt(i).IsEmpty() && !ChunkAt(i).IsMemoryReleased()) {
+				ChunkAt(i).ReleaseMemory();
+				mEmptyChunkCount -= 1;
+			}
+		}
+	}
+
+	uint16_t GetSpareChunkCount() const { return mSpareChunkCount; }
+
+	// make room for 'count' more entities, e.g. before a burst of spawns: the chunks are created 
+	// and their memory is allocated and initialized here, so creating that many entities later never allocates.
+	// the reserved chunks are kept while they are empty, until Trim or SetSpareChunkCount releases them.
+	// with shared components, only the empty chunks are counted, since the others only take entities with their values.
+	// return false if the storage would need more than MAX_CHUNK_COUNT_PER_STORAGE chunks, it holds as many as it can then
+	bool Reserve(size_t count)
+	{
+		bool bShared = (mArchetype->mSharedComponentCount > 0);
+		size_t freeBlockCount = 0;
+		for (uint16_t i = 0; i < mChunkCount && freeBlockCount < count; i++) {
+			EntityComponentChunk* pChunk = &ChunkAt(i);
+			if (pChunk->IsEmpty()) {
+				if (pChunk->IsMemoryReleased()) {
+					pChunk->AllocateMemory();
+					mEmptyChunkCount += 1;
+				}
+			}
+			else if (bShared) {
+				continue;
+			}
+			freeBlockCount += pChunk->GetBlockCount() - pChunk->GetUsedCount();
+		}
+		while (freeBlockCount < count) {
+			EntityComponentChunk* pChunk = CreateChunk();
+			if (pChunk == nullptr)
+				break;
+			freeBlockCount += pChunk->GetBlockCount();
+		}
+		// the partially filled chunks are still used first, then the reserved ones
+		RebuildChunkFreeList();
+		if (mEntityIDTable != nullptr)
+			mEntityIDTable->Reserve(count);
+		return freeBlockCount >= count;
+	}
+
+	// release the memory of all the empty chunks, including the spare ones,
+	// remove the empty chunks at the end and free the pages left empty.
+	// entities are never moved here, call Defragment first to empty more chunks
+	void Trim()
+	{
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			if (ChunkAt(i).IsEmpty() && !ChunkAt(i).IsMemoryReleased())
+				ChunkAt(i).ReleaseMemory();
+		}
+		mEmptyChunkCount = 0;
+
+		// chunks created at the same indexes later continue these generation ids
+		while (mChunkCount > 0 && ChunkAt(mChunkCount - 1).IsEmpty())
+		{
+			EntityComponentChunk* pChunk = &ChunkAt(mChunkCount - 1);
+			EntityGenID genBase = pChunk->GetNextGenBase();
+			if (is_newer_gen_id(genBase, mGenBase))
+				mGenBase = genBase;
+			pChunk->~EntityComponentChunk();
+			mChunkCount.store(mChunkCount - 1, std::memory_order_release);
+		}
+		FreeChunkPages(mChunkCount == 0 ? 0 : GetChunkPageIndex(mChunkCount - 1) + 1);
+
+		uint16_t capacity = 16;
+		while (capacity < mChunkCount)
+			capacity *= 2;
+		if (capacity < mChunkArrayCapacity) {
+			mChunkArrayCapacity = capacity;
+			mChunkFreeList = (uint16_t*)GetChunkMemoryAllocator()->Realloc(mChunkFreeList, sizeof(uint16_t) * mChunkArrayCapacity);
+		}
+		RebuildChunkFreeList();
 	}
 
 	inline IChunkMemoryAllocator* GetChunkMemoryAllocator();
 
+	bool IsPacked() const { return mPacked; }
+
 private:
 
+	inline const ChunkSizePolicy& GetWorldChunkSizePolicy() const;
+
+	inline int GetContextId() const;
+
+	inline EntityIDTable* GetContextEntityIDTable() const;
+
+	// the entity in 'pSrcEntity' has been moved to 'pDstEntity', keep its EntityID resolvable
+	void OnEntityMoved(const Entity* pSrcEntity, Entity* pDstEntity, EntityID eid)
+	{
+		if (mEntityIDTable != nullptr) {
+			uint32_t slot = pSrcEntity->GetChunk()->GetIDSlot(pSrcEntity->GetBlockIndex());
+			pDstEntity->GetChunk()->SetIDSlot(pDstEntity->GetBlockIndex(), slot);
+			mEntityIDTable->Update(slot, pDstEntity);
+		}
+		else {
+			mRelocationMap.Move(eid, GetBlockLocation(pSrcEntity), GetBlockLocation(pDstEntity));
+		}
+	}
+
+	// the page holding the chunk at 'index', see MAX_CHUNK_PAGE_COUNT
+	static int GetChunkPageIndex(uint32_t index)
+	{
+		return 63 - count_leading_zeros((uint64_t)index + 1);
+	}
+
+	// the index of the first chunk in the page, which holds as many chunks plus one
+	static uint32_t GetChunkPageStart(int pageIndex)
+	{
+		return (1u << pageIndex) - 1;
+	}
+
+	// find the chunk in its page
+	EntityComponentChunk& ChunkAt(uint32_t index) const
+	{
+		int pageIndex = GetChunkPageIndex(index);
+		return mChunkPages[pageIndex].load(std::memory_order_acquire)[index - GetChunkPageStart(pageIndex)];
+	}
+
+	static EntityRelocationMap::BlockLocation GetBlockLocation(const Entity* pEntity)
+	{
+		return ((EntityRelocationMap::BlockLocation)pEntity->GetChunkIndex() << MAX_BLOCK_COUNT_BITS) | pEntity->GetBlockIndex();
+	}
+
+	// construct a new chunk after the last one.
+	// return null if there are MAX_CHUNK_COUNT_PER_STORAGE chunks, since the chunk index must fit in EntityID
+	EntityComponentChunk* CreateChunk()
+	{
+		uint16_t chunkIndex = mChunkCount.load(std::memory_order_relaxed);
+		if (chunkIndex >= MAX_CHUNK_COUNT_PER_STORAGE)
+			return nullptr;
+		// don't have enough capacity
+		if (chunkIndex >= mChunkArrayCapacity) {
+			IncreaseCapacity();
+		}
+		int pageIndex = GetChunkPageIndex(chunkIndex);
+		if (mChunkPages[pageIndex].load(std::memory_order_relaxed) == nullptr) {
+			void* pPage = GetChunkMemoryAllocator()->Malloc(sizeof(EntityComponentChunk) * ((size_t)1 << pageIndex));
+			mChunkPages[pageIndex].store((EntityComponentChunk*)pPage, std::memory_order_release);
+		}
+		EntityComponentChunk* pChunk = &ChunkAt(chunkIndex);
+		new (pChunk) EntityComponentChunk(chunkIndex, this, mArchetype, &GetChunkLayout(chunkIndex), mGenBase);
+		// the chunk is visible to other threads only after it's constructed
+		mChunkCount.store(chunkIndex + 1, std::memory_order_release);
+		mEmptyChunkCount += 1;
+		return pChunk;
+	}
+
+	// free the pages from 'firstPageIndex' on, their chunks must have been destroyed
+	void FreeChunkPages(int firstPageIndex)
+	{
+		for (int i = firstPageIndex; i < MAX_CHUNK_PAGE_COUNT; i++) {
+			EntityComponentChunk* pPage = mChunkPages[i].load(std::memory_order_relaxed);
+			if (pPage == nullptr)
+				break;
+			mChunkPages[i].store(nullptr, std::memory_order_relaxed);
+			GetChunkMemoryAllocator()->Free(pPage);
+		}
+	}
+
+	// allocate an entity in the given chunk, the memory of an empty chunk might need to be allocated again.
+	// an empty chunk takes 'sharedValues' as the values of its shared components
+	Entity* AllocateInChunk(EntityComponentChunk* pChunk, bool bCallConstructor, const void* const sharedValues[] = nullptr)
+	{
+		if (pChunk->IsEmpty()) {
+			if (pChunk->IsMemoryReleased())
+				pChunk->AllocateMemory();
+			else
+				mEmptyChunkCount -= 1;
+			if (sharedValues != nullptr)
+				pChunk->SetSharedComponents(sharedValues);
+		}
+		RemoveFromOccupancyBucket(pChunk);
+		Entity* pEntity = pChunk->Allocate(bCallConstructor);
+		InsertIntoOccupancyBucket(pChunk);
+		return pEntity;
+	}
+
+	// fill the null ones in 'sharedValues' with the default values
+	void ResolveSharedComponents(const void* const sharedValues[], const void* values[]) const
+	{
+		for (int i = 0; i < mComponentCountPerEntity; i++) {
+			const void* pValue = (sharedValues != nullptr) ? sharedValues[i] : nullptr;
+			values[i] = (pValue != nullptr) ? pValue : mDefaultSharedComponents[i];
+		}
+	}
+
+	// the chunk for a new entity whose shared components are 'values':
+	// one holding the same values with empty blocks, or an empty one.
+	// the last chunk found is tried first, since entities with the same values are often created together
+	EntityComponentChunk* FindSharedChunk(const void* const values[])
+	{
+		if (mLastSharedChunkIndex < mChunkCount) {
+			EntityComponentChunk* pChunk = &ChunkAt(mLastSharedChunkIndex);
+			if (!pChunk->IsEmpty() && !pChunk->IsFull() && pChunk->MatchSharedComponents(values))
+				return pChunk;
+		}
+
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			EntityComponentChunk* pChunk = &ChunkAt(i);
+			if (!pChunk->IsEmpty() && !pChunk->IsFull() && pChunk->MatchSharedComponents(values)) {
+				mLastSharedChunkIndex = i;
+				return pChunk;
+			}
+		}
+		EntityComponentChunk* pEmptyChunk = FindEmptyChunk();
+		if (pEmptyChunk != nullptr)
+			mLastSharedChunkIndex = pEmptyChunk->GetChunkId();
+		return pEmptyChunk;
+	}
+
+	// an empty chunk, preferring the ones whose memory is kept, or a new one if there is none.
+	// null if there is none and the storage is full
+	EntityComponentChunk* FindEmptyChunk()
+	{
+		EntityComponentChunk* pEmptyChunk = nullptr;
+		for (uint16_t i = 0; i < mChunkCount; i++) {
+			EntityComponentChunk* pChunk = &ChunkAt(i);
+			if (pChunk->IsEmpty() && (pEmptyChunk == nullptr || (pEmptyChunk->IsMemoryReleased() && !pChunk->IsMemoryReleased())))
+				pEmptyChunk = pChunk;
+		}
+		if (pEmptyChunk == nullptr)
+			pEmptyChunk = CreateChunk();
+		return pEmptyChunk;
+	}
+
+	// the fullest chunk that isn't full, or an empty one if all the others are full
+	Entity* AllocateFullestFirst(bool bCallConstructor)
+	{
+		uint32_t chunkIndex = mOccupancyBuckets->FindFullest();
+		EntityComponentChunk* pChunk = (chunkIndex != ChunkOccupancyBuckets::INVALID_CHUNK_INDEX) ? &ChunkAt(chunkIndex) : FindEmptyChunk();
+		if (pChunk == nullptr)
+			return nullptr;
+		return AllocateInChunk(pChunk, bCallConstructor);
+	}
+
+	// keep the chunk in the bucket of its empty blocks while it's partially filled, see ChunkOccupancyBuckets
+	void RemoveFromOccupancyBucket(const EntityComponentChunk* pChunk)
+	{
+		if (mOccupancyBuckets && !pChunk->IsEmpty() && !pChunk->IsFull())
+			mOccupancyBuckets->Remove(pChunk->GetChunkId(), pChunk->GetBlockCount() - pChunk->GetUsedCount());
+	}
+
+	void InsertIntoOccupancyBucket(const EntityComponentChunk* pChunk)
+	{
+		if (mOccupancyBuckets && !pChunk->IsEmpty() && !pChunk->IsFull())
+			mOccupancyBuckets->Insert(pChunk->GetChunkId(), pChunk->GetBlockCount() - pChunk->GetUsedCount());
+	}
+
+	// chunks never hold different values of shared components
+	Entity* AllocateShared(bool bCallConstructor, const void* const sharedValues[])
+	{
+		const void* values[MAX_COMPONENT_COUNT_PER_ENTITY];
+		ResolveSharedComponents(sharedValues, values);
+		EntityComponentChunk* pChunk = FindSharedChunk(values);
+		if (pChunk == nullptr)
+			return nullptr;
+		return AllocateInChunk(pChunk, bCallConstructor, values);
+	}
+
+	// deallocate an entity, the memory of the chunk is released when it gets empty, 
+	// unless it's kept as a spare one
+	void DeallocateInChunk(EntityComponentChunk* pChunk, Entity* pEntity, bool bCallDestructor)
+	{
+		RemoveFromOccupancyBucket(pChunk);
+		pChunk->Deallocate(pEntity, bCallDestructor);
+		InsertIntoOccupancyBucket(pChunk);
+		if (pChunk->IsEmpty()) {
+			if (mEmptyChunkCount < mSpareChunkCount)
+				mEmptyChunkCount += 1;
+			else
+				pChunk->ReleaseMemory();
+		}
+	}
+
+	// move an entity into another chunk of this storage, its EntityID isn't changed.
+	// return the entity at its new place
+	Entity* MoveEntity(Entity* pEntity, EntityComponentChunk* pDstChunk, const void* const sharedValues[] = nullptr)
+	{
+		EntityComponentChunk* pSrcChunk = pEntity->GetChunk();
+		EntityID eid = GetEntityID(pEntity);
+		Entity* pDstEntity = AllocateInChunk(pDstChunk, false, sharedValues);
+		for (int i = 0; i < mComponentCountPerEntity; i++) {
+			if (mArchetype->mComponentStrides[i] == 0)
+				continue;
+			if (mArchetype->mComponentLaned[i]) {
+				pDstChunk->CopyLaneComponent(pDstEntity, i, pEntity, i);
+				continue;
+			}
+			ComponentMove* pMove = mArchetype->mComponentMoves[i];
+			(*pMove)(pDstChunk->GetComponentByIndex(pDstEntity, i), pSrcChunk->GetComponentByIndex(pEntity, i));
+		}
+		pDstChunk->CopyEnabledBits(pDstEntity->GetBlockIndex(), pSrcChunk, pEntity->GetBlockIndex());
+		OnEntityMoved(pEntity, pDstEntity, eid);
+		DeallocateInChunk(pSrcChunk, pEntity, false);
+		return pDstEntity;
+	}
+
+	// link all the chunks that aren't full, the partially filled ones are used first,
+	// then the empty ones with memory, and the ones whose memory is released at last.
+	// as before, the list ends with mChunkCount
+	void RebuildChunkFreeList()
+	{
+		mChunkFreeHead = mChunkCount;
+		LinkFreeChunks([](const EntityComponentChunk& chunk) { return chunk.IsMemoryReleased(); });
+		LinkFreeChunks([](const EntityComponentChunk& chunk) { return chunk.IsEmpty() && !chunk.IsMemoryReleased(); });
+		LinkFreeChunks([](const EntityComponentChunk& chunk) { return !chunk.IsEmpty() && !chunk.IsFull(); });
+	}
+
+	// push the chunks that satisfy 'pred' in front of the chunk free list
+	template<typename Pred>
+	void LinkFreeChunks(Pred&& pred)
+	{
+		for (int i = (int)mChunkCount - 1; i >= 0; i--) {
+			if (pred(ChunkAt(i))) {
+				mChunkFreeList[i] = mChunkFreeHead;
+				mChunkFreeHead = (uint16_t)i;
+			}
+		}
+	}
+
+	// in packed mode, a new entity is always put right after the last one
+	Entity* AllocatePacked(bool bCallConstructor)
+	{
+		int chunkIndex = mTailChunkIndex;
+		if (chunkIndex < 0 || ChunkAt(chunkIndex).IsFull())
+			chunkIndex += 1;
+		if (chunkIndex == mChunkCount && CreateChunk() == nullptr)
+			return nullptr;
+
+		EntityComponentChunk* pChunk = &ChunkAt(chunkIndex);
+		FASTECS_ASSERT(pChunk->GetHighWaterMark() == pChunk->GetUsedCount());
+		Entity* pEntity = AllocateInChunk(pChunk, bCallConstructor);
+		FASTECS_ASSERT(pEntity->GetBlockIndex() + 1 == pChunk->GetHighWaterMark());
+		mTailChunkIndex = chunkIndex;
+		return pEntity;
+	}
+
+	// in packed mode, the last entity of the storage is moved into the released block
+	void DeallocatePacked(Entity* pEntity, bool bCallDestructor)
+	{
+		EntityComponentChunk* pTailChunk = &ChunkAt(mTailChunkIndex);
+		Entity* pTailEntity = pTailChunk->GetEntity((uint16_t)(pTailChunk->GetHighWaterMark() - 1));
+
+		if (pTailEntity == pEntity) {
+			DeallocateInChunk(pTailChunk, pEntity, bCallDestructor);
+		}
+		else {
+			EntityComponentChunk* pChunk = pEntity->GetChunk();
+			if (bCallDestructor)
+				pChunk->DestructComponents(pEntity);
+
+			// the released EntityID must not be resolved to the moved entity
+			pChunk->IncreaseGenID(pEntity->GetBlockIndex());
+			EntityID tailEntityID = GetEntityID(pTailEntity);
+			for (int i = 0; i < mComponentCountPerEntity; i++) {
+				if (mArchetype->mComponentStrides[i] == 0)
+					continue;
+				if (mArchetype->mComponentLaned[i]) {
+					pChunk->CopyLaneComponent(pEntity, i, pTailEntity, i);
+					continue;
+				}
+				ComponentMove* pMove = mArchetype->mComponentMoves[i];
+				(*pMove)(pChunk->GetComponentByIndex(pEntity, i), pTailChunk->GetComponentByIndex(pTailEntity, i));
+			}
+			pChunk->CopyEnabledBits(pEntity->GetBlockIndex(), pTailChunk, pTailEntity->GetBlockIndex());
+			OnEntityMoved(pTailEntity, pEntity, tailEntityID);
+			DeallocateInChunk(pTailChunk, pTailEntity, false);
+		}
+
+		if (pTailChunk->IsEmpty())
+			mTailChunkIndex -= 1;
+	}
+
+	// only the free list grows, chunks are never moved
 	void IncreaseCapacity()
 	{
 		mChunkArrayCapacity *= 2;
 		//mChunkFreeList = (uint16_t*)realloc(mChunkFreeList, sizeof(uint16_t) * mChunkArrayCapacity);
-		//mChunks = (EntityComponentChunk*)realloc(mChunks, sizeof(EntityComponentChunk) * mChunkArrayCapacity);
 		mChunkFreeList = (uint16_t*)GetChunkMemoryAllocator()->Realloc(mChunkFreeList, sizeof(uint16_t) * mChunkArrayCapacity);
-		mChunks = (EntityComponentChunk*)GetChunkMemoryAllocator()->Realloc(mChunks, sizeof(EntityComponentChunk) * mChunkArrayCapacity);
 	}
 
 private:
@@ -2073,23 +4626,53 @@ private:
 	EntityArchetype*			mArchetype;
 	size_t						mEntityCountPerChunk;
 	int							mComponentCountPerEntity;
-	size_t						mChunkSize;
 	//size_t						mEntityBlockSize;
 
+	// where each part is placed in the chunks, one layout for each size of the growing chunks, 
+	// and the last one for all the full sized chunks. never changed after construction
+	std::vector<ChunkLayout>	mChunkLayouts;
+
 	// freeList indicates which chunk is free
 	uint16_t*					mChunkFreeList;
 	
-	// an array of chunks, some of whose memory might not be allocated.
+	// the chunk directory, page p holds (1 << p) chunks, some of whose memory might not be allocated.
+	// pages are allocated when needed and never moved, so a chunk keeps its address while the storage grows.
 	// the valid chunks are indicated by mChunkCount
-	// the size of this array is indicated by mChunkArrayCapacity
-	EntityComponentChunk*		mChunks;
+	std::atomic<EntityComponentChunk*>	mChunkPages[MAX_CHUNK_PAGE_COUNT];
 	
-	// the size of chunk array
+	// the size of the free list
 	uint16_t					mChunkArrayCapacity;
 
-	// the valid chunk's count
-	uint16_t					mChunkCount;
+	// the valid chunk's count, chunks below it can be read by other threads
+	std::atomic<uint16_t>		mChunkCount;
 	uint16_t					mChunkFreeHead;
+
+	// the values of the shared components given to the entities by default, see is_shared_component
+	byte*						mDefaultSharedComponents[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+	// the chunk an entity with shared components was put in last time
+	uint16_t					mLastSharedChunkIndex = 0;
+
+	// released entities are replaced by the last one, see EntityStorageMode::Packed
+	bool						mPacked = false;
+
+	// the partially filled chunks by their empty blocks, only in EntityStorageMode::FullestFirst
+	std::unique_ptr<ChunkOccupancyBuckets>	mOccupancyBuckets;
+
+	// the last chunk that isn't empty, only used in packed mode
+	int							mTailChunkIndex = -1;
+
+	// the entities that don't live in the block where they were created
+	EntityRelocationMap			mRelocationMap;
+
+	// the empty chunks whose memory is kept, at most mSpareChunkCount unless more are reserved, see Reserve
+	uint16_t					mEmptyChunkCount = 0;
+	uint16_t					mSpareChunkCount = DEFAULT_SPARE_CHUNK_COUNT;
+
+	// the generation id new chunks start with, it's raised when chunks are removed by Trim
+	EntityGenID					mGenBase = 0;
+
+	// the EntityIDTable of the context, null if the context doesn't use stable EntityIDs
+	EntityIDTable*				mEntityIDTable = nullptr;
 };
 
 #if EVENT_INDEX_TABLE_TYPE == 0
@@ -2228,7 +4811,15 @@ struct ComponentTypesHelperClass<ComponentType, Rest...>
 	static void ConstructEntity(Entity* pEntity, ComponentType&& data, Rest&&... args)
 	{
 		using T = std::decay_t<ComponentType>;
-		if constexpr (!is_type_duplicate_v<T, Rest...>)
+		// the shared ones are given to the chunk when allocating the entity, see GetSharedComponents,
+		// and the chunk components are never set through entities
+		if constexpr (is_lane_component<T>::value)
+		{
+			// it might be laid out in lanes
+			if constexpr (!is_type_duplicate_v<T, Rest...>)
+				pEntity->SetComponent(T(std::forward<ComponentType>(data)));
+		}
+		else if constexpr (!is_type_duplicate_v<T, Rest...> && !is_shared_component<T>::value && !is_chunk_component<T>::value)
 		{
 			T* pComponentMem = pEntity->GetComponent<T>();
 			if (pComponentMem) {
@@ -2242,7 +4833,13 @@ struct ComponentTypesHelperClass<ComponentType, Rest...>
 	static void ConstructEntity(Entity* pEntity)
 	{
 		using T = std::decay_t<ComponentType>;
-		if constexpr (!is_type_duplicate_v<T, Rest...>)
+		if constexpr (is_lane_component<T>::value)
+		{
+			// it might be laid out in lanes
+			if constexpr (!is_type_duplicate_v<T, Rest...>)
+				pEntity->SetComponent(T());
+		}
+		else if constexpr (!is_type_duplicate_v<T, Rest...> && !is_shared_component<T>::value && !is_chunk_component<T>::value)
 		{
 			T* pComponentMem = pEntity->GetComponent<T>();
 			if (pComponentMem) {
@@ -2252,6 +4849,19 @@ struct ComponentTypesHelperClass<ComponentType, Rest...>
 		ComponentTypesHelperClass<Rest...>::ConstructEntity(pEntity);
 	}
 
+	/// point values[i] to the given shared components, 'i' is the component index in the archetype
+	static void GetSharedComponents(const EntityArchetype* pArchetype, const void* values[], const ComponentType& data, const Rest&... args)
+	{
+		using T = std::decay_t<ComponentType>;
+		if constexpr (is_shared_component<T>::value)
+		{
+			int index = pArchetype->GetComponentIndex<T>();
+			if (index != INVALID_COMPONENT_INDEX)
+				values[index] = &data;
+		}
+		ComponentTypesHelperClass<Rest...>::GetSharedComponents(pArchetype, values, args...);
+	}
+
 	/// check if componentTypeId is contained in the list of the given components
 	static bool Contain(ComponentTypeID componentTypeId)
 	{
@@ -2263,9 +4873,107 @@ template<>
 struct ComponentTypesHelperClass<>
 {
 	static void ConstructEntity(Entity* pEntity) {}
+	static void GetSharedComponents(const EntityArchetype*, const void* []) {}
 	static bool Contain(ComponentTypeID) { return false; }
 };
 
+/// SparseComponentSetBase:
+/// the part of a SparseComponentSet that doesn't depend on the component type.
+/// The EntityIDs are packed in the same order as the values, with an index from EntityID to their position
+class SparseComponentSetBase
+{
+public:
+	virtual ~SparseComponentSetBase() {}
+
+	// remove the component of the entity, return false if it doesn't have one
+	virtual bool Remove(EntityID eid) = 0;
+
+	// give 'dstEid' a copy of the component of 'srcEid', if it has one
+	virtual void Copy(EntityID dstEid, EntityID srcEid) = 0;
+
+	bool Contain(EntityID eid) const { return mIndexes.find(eid) != mIndexes.end(); }
+
+	// the count of the entities having the component
+	size_t GetCount() const { return mEntityIDs.size(); }
+
+	const EntityID* GetEntityIDs() const { return mEntityIDs.data(); }
+
+protected:
+	std::vector<EntityID>						mEntityIDs;
+	std::unordered_map<EntityID, uint32_t>		mIndexes;
+};
+
+/// SparseComponentSet:
+/// the values of a sparse component in a context, see is_sparse_component.
+/// The values are packed, the last one is moved into the hole of a removed one,
+/// so adding and removing a component costs O(1) and never touches the entity.
+/// The EntityIDs are kept while the entities are moved, so are the components
+template<typename ComponentType>
+class SparseComponentSet : public SparseComponentSetBase
+{
+public:
+	ComponentType* Find(EntityID eid)
+	{
+		auto it = mIndexes.find(eid);
+		return (it != mIndexes.end()) ? &mValues[it->second] : nullptr;
+	}
+
+	const ComponentType* Find(EntityID eid) const
+	{
+		auto it = mIndexes.find(eid);
+		return (it != mIndexes.end()) ? &mValues[it->second] : nullptr;
+	}
+
+	// add the component of an entity, or replace the one it has
+	template<typename...Args>
+	ComponentType* Add(EntityID eid, Args&&... args)
+	{
+		auto it = mIndexes.find(eid);
+		if (it != mIndexes.end()) {
+			mValues[it->second] = ComponentType(std::forward<Args>(args)...);
+			return &mValues[it->second];
+		}
+		mIndexes.emplace(eid, (uint32_t)mValues.size());
+		mEntityIDs.push_back(eid);
+		mValues.push_back(ComponentType(std::forward<Args>(args)...));
+		return &mValues.back();
+	}
+
+	bool Remove(EntityID eid) override
+	{
+		auto it = mIndexes.find(eid);
+		if (it == mIndexes.end())
+			return false;
+		uint32_t index = it->second;
+		uint32_t lastIndex = (uint32_t)mValues.size() - 1;
+		if (index != lastIndex) {
+			mValues[index] = std::move(mValues[lastIndex]);
+			mEntityIDs[index] = mEntityIDs[lastIndex];
+			mIndexes[mEntityIDs[index]] = index;
+		}
+		mIndexes.erase(it);
+		mValues.pop_back();
+		mEntityIDs.pop_back();
+		return true;
+	}
+
+	void Copy(EntityID dstEid, EntityID srcEid) override
+	{
+		const ComponentType* pValue = Find(srcEid);
+		if (pValue) {
+			// the value might be moved while adding
+			ComponentType value = *pValue;
+			Add(dstEid, std::move(value));
+		}
+	}
+
+	// the values, in the order of GetEntityIDs
+	ComponentType* GetValues() { return mValues.data(); }
+
+private:
+	std::vector<ComponentType>		mValues;
+};
+
 /// EntityContext:
 /// A world can have multiple contexts, 
 /// entities across different contexts are independent, cannot communicate with each other 
@@ -2274,6 +4982,7 @@ class EntityContext
 	friend class World;
 	friend class EntityArchetype;
 	friend class Entity;
+	friend class EntityComponentStorage;
 
 	template<typename...ComponentTypes>
 	friend class ParallelJobBase;
@@ -2281,14 +4990,20 @@ public:
 	EntityContext(int id, World* pWorld, EntityArchetypeManager* pArchetypeManager)
 		:mContextId(id), mWorld(pWorld), mArchetypeManager(pArchetypeManager)
 	{
-
+		for (int i = 0; i < MAX_STORAGE_COUNT_PER_CONTEXT; i++)
+			mStorageDirectory[i].store(nullptr, std::memory_order_relaxed);
 	}
 
-	// create an entity by an archetype
+	// create an entity by an archetype.
+	// all the ways of creating entities return null if the EntityID layout can't address one more:
+	// its storage has MAX_CHUNK_COUNT_PER_STORAGE chunks that are full, 
+	// or the context has MAX_STORAGE_COUNT_PER_CONTEXT storages and the archetype has none
 	Entity* CreateEntity(EntityArchetype* pArchetype)
 	{
 		EntityComponentStorage* pStorage = GetEntityComponentStorage(pArchetype);
-		Entity* pEntity = pStorage->Allocate(true);
+		Entity* pEntity = pStorage ? pStorage->Allocate(true) : nullptr;
+		if (pEntity == nullptr)
+			return nullptr;
 		OnEntityCreated(pEntity);
 		return pEntity;
 	}
@@ -2298,14 +5013,22 @@ public:
 	Entity* CreateEntity(EntityArchetype* pArchetype, Args&&...args)
 	{
 		EntityComponentStorage* pStorage = GetEntityComponentStorage(pArchetype);
-		Entity* pEntity = pStorage->Allocate(false);
+		const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+		ComponentTypesHelperClass<Args...>::GetSharedComponents(pArchetype, sharedValues, args...);
+		Entity* pEntity = pStorage ? pStorage->Allocate(false, sharedValues) : nullptr;
+		if (pEntity == nullptr)
+			return nullptr;
 		int componentCount = pArchetype->mComponentCount;
 		
 		// construct those components whose values aren't provided through parameters
 		for (int i = 0; i < componentCount; i++) {
 			ComponentTypeID componentTypeId = pArchetype->mComponentTypeIds[i];
-			if (!ComponentTypesHelperClass<Args...>::Contain(componentTypeId))
+			if (pArchetype->mComponentStrides[i] != 0 && !ComponentTypesHelperClass<Args...>::Contain(componentTypeId))
 			{
+				if (pArchetype->mComponentLaned[i]) {
+					pEntity->GetChunk()->ConstructLaneComponent(pEntity, i);
+					continue;
+				}
 				byte* pComponentBytes = pStorage->GetComponentByIndex(pEntity, i);
 				ComponentConstructor* pConstructor = pArchetype->mComponentConstructors[i];
 				(*pConstructor)(pComponentBytes);
@@ -2346,7 +5069,11 @@ public:
 		{
 			EntityArchetype* pArchetype = mArchetypeManager->CreateArchetype<std::decay_t<Args>...>();
 			EntityComponentStorage* pStorage = GetEntityComponentStorage(pArchetype);
-			Entity* pEntity = pStorage->Allocate(false);
+			const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+			ComponentTypesHelperClass<Args...>::GetSharedComponents(pArchetype, sharedValues, args...);
+			Entity* pEntity = pStorage ? pStorage->Allocate(false, sharedValues) : nullptr;
+			if (pEntity == nullptr)
+				return nullptr;
 
 			ComponentTypesHelperClass<Args...>::ConstructEntity(pEntity, std::forward<Args>(args)...);
 			OnEntityCreated(pEntity);
@@ -2363,34 +5090,37 @@ public:
 	}
 
 	// return an entity by giving it an id
-	// this id is the same gotten by GetEntityID
+	// this id is the same gotten by GetEntityID.
+	// without stable EntityIDs it can run on other threads while this context creates or releases
+	// other entities and creates storages, see EntityComponentStorage::GetEntity
 	Entity* GetEntity(EntityID eid)
 	{
-		uint16_t genid;
+		if (mEntityIDTable != nullptr)
+			return mEntityIDTable->Find(eid);
+
+		EntityGenID genid;
 		uint8_t contextId;
 		uint16_t chunkIndex, blockIndex, storageIndex;
 		Entity::ParseEntityID(eid, &genid, &contextId, &storageIndex, &chunkIndex, &blockIndex);
-		if (storageIndex >= mEntityComponentStorageList.size()) {
-			return nullptr;
-		}
-		EntityComponentStorage* pStorage = mEntityComponentStorageList[storageIndex];
-		Entity* pEntity = pStorage->GetEntity(chunkIndex, blockIndex);
-		if (pEntity == nullptr)
-			return nullptr;
-		if (pEntity->mGenID != genid) {
+		EntityComponentStorage* pStorage = mStorageDirectory[storageIndex].load(std::memory_order_acquire);
+		if (pStorage == nullptr) {
 			return nullptr;
 		}
-		return pEntity;
+		return pStorage->GetEntity(eid);
 	}
 
 	EntityComponentStorage* GetEntityComponentStorage(EntityArchetype* pArchetype) 
 	{
 		EntityComponentStorage* pStorage = pArchetype->mStoragesInContext[mContextId];
 		if (!pStorage) {
+			// the storage index must fit in EntityID
 			uint16_t index = (uint16_t)mEntityComponentStorageList.size();
-			FASTECS_ASSERT(index < MAX_STORAGE_COUNT_PER_CONTEXT);
+			if (index >= MAX_STORAGE_COUNT_PER_CONTEXT)
+				return nullptr;
 			pStorage = new EntityComponentStorage(this, index, pArchetype);
 			mEntityComponentStorageList.push_back(pStorage);
+			// the storage is visible to GetEntity on other threads only after it's constructed
+			mStorageDirectory[index].store(pStorage, std::memory_order_release);
 			pArchetype->mStoragesInContext[mContextId] = pStorage;
 		}
 		return pStorage;
@@ -2409,7 +5139,12 @@ public:
 		
 		EntityArchetype* pDstArchetype = mArchetypeManager->AddComponents<std::decay_t<ComponentTypes>...>(pSrcArchetype);
 		EntityComponentStorage* pDstStorage = GetEntityComponentStorage(pDstArchetype);
-		Entity* pDstEntity = pDstStorage->Allocate(false);
+		const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+		GetSharedComponents(pDstArchetype, pSrcEntity, sharedValues);
+		ComponentTypesHelperClass<ComponentTypes...>::GetSharedComponents(pDstArchetype, sharedValues, args...);
+		Entity* pDstEntity = pDstStorage ? pDstStorage->Allocate(false, sharedValues) : nullptr;
+		if (pDstEntity == nullptr)
+			return nullptr;
 		CopyEntityData(pDstEntity, pSrcEntity);
 		// construct new added components
 		ComponentTypesHelperClass<ComponentTypes...>::ConstructEntity(pDstEntity, std::forward<ComponentTypes>(args)...);
@@ -2430,7 +5165,11 @@ public:
 
 		EntityArchetype* pDstArchetype = mArchetypeManager->AddComponents<std::decay_t<ComponentTypes>...>(pSrcArchetype);
 		EntityComponentStorage* pDstStorage = GetEntityComponentStorage(pDstArchetype);
-		Entity* pDstEntity = pDstStorage->Allocate(false);
+		const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+		GetSharedComponents(pDstArchetype, pSrcEntity, sharedValues);
+		Entity* pDstEntity = pDstStorage ? pDstStorage->Allocate(false, sharedValues) : nullptr;
+		if (pDstEntity == nullptr)
+			return nullptr;
 		CopyEntityData(pDstEntity, pSrcEntity);
 		// construct new added components
 		ComponentTypesHelperClass<ComponentTypes...>::ConstructEntity(pDstEntity);
@@ -2449,19 +5188,52 @@ public:
 		}
 		EntityArchetype* pDstArchetype = mArchetypeManager->RemoveComponents<std::decay_t<ComponentTypes>...>(pSrcArchetype);
 		EntityComponentStorage* pDstStorage = GetEntityComponentStorage(pDstArchetype);
-		Entity* pDstEntity = pDstStorage->Allocate(false);
+		const void* sharedValues[MAX_COMPONENT_COUNT_PER_ENTITY] = { 0 };
+		GetSharedComponents(pDstArchetype, pSrcEntity, sharedValues);
+		Entity* pDstEntity = pDstStorage ? pDstStorage->Allocate(false, sharedValues) : nullptr;
+		if (pDstEntity == nullptr)
+			return nullptr;
 		CopyEntityData(pDstEntity, pSrcEntity);
 		OnEntityCreated(pDstEntity);
 		return pDstEntity;
 	}
 
+	// 'pNewEntity' was extended from or removed components from 'pOldEntity' and takes its place:
+	// with stable EntityIDs it takes over the ID slot of 'pOldEntity', then 'pOldEntity' is released.
+	// if 'pNewEntity' is null, 'pOldEntity' is kept
+	Entity* ReplaceEntity(Entity* pOldEntity, Entity* pNewEntity)
+	{
+		if (pNewEntity == nullptr)
+			return nullptr;
+		if (mEntityIDTable != nullptr) {
+			EntityComponentChunk* pOldChunk = pOldEntity->GetChunk();
+			EntityComponentChunk* pNewChunk = pNewEntity->GetChunk();
+			uint32_t oldSlot = pOldChunk->GetIDSlot(pOldEntity->GetBlockIndex());
+			uint32_t newSlot = pNewChunk->GetIDSlot(pNewEntity->GetBlockIndex());
+			pOldChunk->SetIDSlot(pOldEntity->GetBlockIndex(), newSlot);
+			pNewChunk->SetIDSlot(pNewEntity->GetBlockIndex(), oldSlot);
+			mEntityIDTable->Update(oldSlot, pNewEntity);
+			mEntityIDTable->Update(newSlot, pOldEntity);
+		}
+		// the sparse components have been copied to both EntityIDs, those of the released one go with it
+		pOldEntity->Release();
+		return pNewEntity;
+	}
+
 	// call ForEach with a list of component types and a callback function
 	template<typename...ComponentTypes, typename F>
 	void ForEach(F&& f)
 	{
-		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
-			if (pStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>()) {
-				pStorage->ForEach<F, ComponentTypes...>(std::forward<F>(f));
+		if constexpr (any_sparse_component_v<ComponentTypes...>) {
+			ForEachWithSparseComponents<ComponentTypes...>([&f](Entity* pEntity, std::decay_t<ComponentTypes>*... pComponents) {
+				f(pEntity, pComponents...);
+			});
+		}
+		else {
+			for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+				if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
+					pStorage->ForEach<F, ComponentTypes...>(std::forward<F>(f));
+				}
 			}
 		}
 	}
@@ -2470,9 +5242,16 @@ public:
 	template<typename...ComponentTypes, typename F, typename RuntimeArg>
 	void ForEach(F&& f, RuntimeArg* pArg)
 	{
-		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
-			if (pStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>()) {
-				pStorage->ForEach<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg);
+		if constexpr (any_sparse_component_v<ComponentTypes...>) {
+			ForEachWithSparseComponents<ComponentTypes...>([&f, pArg](Entity* pEntity, std::decay_t<ComponentTypes>*... pComponents) {
+				f(pArg, pEntity, pComponents...);
+			});
+		}
+		else {
+			for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+				if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
+					pStorage->ForEach<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg);
+				}
 			}
 		}
 	}
@@ -2485,19 +5264,46 @@ public:
 	void ForEachBatch(F&& f)
 	{
 		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
-			if (pStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>()) {
-				pStorage->ForEachBatch<F, ComponentTypes...>(std::forward<F>(f));
+			if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
+				pStorage->ForEachBatch<F, ComponentTypes...>(std::forward<F>(f));
+			}
+		}
+	}
+
+	// call ForEachBatch with a list of component types, a callback function as well as a runtime argument
+	template<typename...ComponentTypes, typename F, typename RuntimeArg>
+	void ForEachBatch(F&& f, RuntimeArg* pArg)
+	{
+		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+			if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
+				pStorage->ForEachBatch<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg);
+			}
+		}
+	}
+
+	// call ForEachBatch on the chunks accepted by 'filter', which is called with each chunk as
+	// bool(const EntityComponentChunk*), e.g. to cull the chunks by their chunk components
+	template<typename...ComponentTypes, typename Filter, typename F>
+	void ForEachBatchFiltered(Filter&& filter, F&& f)
+	{
+		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+			if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
+				pStorage->ForEachBatchFiltered<F, Filter, ComponentTypes...>(std::forward<Filter>(filter), std::forward<F>(f));
 			}
 		}
 	}
 
-	// call ForEachBatch with a list of component types, a callback function as well as a runtime argument
-	template<typename...ComponentTypes, typename F, typename RuntimeArg>
-	void ForEachBatch(F&& f, RuntimeArg* pArg)
+	// call 'f' for each group of lanes of the archetypes that are laid out in lanes, see EntityArchetype::SetLaneWidth.
+	// the prototype of 'f' is void(Entity* pEntities, uint32_t laneMask, lane_field_t<ComponentTypes>*...),
+	// see EntityComponentChunk::ForEachLaneGroup. the other archetypes with these components are skipped
+	template<typename...ComponentTypes, typename F>
+	void ForEachLaneGroup(F&& f)
 	{
+		static_assert((is_lane_component<std::decay_t<ComponentTypes>>::value && ...), "only lane components can be iterated in lanes");
 		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
-			if (pStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>()) {
-				pStorage->ForEachBatch<F, RuntimeArg, ComponentTypes...>(std::forward<F>(f), pArg);
+			const EntityArchetype* pArchetype = pStorage->GetArchetype();
+			if (pArchetype->GetLaneWidth() > 0 && pArchetype->ContainAllComponents<ComponentTypes...>()) {
+				pStorage->ForEachLaneGroup<F, ComponentTypes...>(std::forward<F>(f));
 			}
 		}
 	}
@@ -2519,10 +5325,226 @@ public:
 		}
 	}
 
+	// do the periodic maintenance of all the storages within 'budgetMicroseconds', e.g. once per frame.
+	// for now it defragments the fragmented storages, see EntityComponentStorage::Defragment
+	// return true if all the work is done
+	bool Maintain(uint32_t budgetMicroseconds)
+	{
+		return MaintainUntil(std::chrono::steady_clock::now() + std::chrono::microseconds(budgetMicroseconds));
+	}
+
+	// same as Maintain, but stops at 'deadline'
+	bool MaintainUntil(std::chrono::steady_clock::time_point deadline)
+	{
+		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+			if (pStorage->IsFragmented() && !pStorage->DefragmentUntil(deadline))
+				return false;
+		}
+		return true;
+	}
+
+	// make room for 'count' more entities of the archetype before they are created, e.g. before loading a level,
+	// so creating them never allocates chunks, see EntityComponentStorage::Reserve.
+	// return false if the EntityID layout can't address that many
+	bool Reserve(EntityArchetype* pArchetype, size_t count)
+	{
+		EntityComponentStorage* pStorage = GetEntityComponentStorage(pArchetype);
+		return pStorage != nullptr && pStorage->Reserve(count);
+	}
+
+	template<typename...ComponentTypes>
+	bool Reserve(size_t count)
+	{
+		return Reserve(mArchetypeManager->CreateArchetype<ComponentTypes...>(), count);
+	}
+
+	// give the memory of the empty chunks in all the storages back to the allocator,
+	// see EntityComponentStorage::Trim
+	void Trim()
+	{
+		for (EntityComponentStorage* pStorage : mEntityComponentStorageList) {
+			pStorage->Trim();
+		}
+	}
+
+	// give the entities of this context stable EntityIDs, which are kept while the entities are moved
+	// by Defragment or by a packed storage. Each EntityID refers to a slot in an EntityIDTable,
+	// which refers to the entity, instead of the location of the entity.
+	// call it before any entity is created in this context
+	void EnableStableEntityIDs()
+	{
+		FASTECS_ASSERT(mEntityComponentStorageList.empty());
+		if (mEntityIDTable == nullptr)
+			mEntityIDTable = new EntityIDTable();
+	}
+
+	bool HasStableEntityIDs() const { return mEntityIDTable != nullptr; }
+
+	// create the singleton of type T in this context.
+	// if it's set already, the new value is assigned to the existing object, 
+	// so the pointers to it, e.g. in Singletons objects, stay valid.
+	// singletons hold the global states such as the clock or the input, see Singletons
+	template<typename T, typename...Args>
+	T* SetSingleton(Args&&... args)
+	{
+		uint32_t index = GetSingletonTypeIndex<T>();
+		if (index >= mSingletons.size())
+			mSingletons.resize(index + 1);
+		SingletonSlot& slot = mSingletons[index];
+		if (slot.pData) {
+			T* pSingleton = reinterpret_cast<T*>(slot.pData);
+			if constexpr (std::is_move_assignable_v<T>) {
+				*pSingleton = T(std::forward<Args>(args)...);
+			}
+			else {
+				pSingleton->~T();
+				new (pSingleton) T(std::forward<Args>(args)...);
+			}
+			return pSingleton;
+		}
+		T* pSingleton = new T(std::forward<Args>(args)...);
+		slot.pData = pSingleton;
+		slot.destructor = [](void* pData) { delete reinterpret_cast<T*>(pData); };
+		return pSingleton;
+	}
+
+	// the singleton of type T, null if it hasn't been set.
+	// a const context only gives it to be read
+	template<typename T>
+	T* GetSingleton()
+	{
+		uint32_t index = GetSingletonTypeIndex<T>();
+		return (index < mSingletons.size()) ? reinterpret_cast<T*>(mSingletons[index].pData) : nullptr;
+	}
+
+	template<typename T>
+	const T* GetSingleton() const
+	{
+		return const_cast<EntityContext*>(this)->GetSingleton<T>();
+	}
+
+	// destroy the singleton of type T, the Singletons objects holding it mustn't be used any more
+	template<typename T>
+	void RemoveSingleton()
+	{
+		uint32_t index = GetSingletonTypeIndex<T>();
+		if (index < mSingletons.size() && mSingletons[index].pData) {
+			mSingletons[index].destructor(mSingletons[index].pData);
+			mSingletons[index] = SingletonSlot();
+		}
+	}
+
+	// the sparse set of ComponentType in this context, it's created the first time, see is_sparse_component
+	template<typename ComponentType>
+	SparseComponentSet<ComponentType>* GetSparseComponentSet()
+	{
+		static_assert(is_sparse_component<ComponentType>::value, "not a sparse component");
+		uint32_t index = GetSparseComponentTypeIndex<ComponentType>();
+		if (index >= mSparseComponentSets.size())
+			mSparseComponentSets.resize(index + 1, nullptr);
+		if (mSparseComponentSets[index] == nullptr)
+			mSparseComponentSets[index] = new SparseComponentSet<ComponentType>();
+		return static_cast<SparseComponentSet<ComponentType>*>(mSparseComponentSets[index]);
+	}
+
+	// null if no entity of this context has ever had ComponentType
+	template<typename ComponentType>
+	const SparseComponentSet<ComponentType>* FindSparseComponentSet() const
+	{
+		static_assert(is_sparse_component<ComponentType>::value, "not a sparse component");
+		uint32_t index = GetSparseComponentTypeIndex<ComponentType>();
+		return (index < mSparseComponentSets.size()) ? static_cast<const SparseComponentSet<ComponentType>*>(mSparseComponentSets[index]) : nullptr;
+	}
+
 	World* GetWorld() { return mWorld; }
 	int GetContextId() { return mContextId; }
 
 private:
+	// call f(Entity*, ComponentTypes*...) for each entity having all of ComponentTypes, some of which are sparse.
+	// the smallest sparse set is walked, and the other components of each of its entities are looked up,
+	// it's walked backwards, so 'f' may remove the sparse components of the entity it's called with
+	template<typename...ComponentTypes, typename F>
+	void ForEachWithSparseComponents(F&& f)
+	{
+		const SparseComponentSetBase* sets[] = { FindSparseComponentSetBase<std::decay_t<ComponentTypes>>()... };
+		const SparseComponentSetBase* pSmallestSet = nullptr;
+		for (int i = 0; i < (int)sizeof...(ComponentTypes); i++) {
+			if (!is_sparse_component_list<std::decay_t<ComponentTypes>...>(i))
+				continue;
+			// no entity has this one
+			if (sets[i] == nullptr)
+				return;
+			if (pSmallestSet == nullptr || sets[i]->GetCount() < pSmallestSet->GetCount())
+				pSmallestSet = sets[i];
+		}
+
+		for (size_t i = pSmallestSet->GetCount(); i > 0; i--) {
+			if (i > pSmallestSet->GetCount())
+				continue;
+			EntityID eid = pSmallestSet->GetEntityIDs()[i - 1];
+			Entity* pEntity = GetEntity(eid);
+			if (!pEntity->IsEnabled())
+				continue;
+			std::tuple<Entity*, std::decay_t<ComponentTypes>*...> componentTuple(pEntity, FindComponentOfEntity<std::decay_t<ComponentTypes>>(pEntity, eid)...);
+			if ((std::get<std::decay_t<ComponentTypes>*>(componentTuple) && ...))
+				std::apply(f, componentTuple);
+		}
+	}
+
+	// if the i-th of ComponentTypes is a sparse component
+	template<typename...ComponentTypes>
+	static constexpr bool is_sparse_component_list(int i)
+	{
+		constexpr bool sparses[] = { is_sparse_component<ComponentTypes>::value... };
+		return sparses[i];
+	}
+
+	// null for the components that aren't sparse
+	template<typename ComponentType>
+	const SparseComponentSetBase* FindSparseComponentSetBase() const
+	{
+		if constexpr (is_sparse_component<ComponentType>::value)
+			return FindSparseComponentSet<ComponentType>();
+		else
+			return nullptr;
+	}
+
+	template<typename ComponentType>
+	ComponentType* FindComponentOfEntity(Entity* pEntity, EntityID eid)
+	{
+		if constexpr (is_sparse_component<ComponentType>::value)
+			return GetSparseComponentSet<ComponentType>()->Find(eid);
+		else
+			return pEntity->IsEnabled<ComponentType>() ? pEntity->GetComponent<ComponentType>() : nullptr;
+	}
+
+	// each sparse component type gets an index in mSparseComponentSets the first time it's used
+	template<typename T>
+	static uint32_t GetSparseComponentTypeIndex()
+	{
+		static const uint32_t index = GenSparseComponentTypeIndex();
+		return index;
+	}
+
+	static uint32_t GenSparseComponentTypeIndex()
+	{
+		static std::atomic<uint32_t> index = 0;
+		return index++;
+	}
+
+	// each singleton type gets an index in mSingletons the first time it's used
+	template<typename T>
+	static uint32_t GetSingletonTypeIndex()
+	{
+		static const uint32_t index = GenSingletonTypeIndex();
+		return index;
+	}
+
+	static uint32_t GenSingletonTypeIndex()
+	{
+		static std::atomic<uint32_t> index = 0;
+		return index++;
+	}
 	
 	void OnEntityCreated(Entity* pEntity)
 	{
@@ -2534,17 +5556,63 @@ private:
 	{
 		DeleteEntityEvent evt(pEntity);
 		TriggerEvent(evt);
+
+		// the sparse components go with the entity
+		if (!mSparseComponentSets.empty()) {
+			EntityID eid = pEntity->GetEntityID();
+			for (SparseComponentSetBase* pSet : mSparseComponentSets) {
+				if (pSet)
+					pSet->Remove(eid);
+			}
+		}
+	}
+
+	// give pDstEntity a copy of each sparse component of pSrcEntity
+	void CopySparseComponents(const Entity* pDstEntity, const Entity* pSrcEntity)
+	{
+		if (mSparseComponentSets.empty())
+			return;
+		EntityID dstEid = pDstEntity->GetEntityID();
+		EntityID srcEid = pSrcEntity->GetEntityID();
+		for (SparseComponentSetBase* pSet : mSparseComponentSets) {
+			if (pSet)
+				pSet->Copy(dstEid, srcEid);
+		}
 	}
 
 public:
 
-	// copy all components' data from pSrcEntity to pDstEntity
+	// point values[i] to the shared components of pSrcEntity, 'i' is the component index in pDstArchetype
+	void GetSharedComponents(const EntityArchetype* pDstArchetype, const Entity* pSrcEntity, const void* values[])
+	{
+		for (int i = 0; i < pDstArchetype->mComponentCount; i++) {
+			if (pDstArchetype->mComponentShareds[i])
+				values[i] = pSrcEntity->GetComponentByTypeID(pDstArchetype->mComponentTypeIds[i]);
+		}
+	}
+
+	// copy all components' data from pSrcEntity to pDstEntity, including the sparse ones and the enabled bits
 	void CopyEntityData(Entity* pDstEntity, const Entity* pSrcEntity)
 	{
+		CopySparseComponents(pDstEntity, pSrcEntity);
 		const EntityArchetype* pSrcArchetype = pSrcEntity->GetArchetype();
+		const EntityArchetype* pDstArchetype = pDstEntity->GetArchetype();
+		EntityComponentChunk* pDstChunk = pDstEntity->GetChunk();
+		const EntityComponentChunk* pSrcChunk = pSrcEntity->GetChunk();
+		pDstChunk->SetEnabled(pDstEntity->GetBlockIndex(), 0, pSrcChunk->IsEnabled(pSrcEntity->GetBlockIndex(), 0));
 		for (int i = 0; i < pSrcArchetype->mComponentCount; i++) {
 			ComponentTypeID componentTypeID = pSrcArchetype->mComponentTypeIds[i];
-			byte* pDstComponentMem = pDstEntity->GetComponentByTypeID(componentTypeID);
+			int dstIndex = pDstArchetype->GetComponentIndex(componentTypeID);
+			if (dstIndex == INVALID_COMPONENT_INDEX)
+				continue;
+			pDstChunk->SetEnabled(pDstEntity->GetBlockIndex(), dstIndex + 1, pSrcChunk->IsEnabled(pSrcEntity->GetBlockIndex(), i + 1));
+			if (pSrcArchetype->mComponentStrides[i] == 0)
+				continue;
+			if (pSrcArchetype->mComponentLaned[i] || pDstArchetype->mComponentLaned[dstIndex]) {
+				pDstEntity->GetChunk()->CopyLaneComponent(pDstEntity, dstIndex, pSrcEntity, i);
+				continue;
+			}
+			byte* pDstComponentMem = pDstEntity->GetComponentByIndex(dstIndex);
 			if (pDstComponentMem) {
 				const byte* pSrcComponentMem = pSrcEntity->GetComponentByIndex(i);
 				ComponentAssignment* pAssignment = pSrcArchetype->mComponentAssignments[i];
@@ -2556,9 +5624,53 @@ public:
 private:
 	int					mContextId;
 	std::vector<EntityComponentStorage*>		mEntityComponentStorageList;
+
+	// the storages indexed by the storage index of the EntityIDs, for GetEntity on other threads.
+	// unlike mEntityComponentStorageList it's never moved, and a storage is stored after it's constructed
+	std::atomic<EntityComponentStorage*>		mStorageDirectory[MAX_STORAGE_COUNT_PER_CONTEXT];
 	World*						mWorld;
 	EntityArchetypeManager*		mArchetypeManager;
 	EventManager*				mEventManager = nullptr;
+
+	// null if the EntityIDs are the locations of the entities, see EnableStableEntityIDs
+	EntityIDTable*				mEntityIDTable = nullptr;
+
+	// the singletons indexed by GetSingletonTypeIndex
+	struct SingletonSlot
+	{
+		void*					pData = nullptr;
+		void					(*destructor)(void*) = nullptr;
+	};
+	std::vector<SingletonSlot>	mSingletons;
+
+	// the sparse sets indexed by GetSparseComponentTypeIndex, null for the types never used in this context
+	std::vector<SparseComponentSetBase*>	mSparseComponentSets;
+};
+
+/// Singletons:
+/// the singletons that ForEach callbacks or jobs read (const T) or write (T), e.g. Singletons<const Clock, Input>.
+/// they are looked up once when it's constructed, then it's passed as the runtime argument of ForEach,
+/// ForEachBatch, DeferredJob or ParallelJob, and the callbacks get them with Get<T>() without any lookup.
+/// it stays valid when the singletons are set again, but not when they are removed
+template<typename...SingletonTypes>
+class Singletons
+{
+	// a const context is enough if all the singletons are only read
+	using ContextType = std::conditional_t<(std::is_const_v<SingletonTypes> && ...), const EntityContext, EntityContext>;
+
+public:
+	explicit Singletons(ContextType* pContext)
+		: mSingletons(pContext->template GetSingleton<std::remove_const_t<SingletonTypes>>()...)
+	{
+		FASTECS_ASSERT(((std::get<SingletonTypes*>(mSingletons) != nullptr) && ...));
+	}
+
+	// a singleton declared as const T can only be read through Get<const T>()
+	template<typename T>
+	T* Get() const { return std::get<T*>(mSingletons); }
+
+private:
+	std::tuple<SingletonTypes*...>	mSingletons;
 };
 
 /// chunk segment that is put into an parallelJob
@@ -2600,7 +5712,7 @@ public:
 		int threadTaskCounts[MAX_THREAD_COUNT] = { 0 };
 		std::vector<EntityComponentStorage*> vecStorages;
 		for (EntityComponentStorage* pStorage : pContext->mEntityComponentStorageList) {
-			if (pStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>()) {
+			if (pStorage->GetArchetype()->CanIterateComponents<ComponentTypes...>()) {
 				vecStorages.push_back(pStorage);
 			}
 		}
@@ -2617,13 +5729,17 @@ public:
 			uint16_t chunkCount = pStorage->mChunkCount;
 			for (uint16_t i = 0; i < chunkCount; i++) {
 				auto pChunk = pStorage->GetChunk((int)i);
+				// blocks after the high-water mark are all empty
+				int highWaterMark = pChunk->GetHighWaterMark();
+				if (highWaterMark == 0)
+					continue;
 				auto threadIndexSelected = std::min_element(threadTaskCounts, threadTaskCounts + threadCount) - threadTaskCounts;
 				ParallelJobChunkSegement chunkSegment;
 				chunkSegment.pChunk = pChunk;
 				chunkSegment.RangeStart = 0;
-				chunkSegment.RangeEnd = (int)(pStorage->mEntityCountPerChunk);
+				chunkSegment.RangeEnd = highWaterMark;
 				mDividedJobChunkSegmentArray[threadIndexSelected].push_back(chunkSegment);
-				threadTaskCounts[threadIndexSelected] += (int)(pStorage->mEntityCountPerChunk);
+				threadTaskCounts[threadIndexSelected] += highWaterMark;
 			}
 		}
 #elif DIVIDE_PARALLEL_JOB_METHOD == 1
@@ -2632,10 +5748,6 @@ public:
 		for (EntityComponentStorage* pStorage : vecStorages)
 		{
 			int chunkCount = (int)(pStorage->mChunkCount);
-			int entityCountPerChunk = (int)pStorage->mEntityCountPerChunk;
-			// divide the entire chunk into many segments, each segment per thread
-			int entityCountPerThread = entityCountPerChunk / threadCount;
-			entityCountPerThread = entityCountPerThread / 16 * 16;
 			
 			for (int i = 0; i < chunkCount; i++)
 			{
@@ -2643,8 +5755,29 @@ public:
 				// we give the last segment to the specific thread with the least tasks currently. 
 				auto pChunk = pStorage->GetChunk(i);
 
+				// only divide the blocks below the high-water mark, the rest are all empty
+				int entityCountPerChunk = pChunk->GetHighWaterMark();
+				if (entityCountPerChunk == 0)
+					continue;
+				// divide the entire chunk into many segments, each segment per thread
+				int entityCountPerThread = entityCountPerChunk / threadCount;
+				entityCountPerThread = entityCountPerThread / 16 * 16;
+
 				// find the thread with the least tasks
 				auto threadIndexSelected = std::min_element(threadTaskCounts, threadTaskCounts + threadCount) - threadTaskCounts;
+
+				// small chunks (see ChunkSizePolicy) aren't worth dividing, 
+				// the whole chunk is given to the thread with the least tasks
+				if (entityCountPerThread < 64)
+				{
+					ParallelJobChunkSegement chunkSegment;
+					chunkSegment.pChunk = pChunk;
+					chunkSegment.RangeStart = 0;
+					chunkSegment.RangeEnd = entityCountPerChunk;
+					mDividedJobChunkSegmentArray[threadIndexSelected].push_back(chunkSegment);
+					threadTaskCounts[threadIndexSelected] += entityCountPerChunk;
+					continue;
+				}
 				int currentStartIndex = 0;
 
 				for (int j = 0; j < threadCount; j++)
@@ -2872,11 +6005,42 @@ private:
 	std::function<void(Entity*, int, ComponentTypes *...)>		mFunction;
 };
 
+EntityComponentChunk* Entity::GetChunk() const
+{
+	return *reinterpret_cast<EntityComponentChunk* const*>((uintptr_t)this & ~(uintptr_t)(ENTITY_HANDLE_ALIGNMENT - 1));
+}
+
+uint16_t Entity::GetBlockIndex() const
+{
+	return (uint16_t)(((uintptr_t)this & (ENTITY_HANDLE_ALIGNMENT - 1)) - ENTITY_HANDLES_OFFSET);
+}
+
+uint16_t Entity::GetChunkIndex() const
+{
+	return GetChunk()->GetChunkId();
+}
+
+EntityGenID Entity::GetGenID() const
+{
+	return GetChunk()->GetGenID(GetBlockIndex());
+}
+
+EntityComponentStorage* Entity::GetStorage() const
+{
+	return GetChunk()->GetStorage();
+}
+
+bool Entity::IsValid() const
+{
+	return GetChunk()->IsOccupied(GetBlockIndex());
+}
+
 void Entity::Release()
 {
-	FASTECS_ASSERT(mValid);
-	this->mStorage->mContext->OnEntityDeleted(this);
-	mStorage->Deallocate(this, true);
+	FASTECS_ASSERT(IsValid());
+	EntityComponentStorage* pStorage = GetStorage();
+	pStorage->mContext->OnEntityDeleted(this);
+	pStorage->Deallocate(this, true);
 }
 
 /// World must be singleton in the entire system.
@@ -2892,10 +6056,12 @@ public:
 		return &_inst;
 	}
 
+	// return null if MAX_CONTEXT_COUNT contexts are alive
 	EntityContext* CreateContext()
 	{
 		auto id = FindAvaibableContextId();
-		FASTECS_ASSERT(id != -1);
+		if (id == -1)
+			return nullptr;
 		auto pContext = new EntityContext(id, this, mArchetypeManager);
 		mEntityContexts[id] = pContext;
 		return pContext;
@@ -2953,6 +6119,19 @@ public:
 		}
 	}
 
+	template<typename...ComponentTypes, typename Filter, typename F>
+	void ForEachBatchFiltered(Filter&& filter, F&& f)
+	{
+		for (int i = 0; i < MAX_CONTEXT_COUNT; i++)
+		{
+			EntityContext* pContext = mEntityContexts[i];
+			if (pContext)
+			{
+				pContext->ForEachBatchFiltered<ComponentTypes...>(std::forward<Filter>(filter), std::forward<F>(f));
+			}
+		}
+	}
+
 	~World()
 	{
 		FASTECS_SAFE_DELETE(mArchetypeManager);
@@ -2980,21 +6159,72 @@ public:
 			m_pChunkMemoryAllocator = &mStandardChunkMemoryAllocator;
 		else 
 			m_pChunkMemoryAllocator = pAllocator; 
+		mChunkMemoryPool.SetAllocator(m_pChunkMemoryAllocator);
+	}
+
+	// Keep the memory of released chunks in size classes and reuse it for any archetype, see ChunkMemoryPool.
+	// sizeClassStep: 0 means rounding chunk sizes up to powers of two, otherwise to multiples of it
+	// maxPooledBytes: the memory released beyond it goes back to the allocator
+	void EnableChunkMemoryPool(size_t sizeClassStep = 0, size_t maxPooledBytes = 256 * 1024 * 1024)
+	{
+		mChunkMemoryPool.Enable(sizeClassStep, maxPooledBytes);
+	}
+
+	// Give the pooled memory back to the allocator, and stop pooling
+	void DisableChunkMemoryPool()
+	{
+		mChunkMemoryPool.Disable();
 	}
 
+	// All the memory of the storages goes through this pool
+	ChunkMemoryPool* GetChunkMemoryPool() { return &mChunkMemoryPool; }
+
+	// How many entities are put in each chunk, for the archetypes that don't have their own policy.
+	// only the storages created later use the new policy
+	void SetChunkSizePolicy(const ChunkSizePolicy& policy) { mChunkSizePolicy = policy; }
+	const ChunkSizePolicy& GetChunkSizePolicy() const { return mChunkSizePolicy; }
+
 	World()
+		: mChunkMemoryPool(&mStandardChunkMemoryAllocator)
 	{
 		memset(mEntityContexts, 0, sizeof(mEntityContexts));
 		mArchetypeManager = new EntityArchetypeManager();
 		m_pChunkMemoryAllocator = &mStandardChunkMemoryAllocator;
 	}
 
+	// do the periodic maintenance of all the contexts within 'budgetMicroseconds', 
+	// see EntityContext::Maintain
+	bool Maintain(uint32_t budgetMicroseconds)
+	{
+		auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budgetMicroseconds);
+		for (int i = 0; i < MAX_CONTEXT_COUNT; i++)
+		{
+			EntityContext* pContext = mEntityContexts[i];
+			if (pContext && !pContext->MaintainUntil(deadline))
+				return false;
+		}
+		return true;
+	}
+
+	// give the memory of the empty chunks in all the contexts back to the allocator,
+	// as well as the memory kept by the chunk memory pool
+	void Trim()
+	{
+		for (int i = 0; i < MAX_CONTEXT_COUNT; i++)
+		{
+			EntityContext* pContext = mEntityContexts[i];
+			if (pContext)
+				pContext->Trim();
+		}
+		mChunkMemoryPool.Flush();
+	}
+
 	// Return an entity by giving an EntityID
 	Entity* GetEntity(EntityID eid)
 	{
 		// get context id 
 		uint8_t contextId = Entity::ExtractContextIdFromEntityID(eid);
-		if (mEntityContexts[contextId] == nullptr)
+		if (contextId >= MAX_CONTEXT_COUNT || mEntityContexts[contextId] == nullptr)
 			return nullptr;
 		return mEntityContexts[contextId]->GetEntity(eid);
 	}
@@ -3020,6 +6250,8 @@ private:
 	//bool							mContextIdsUsed[MAX_CONTEXT_COUNT] = { false };
 	IChunkMemoryAllocator*			m_pChunkMemoryAllocator;
 	StandardChunkMemoryAllocator	mStandardChunkMemoryAllocator;
+	ChunkMemoryPool					mChunkMemoryPool;
+	ChunkSizePolicy					mChunkSizePolicy;
 };
 
 void EntityContext::Release()
@@ -3031,9 +6263,20 @@ void EntityContext::Release()
 	for (auto pEntityComponentStorage : mEntityComponentStorageList) {
 		auto pArchetype = pEntityComponentStorage->GetArchetype();
 		pArchetype->mStoragesInContext[mContextId] = nullptr;
+		mStorageDirectory[pEntityComponentStorage->GetIndex()].store(nullptr, std::memory_order_relaxed);
 		FASTECS_SAFE_DELETE(pEntityComponentStorage);
 	}
 	mEntityComponentStorageList.clear();
+	FASTECS_SAFE_DELETE(mEntityIDTable);
+	for (SingletonSlot& slot : mSingletons) {
+		if (slot.pData)
+			slot.destructor(slot.pData);
+	}
+	mSingletons.clear();
+	for (SparseComponentSetBase* pSet : mSparseComponentSets) {
+		FASTECS_SAFE_DELETE(pSet);
+	}
+	mSparseComponentSets.clear();
 	mWorld->RemoveContext(this);
 	delete this;
 }
@@ -3041,66 +6284,79 @@ void EntityContext::Release()
 template<typename ComponentType>
 ComponentType* Entity::GetComponent()
 {
-	return mStorage->GetComponent<ComponentType>(this);
+	if constexpr (is_sparse_component<ComponentType>::value)
+		return const_cast<ComponentType*>(static_cast<const Entity*>(this)->GetComponent<ComponentType>());
+	else
+		return GetStorage()->GetComponent<ComponentType>(this);
 }
 
 template<typename ComponentType>
 const ComponentType* Entity::GetComponent() const
 {
-	return mStorage->GetComponent<ComponentType>(this);
+	if constexpr (is_sparse_component<ComponentType>::value) {
+		auto pSet = GetStorage()->mContext->FindSparseComponentSet<ComponentType>();
+		return pSet ? pSet->Find(GetEntityID()) : nullptr;
+	}
+	else
+		return GetStorage()->GetComponent<ComponentType>(this);
 }
 
 template<typename ComponentType>
 int Entity::GetComponentIndex() const
 {
-	return mStorage->GetArchetype()->GetComponentIndex<ComponentType>();
+	return GetStorage()->GetArchetype()->GetComponentIndex<ComponentType>();
 }
 
 int Entity::GetComponentIndex(ComponentTypeID componentTypeID) const
 {
-	return mStorage->GetArchetype()->GetComponentIndex(componentTypeID);
+	return GetStorage()->GetArchetype()->GetComponentIndex(componentTypeID);
 }
 
 template<typename T/*=byte*/>
 T* Entity::GetComponentByIndex(int index)
 {
-	return mStorage->GetComponentByIndex<T>(this, index);
+	return GetStorage()->GetComponentByIndex<T>(this, index);
 }
 
 template<typename T/*=byte*/>
 T* Entity::GetComponentByTypeID(ComponentTypeID typeId)
 {
-	return mStorage->GetComponentByTypeID<T>(this, typeId);
+	return GetStorage()->GetComponentByTypeID<T>(this, typeId);
 }
 
 template<typename T/*=byte*/>
 const T* Entity::GetComponentByIndex(int index) const
 {
-	return mStorage->GetComponentByIndex<T>(this, index);
+	return GetStorage()->GetComponentByIndex<T>(this, index);
 }
 
 template<typename T/*=byte*/>
 const T* Entity::GetComponentByTypeID(ComponentTypeID typeId) const
 {
-	return mStorage->GetComponentByTypeID<T>(this, typeId);
+	return GetStorage()->GetComponentByTypeID<T>(this, typeId);
 }
 
 template<typename ComponentType>
 bool Entity::ContainComponent() const
 {
-	return mStorage->GetArchetype()->ContainComponent<ComponentType>();
+	if constexpr (is_sparse_component<ComponentType>::value) {
+		auto pSet = GetStorage()->mContext->FindSparseComponentSet<ComponentType>();
+		return pSet != nullptr && pSet->Contain(GetEntityID());
+	}
+	else
+		return GetStorage()->GetArchetype()->ContainComponent<ComponentType>();
 }
 
 template<typename... ComponentTypes>
 bool Entity::ContainAllComponents() const
 {
-	return mStorage->GetArchetype()->ContainAllComponents<ComponentTypes...>();
+	return GetStorage()->GetArchetype()->ContainAllComponents<ComponentTypes...>();
 }
 
 template<typename... ComponentTypes>
 bool Entity::ContainAnyComponents() const
 {
-	return mStorage->GetArchetype()->ContainAnyComponents<ComponentTypes...>();
+	return GetStorage()->GetArchetype()->ContainAnyComponents<ComponentTypes...>();
 }
 
 // Get EntityID of this entity.
@@ -3108,37 +6364,42 @@ bool Entity::ContainAnyComponents() const
 // You can get entity by EntityID throught calling GetEntity() method
 EntityID Entity::GetEntityID() const
 {
-	// an entity id contains:
-	// |<-----16:GenID----->||<--8:contextID-->||<----X:storageId---->||<---Z:chunkId--->||<---Z:block--->|
+	return GetStorage()->GetEntityID(this);
+}
+
+EntityID Entity::ComposeEntityID(EntityGenID genid, uint8_t contextId,
+	uint16_t storageIndex, uint16_t chunkIndex, uint16_t blockIndex)
+{
+	// an entity id contains, see EntityIDLayout:
+	// |<-----G:GenID----->||<--C:contextID-->| ... |<----X:storageId---->||<---Y:chunkId--->||<---Z:block--->|
+	// G is GEN_ID_BITS
+	// C is CONTEXT_ID_BITS
+	// X is MAX_STORAGE_COUNT_BITS
 	// Y is MAX_CHUNK_COUNT_BITS
 	// Z is MAX_BLOCK_COUNT_BITS
-	// X is (40 - X - Y)
 
-	return ((uint64_t)mGenID << 48)
-		| ((uint64_t)mStorage->mContext->GetContextId() << 40)
-		| ((uint64_t)mStorage->GetIndex() << ((int)MAX_CHUNK_COUNT_BITS + (int)MAX_BLOCK_COUNT_BITS))
-		| ((uint64_t)mChunkIndex << MAX_BLOCK_COUNT_BITS)
-		| (uint64_t)mBlockIndex;
+	return (EntityID)((((uint64_t)genid & GEN_ID_MASK) << GEN_ID_SHIFT)
+		| ((uint64_t)contextId << CONTEXT_ID_SHIFT)
+		| ((uint64_t)storageIndex << ((int)MAX_CHUNK_COUNT_BITS + (int)MAX_BLOCK_COUNT_BITS))
+		| ((uint64_t)chunkIndex << MAX_BLOCK_COUNT_BITS)
+		| (uint64_t)blockIndex);
 }
 
 EntityContext* Entity::GetContext()
 {
-	return mStorage->mContext;
+	return GetStorage()->mContext;
 }
 
-void Entity::ParseEntityID(EntityID eid, uint16_t* genid,
+void Entity::ParseEntityID(EntityID eid, EntityGenID* genid,
 	uint8_t* contextId,
 	uint16_t* storageIndex,
 	uint16_t* chunkIndex, uint16_t* blockIndex)
 {
-	// an entity id contains:
-	// |<-----16:GenID----->||<--8:contextID-->||<----X:storageId---->||<---Z:chunkId--->||<---Z:block--->|
-	// Y is MAX_CHUNK_COUNT_BITS
-	// Z is MAX_BLOCK_COUNT_BITS
-	// X is (40 - X - Y)
+	// an entity id contains, see ComposeEntityID:
+	// |<-----G:GenID----->||<--C:contextID-->| ... |<----X:storageId---->||<---Y:chunkId--->||<---Z:block--->|
 
-	*genid = (uint16_t)((eid >> 48) & 0x0FFFF);
-	*contextId = (uint8_t)((eid >> 40) & 0x0FF);
+	*genid = (EntityGenID)(((uint64_t)eid >> GEN_ID_SHIFT) & GEN_ID_MASK);
+	*contextId = ExtractContextIdFromEntityID(eid);
 	*storageIndex = (uint16_t)((eid >> ((int)MAX_CHUNK_COUNT_BITS + (int)MAX_BLOCK_COUNT_BITS)) & STORAGE_INDEX_MASK);
 	*chunkIndex = (uint16_t)((eid >> MAX_BLOCK_COUNT_BITS) & CHUNK_INDEX_MASK);
 	*blockIndex = (uint16_t)(eid & BLOCK_INDEX_MASK);
@@ -3146,22 +6407,22 @@ void Entity::ParseEntityID(EntityID eid, uint16_t* genid,
 
 uint8_t Entity::ExtractContextIdFromEntityID(EntityID eid)
 {
-	return (uint8_t)((eid >> 40) & 0x0FF);
+	return (uint8_t)(((uint64_t)eid >> CONTEXT_ID_SHIFT) & ((1u << CONTEXT_ID_BITS) - 1));
 }
 
 EntityArchetype* Entity::GetArchetype() 
 {
-	return mStorage->GetArchetype();
+	return GetStorage()->GetArchetype();
 }
 
 const EntityArchetype* Entity::GetArchetype() const
 {
-	return mStorage->GetArchetype();
+	return GetStorage()->GetArchetype();
 }
 
 int Entity::GetComponentCount() const
 {
-	return mStorage->mComponentCountPerEntity;
+	return GetStorage()->mComponentCountPerEntity;
 }
 
 // extend current entity by a list of component types.
@@ -3170,7 +6431,7 @@ int Entity::GetComponentCount() const
 template<typename...ComponentTypes>
 Entity* Entity::Extend(ComponentTypes&&... args) const
 {
-	return mStorage->mContext->ExtendEntity<ComponentTypes...>(this, std::forward<ComponentTypes>(args)...);
+	return GetStorage()->mContext->ExtendEntity<ComponentTypes...>(this, std::forward<ComponentTypes>(args)...);
 }
 
 // extend current entity by a list of component types.
@@ -3178,26 +6439,103 @@ Entity* Entity::Extend(ComponentTypes&&... args) const
 template<typename...ComponentTypes>
 Entity* Entity::Extend() const
 {
-	return mStorage->mContext->ExtendEntity<ComponentTypes...>(this);
+	return GetStorage()->mContext->ExtendEntity<ComponentTypes...>(this);
+}
+
+template<typename ComponentType, typename...Args>
+ComponentType* Entity::AddSparseComponent(Args&&... args)
+{
+	return GetStorage()->mContext->GetSparseComponentSet<ComponentType>()->Add(GetEntityID(), std::forward<Args>(args)...);
+}
+
+template<typename ComponentType>
+bool Entity::RemoveSparseComponent()
+{
+	return GetStorage()->mContext->GetSparseComponentSet<ComponentType>()->Remove(GetEntityID());
+}
+
+void Entity::SetEnabled(bool bEnabled)
+{
+	GetChunk()->SetEnabled(GetBlockIndex(), 0, bEnabled);
+}
+
+bool Entity::IsEnabled() const
+{
+	return GetChunk()->IsEnabled(GetBlockIndex(), 0);
+}
+
+template<typename ComponentType>
+bool Entity::SetEnabled(bool bEnabled)
+{
+	static_assert(!is_sparse_component<ComponentType>::value, "a sparse component is removed instead of disabled");
+	int index = GetComponentIndex<ComponentType>();
+	if (index == INVALID_COMPONENT_INDEX)
+		return false;
+	GetChunk()->SetEnabled(GetBlockIndex(), index + 1, bEnabled);
+	return true;
+}
+
+template<typename ComponentType>
+bool Entity::IsEnabled() const
+{
+	static_assert(!is_sparse_component<ComponentType>::value, "a sparse component is removed instead of disabled");
+	int index = GetComponentIndex<ComponentType>();
+	return index != INVALID_COMPONENT_INDEX && GetChunk()->IsEnabled(GetBlockIndex(), index + 1);
+}
+
+template<typename ComponentType>
+Entity* Entity::SetSharedComponent(const ComponentType& data)
+{
+	static_assert(is_shared_component<ComponentType>::value, "not a shared component");
+	int index = GetComponentIndex<ComponentType>();
+	if (index == INVALID_COMPONENT_INDEX)
+		return nullptr;
+	return GetStorage()->SetSharedComponent(this, index, &data);
+}
+
+template<typename ComponentType>
+bool Entity::LoadComponent(ComponentType* pValue) const
+{
+	static_assert(is_lane_component<ComponentType>::value, "not a lane component");
+	int index = GetComponentIndex<ComponentType>();
+	if (index == INVALID_COMPONENT_INDEX)
+		return false;
+	GetChunk()->LoadLaneComponent(GetBlockIndex(), index, pValue);
+	return true;
 }
 
 template<typename ComponentType>
 bool Entity::SetComponent(ComponentType&& data)
 {
 	using T = std::decay_t<ComponentType>;
-	T* pComponent = GetComponent<T>();
-	if (!pComponent) {
-		return false;
+	if constexpr (is_lane_component<T>::value)
+	{
+		int index = GetComponentIndex<T>();
+		if (index == INVALID_COMPONENT_INDEX)
+			return false;
+		const T value = std::forward<ComponentType>(data);
+		GetChunk()->StoreLaneComponent(GetBlockIndex(), index, &value);
+		return true;
+	}
+	else
+	{
+		T* pComponent = GetComponent<T>();
+		if (!pComponent) {
+			return false;
+		}
+		*pComponent = std::forward<ComponentType>(data);
+		return true;
 	}
-	*pComponent = std::forward<ComponentType>(data);
-	return true;
 }
 
 // clone current entity, 
 // return a new entity
 Entity* Entity::Clone() const
 {
-	return mStorage->CloneEntity(this);
+	Entity* pClonedEntity = GetStorage()->CloneEntity(this);
+	if (pClonedEntity != nullptr)
+		GetStorage()->mContext->CopySparseComponents(pClonedEntity, this);
+	return pClonedEntity;
 }
 
 // remove component types from current entity.
@@ -3205,12 +6543,48 @@ Entity* Entity::Clone() const
 template<typename...ComponentTypes>
 Entity* Entity::Remove() const
 {
-	return mStorage->mContext->RemoveComponentsFromEntity<ComponentTypes...>(this);
+	return GetStorage()->mContext->RemoveComponentsFromEntity<ComponentTypes...>(this);
+}
+
+template<typename...ComponentTypes>
+Entity* Entity::AddComponents(ComponentTypes&&... args)
+{
+	EntityContext* pContext = GetStorage()->mContext;
+	return pContext->ReplaceEntity(this, pContext->ExtendEntity<ComponentTypes...>(this, std::forward<ComponentTypes>(args)...));
+}
+
+template<typename...ComponentTypes>
+Entity* Entity::AddComponents()
+{
+	EntityContext* pContext = GetStorage()->mContext;
+	return pContext->ReplaceEntity(this, pContext->ExtendEntity<ComponentTypes...>(this));
+}
+
+template<typename...ComponentTypes>
+Entity* Entity::RemoveComponents()
+{
+	EntityContext* pContext = GetStorage()->mContext;
+	return pContext->ReplaceEntity(this, pContext->RemoveComponentsFromEntity<ComponentTypes...>(this));
 }
 
 IChunkMemoryAllocator* EntityComponentStorage::GetChunkMemoryAllocator()
 {
-	return mContext->GetWorld()->GetChunkMemoryAllocator();
+	return mContext->GetWorld()->GetChunkMemoryPool();
+}
+
+int EntityComponentStorage::GetContextId() const
+{
+	return mContext->GetContextId();
+}
+
+EntityIDTable* EntityComponentStorage::GetContextEntityIDTable() const
+{
+	return mContext->mEntityIDTable;
+}
+
+const ChunkSizePolicy& EntityComponentStorage::GetWorldChunkSizePolicy() const
+{
+	return mContext->GetWorld()->GetChunkSizePolicy();
 }
 
 
@@ -110,6 +110,68 @@ DefineComponent(Velocity)
 	inline bool operator!=(const Velocity& other) const;
 };
 
+// a cold component, rarely accessed
+DefineComponent(Description)
+{
+	static constexpr bool cold_component = true;
+	char	text[256] = { 0 };
+};
+
+// a component that must be aligned for SIMD loads
+struct alignas(64) SimdVector : public FastECS::component_name_class<INVALID_COMPONENT_TYPE_ID, FASTECS_STR("SimdVector")>
+{
+	float	values[16] = { 0 };
+};
+
+// a tag component, it has no data
+DefineComponent(IsEnemy)
+{
+	static inline int constructCount = 0;
+	IsEnemy() { constructCount++; }
+};
+
+// a shared component, stored once per chunk
+DefineComponent(Team)
+{
+	static constexpr bool shared_component = true;
+	int		id = 0;
+
+	Team() {}
+	Team(int id) : id(id) {}
+	bool operator==(const Team& other) const { return id == other.id; }
+};
+
+// a chunk component, the range of the yaws in a chunk
+DefineComponent(YawBounds)
+{
+	static constexpr bool chunk_component = true;
+	float	minYaw = FLT_MAX;
+	float	maxYaw = -FLT_MAX;
+};
+
+// a lane component, it can be laid out in lanes
+DefineComponent(Particle)
+{
+	using lane_field_type = float;
+	float	x = 0;
+	float	y = 0;
+	float	z = 0;
+	float	mass = 1.0f;
+
+	Particle() {}
+	Particle(float x, float y, float z) : x(x), y(y), z(z) {}
+};
+
+// a sparse component, it's kept outside the archetypes
+DefineComponent(Stunned)
+{
+	static constexpr bool sparse_component = true;
+	float	duration = 0;
+
+	Stunned() {}
+	Stunned(float duration) : duration(duration) {}
+};
+
 #else
 
 DefineComponentWithID(Profile, 1)
@@ -146,6 +208,68 @@ DefineComponentWithID(Velocity, 3)
 	inline bool operator!=(const Velocity& other) const;
 };
 
+// a cold component, rarely accessed
+DefineComponentWithID(Description, 4)
+{
+	static constexpr bool cold_component = true;
+	char	text[256] = { 0 };
+};
+
+// a component that must be aligned for SIMD loads
+struct alignas(64) SimdVector : public FastECS::component_name_class<5, FASTECS_STR("SimdVector")>
+{
+	float	values[16] = { 0 };
+};
+
+// a tag component, it has no data
+DefineComponentWithID(IsEnemy, 6)
+{
+	static inline int constructCount = 0;
+	IsEnemy() { constructCount++; }
+};
+
+// a shared component, stored once per chunk
+DefineComponentWithID(Team, 7)
+{
+	static constexpr bool shared_component = true;
+	int		id = 0;
+
+	Team() {}
+	Team(int id) : id(id) {}
+	bool operator==(const Team& other) const { return id == other.id; }
+};
+
+// a chunk component, the range of the yaws in a chunk
+DefineComponentWithID(YawBounds, 8)
+{
+	static constexpr bool chunk_component = true;
+	float	minYaw = FLT_MAX;
+	float	maxYaw = -FLT_MAX;
+};
+
+// a lane component, it can be laid out in lanes
+DefineComponentWithID(Particle, 9)
+{
+	using lane_field_type = float;
+	float	x = 0;
+	float	y = 0;
+	float	z = 0;
+	float	mass = 1.0f;
+
+	Particle() {}
+	Particle(float x, float y, float z) : x(x), y(y), z(z) {}
+};
+
+// a sparse component, it's kept outside the archetypes
+DefineComponentWithID(Stunned, 10)
+{
+	static constexpr bool sparse_component = true;
+	float	duration = 0;
+
+	Stunned() {}
+	Stunned(float duration) : duration(duration) {}
+};
+
 // comment out the following code to replace the above definination
 // for memory alignment testing
 //struct alignas(64) Velocity : public FastECS::component_name_class<3, FASTECS_STR("Velocity")>
@@ -199,7 +199,9 @@ TEST_CASE("Create Entity in different ways", "[CreateEntity]")
 
 	SECTION("Create a large number of entities")
 	{
-		const int n = 1000 * 1000;
+		// as many as the EntityID layout can address, up to a million
+		size_t entityCountPerChunk = pContext->GetEntityComponentStorage(pActorArchetype)->GetEntityCountPerChunk();
+		const int n = (int)std::min<size_t>(1000 * 1000, MAX_CHUNK_COUNT_PER_STORAGE * entityCountPerChunk);
 		std::vector<Profile> profiles;
 		std::vector<Velocity> velocities;
 		std::vector<EntityID> entityIds;
@@ -847,6 +849,2128 @@ TEST_CASE("Migration of entities", "EntityContext")
 }
 
 
+TEST_CASE("Iterate chunks with released entities", "ForEach")
+{
+	World* pWorld = World::GetInstance();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 5000;
+	std::vector<Entity*> entities;
+	for (int i = 0; i < n; i++)
+	{
+		Profile profile("Test", i);
+		entities.push_back(pContext->CreateEntity<Profile, Transform>(profile));
+	}
+
+	// release every entity whose age is not a multiple of 3, and the last 500 entities
+	int expectedSum = 0;
+	int expectedCount = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 3 != 0 || i >= n - 500) {
+			entities[i]->Release();
+		}
+		else {
+			expectedSum += i;
+			expectedCount += 1;
+		}
+	}
+
+	SECTION("ForEach only visits valid entities")
+	{
+		int sum = 0;
+		int count = 0;
+		pContext->ForEach<Profile>([&sum, &count](Entity* pEntity, Profile* pProfile) {
+			REQUIRE(pEntity->IsValid());
+			sum += pProfile->age;
+			count += 1;
+		});
+		REQUIRE(sum == expectedSum);
+		REQUIRE(count == expectedCount);
+	}
+
+	SECTION("ForEachBatch only gives runs of valid entities")
+	{
+		int sum = 0;
+		int count = 0;
+		pContext->ForEachBatch<Profile>([&sum, &count](Entity* pEntity, int entityCount, Profile* pProfile) {
+			for (int i = 0; i < entityCount; i++) {
+				REQUIRE(pEntity->IsValid());
+				sum += pProfile->age;
+				count += 1;
+				AdvancePointers(pEntity, pProfile);
+			}
+		});
+		REQUIRE(sum == expectedSum);
+		REQUIRE(count == expectedCount);
+	}
+
+	SECTION("ParallelJob only visits valid entities")
+	{
+		const int threadCount = 3;
+		std::atomic<int> sum(0);
+		std::atomic<int> count(0);
+		ParallelJob<false, Profile> job1([&sum, &count](Entity* pEntity, Profile* pProfile) {
+			sum.fetch_add(pProfile->age);
+			count++;
+		});
+		job1.Prepare(pContext, threadCount);
+		std::thread threads[threadCount];
+		for (int i = 0; i < threadCount; i++) {
+			threads[i] = std::thread([&]() { job1.Execute(); });
+		}
+		for (int i = 0; i < threadCount; i++) {
+			threads[i].join();
+		}
+		REQUIRE(sum.load() == expectedSum);
+		REQUIRE(count.load() == expectedCount);
+	}
+
+	pContext->Release();
+}
+
+TEST_CASE("Packed storage mode", "EntityStorageMode")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	pArchetype->SetStorageMode(EntityStorageMode::Packed);
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Profile profile("Test", i);
+		Entity* pEntity = pContext->CreateEntity(pArchetype, profile);
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// release entities in a scattered order, the last entities are moved into the holes
+	std::vector<bool> released(n, false);
+	for (int i = 0; i < n; i += 2)
+	{
+		int index = (i * 7) % n;
+		if (!released[index]) {
+			pContext->GetEntity(entityIds[index])->Release();
+			released[index] = true;
+		}
+	}
+
+	int expectedCount = 0;
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		if (released[i]) {
+			correctness &= (int)(pEntity == nullptr);
+		}
+		else {
+			expectedCount += 1;
+			correctness &= (int)(pEntity != nullptr && pEntity->GetComponent<Profile>()->age == i);
+			correctness &= (int)(pEntity != nullptr && pEntity->GetEntityID() == entityIds[i]);
+		}
+	}
+	REQUIRE(correctness);
+
+	// every batch is one whole chunk, and only the last one may be partially filled
+	int count = 0;
+	int batchCount = 0;
+	int partialBatchCount = 0;
+	pContext->ForEachBatch<Profile>([&](Entity* pEntity, int entityCount, Profile* pProfile) {
+		count += entityCount;
+		batchCount += 1;
+		if (entityCount != MAX_ENTITY_COUNT_PER_CHUNK)
+			partialBatchCount += 1;
+	});
+	REQUIRE(count == expectedCount);
+	REQUIRE(batchCount == (expectedCount + MAX_ENTITY_COUNT_PER_CHUNK - 1) / MAX_ENTITY_COUNT_PER_CHUNK);
+	REQUIRE(partialBatchCount <= 1);
+
+	// new entities are appended after the last one
+	Entity* pNewEntity = pContext->CreateEntity(pArchetype, Profile("New", -1));
+	EntityID newEntityId = pNewEntity->GetEntityID();
+	REQUIRE(pContext->GetEntity(newEntityId) == pNewEntity);
+	for (int i = 0; i < n; i++)
+	{
+		if (!released[i])
+			REQUIRE(pContext->GetEntity(entityIds[i])->GetComponent<Profile>()->age == i);
+	}
+
+	pContext->Release();
+	pArchetype->SetStorageMode(EntityStorageMode::Default);
+}
+
+
+// the chunk where an entity was created, it's the current one if the entity has never been moved
+static int GetCreationChunkIndex(Entity* pEntity)
+{
+	EntityGenID genid;
+	uint8_t contextId;
+	uint16_t storageIndex, chunkIndex, blockIndex;
+	Entity::ParseEntityID(pEntity->GetEntityID(), &genid, &contextId, &storageIndex, &chunkIndex, &blockIndex);
+	return chunkIndex;
+}
+
+TEST_CASE("Fullest first storage mode", "EntityStorageMode")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity, IsEnemy>();
+	pArchetype->SetStorageMode(EntityStorageMode::FullestFirst);
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 5000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	const int chunkCount = pStorage->GetChunkCount();
+	REQUIRE(chunkCount == (int)((n + pStorage->GetEntityCountPerChunk() - 1) / pStorage->GetEntityCountPerChunk()));
+
+	// leave a different count of entities in each chunk
+	std::vector<bool> released(n, false);
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		int chunkId = GetCreationChunkIndex(pEntity);
+		if (i % (chunkId + 2) != 0) {
+			pEntity->Release();
+			released[i] = true;
+		}
+	}
+
+	// each new entity goes to the fullest chunk that isn't full
+	int correctness = 1;
+	for (int i = 0; i < n / 2; i++)
+	{
+		int maxUsedCount = 0;
+		for (int j = 0; j < pStorage->GetChunkCount(); j++) {
+			EntityComponentChunk* pChunk = pStorage->GetChunk(j);
+			if (!pChunk->IsFull())
+				maxUsedCount = std::max(maxUsedCount, pChunk->GetUsedCount());
+		}
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		pEntity->GetComponent<Transform>()->yaw = -1.0f;
+		correctness &= (int)(pStorage->GetChunk(GetCreationChunkIndex(pEntity))->GetUsedCount() == maxUsedCount + 1);
+	}
+	REQUIRE(correctness);
+
+	// the entities are in as few chunks as possible, without defragmenting the storage
+	int liveCount = 0;
+	for (int i = 0; i < n; i++)
+		liveCount += released[i] ? 0 : 1;
+	liveCount += n / 2;
+	int usedChunkCount = 0;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+		usedChunkCount += pStorage->GetChunk(i)->IsEmpty() ? 0 : 1;
+	REQUIRE(usedChunkCount <= (int)((liveCount + pStorage->GetEntityCountPerChunk() - 1) / pStorage->GetEntityCountPerChunk()) + 1);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (!released[i])
+			correctness &= (int)(pContext->GetEntity(entityIds[i])->GetComponent<Transform>()->yaw == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// releasing the entities of a chunk gives its memory back
+	for (int i = 0; i < 2; i++)
+	{
+		EntityComponentChunk* pChunk = pStorage->GetChunk(chunkCount - 1 - i);
+		std::vector<Entity*> entities;
+		pChunk->ForEachOccupiedRange(0, MAX_ENTITY_COUNT_PER_CHUNK, [&](int rangeStart, int rangeEnd) {
+			for (int j = rangeStart; j < rangeEnd; j++)
+				entities.push_back(pChunk->GetEntity((uint16_t)j));
+		});
+		for (Entity* pEntity : entities)
+			pEntity->Release();
+	}
+	REQUIRE(pStorage->GetAllocatedChunkCount() == chunkCount - 2 + pStorage->GetSpareChunkCount());
+
+	int count = 0;
+	pContext->ForEach<Transform, Velocity>([&count](Entity* pEntity, Transform* pTransform, Velocity* pVelocity) {
+		count += 1;
+	});
+	int entityCount = 0;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+		entityCount += pStorage->GetChunk(i)->GetUsedCount();
+	REQUIRE(count == entityCount);
+
+	// defragmenting keeps the buckets up to date
+	pStorage->Defragment(1000000);
+	for (int i = 0; i < 100; i++)
+	{
+		int maxUsedCount = 0;
+		for (int j = 0; j < pStorage->GetChunkCount(); j++) {
+			EntityComponentChunk* pChunk = pStorage->GetChunk(j);
+			if (!pChunk->IsFull())
+				maxUsedCount = std::max(maxUsedCount, pChunk->GetUsedCount());
+		}
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		correctness &= (int)(pStorage->GetChunk(GetCreationChunkIndex(pEntity))->GetUsedCount() == maxUsedCount + 1);
+	}
+	REQUIRE(correctness);
+
+	pContext->Release();
+	pArchetype->SetStorageMode(EntityStorageMode::Default);
+}
+
+TEST_CASE("Defragment storages", "Defragment")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 10000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Profile profile("Test", i);
+		Entity* pEntity = pContext->CreateEntity(pArchetype, profile);
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// keep one entity in every five, scattered over all the chunks
+	std::vector<bool> released(n, false);
+	int expectedCount = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 5 != 0) {
+			pContext->GetEntity(entityIds[i])->Release();
+			released[i] = true;
+		}
+		else {
+			expectedCount += 1;
+		}
+	}
+
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->IsFragmented());
+	// no time to move anything
+	REQUIRE(pStorage->Defragment(0) == false);
+	REQUIRE(pStorage->IsFragmented());
+
+	// the maintenance hook defragments in several calls
+	while (!pWorld->Maintain(100)) {}
+	REQUIRE(pStorage->IsFragmented() == false);
+	REQUIRE(pStorage->Defragment(0));
+
+	int usedChunkCount = 0;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++) {
+		if (!pStorage->GetChunk(i)->IsEmpty())
+			usedChunkCount += 1;
+	}
+	REQUIRE(usedChunkCount == (expectedCount + MAX_ENTITY_COUNT_PER_CHUNK - 1) / MAX_ENTITY_COUNT_PER_CHUNK);
+
+	// the moved entities are still found by their EntityIDs
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		if (released[i]) {
+			correctness &= (int)(pEntity == nullptr);
+		}
+		else {
+			correctness &= (int)(pEntity != nullptr && pEntity->GetComponent<Profile>()->age == i);
+			correctness &= (int)(pEntity != nullptr && pEntity->GetEntityID() == entityIds[i]);
+		}
+	}
+	REQUIRE(correctness);
+
+	int count = 0;
+	pContext->ForEach<Profile>([&count](Entity* pEntity, Profile* pProfile) {
+		count += 1;
+	});
+	REQUIRE(count == expectedCount);
+
+	// release the moved entities and create new ones in the freed blocks
+	for (int i = 0; i < n; i += 10)
+	{
+		pContext->GetEntity(entityIds[i])->Release();
+		released[i] = true;
+	}
+	for (int i = 0; i < n; i += 10)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("New", -i));
+		REQUIRE(pContext->GetEntity(pEntity->GetEntityID()) == pEntity);
+		REQUIRE(pContext->GetEntity(entityIds[i]) == nullptr);
+	}
+	for (int i = 0; i < n; i++)
+	{
+		if (!released[i])
+			REQUIRE(pContext->GetEntity(entityIds[i])->GetComponent<Profile>()->age == i);
+	}
+
+	pContext->Release();
+}
+
+
+TEST_CASE("Release empty chunks and trim storages", "Trim")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int chunkCount = 10;
+	const int n = chunkCount * MAX_ENTITY_COUNT_PER_CHUNK;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == chunkCount);
+
+	// only the first chunk is still used, one empty chunk is kept as a spare one
+	for (int i = MAX_ENTITY_COUNT_PER_CHUNK; i < n; i++)
+		pContext->GetEntity(entityIds[i])->Release();
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 1 + DEFAULT_SPARE_CHUNK_COUNT);
+	for (int i = MAX_ENTITY_COUNT_PER_CHUNK; i < n; i++)
+		REQUIRE(pContext->GetEntity(entityIds[i]) == nullptr);
+
+	pContext->Trim();
+	REQUIRE(pStorage->GetChunkCount() == 1);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 1);
+
+	// the removed chunks are created again, the old EntityIDs must not refer to the new entities
+	std::vector<EntityID> newEntityIds;
+	for (int i = MAX_ENTITY_COUNT_PER_CHUNK; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("New", i));
+		newEntityIds.push_back(pEntity->GetEntityID());
+	}
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+	int correctness = 1;
+	for (int i = MAX_ENTITY_COUNT_PER_CHUNK; i < n; i++)
+	{
+		correctness &= (int)(pContext->GetEntity(entityIds[i]) == nullptr);
+		Entity* pEntity = pContext->GetEntity(newEntityIds[i - MAX_ENTITY_COUNT_PER_CHUNK]);
+		correctness &= (int)(pEntity != nullptr && pEntity->GetComponent<Profile>()->age == i);
+	}
+	for (int i = 0; i < MAX_ENTITY_COUNT_PER_CHUNK; i++)
+		correctness &= (int)(pContext->GetEntity(entityIds[i])->GetComponent<Profile>()->age == i);
+	REQUIRE(correctness);
+
+	// keep more spare chunks
+	pStorage->SetSpareChunkCount(3);
+	for (EntityID eid : newEntityIds)
+		pContext->GetEntity(eid)->Release();
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 1 + 3);
+	pStorage->SetSpareChunkCount(2);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 1 + 2);
+
+	// the chunks whose memory has been released are reused
+	int count = 0;
+	for (int i = 0; i < MAX_ENTITY_COUNT_PER_CHUNK * 4; i++)
+		pContext->CreateEntity(pArchetype, Profile("Reuse", i));
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+	REQUIRE(pStorage->GetAllocatedChunkCount() <= 1 + 4 + 2);
+	pContext->ForEach<Profile>([&count](Entity* pEntity, Profile* pProfile) {
+		count += 1;
+	});
+	REQUIRE(count == MAX_ENTITY_COUNT_PER_CHUNK * 5);
+
+	pWorld->Trim();
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 5);
+	REQUIRE(pContext->GetEntity(entityIds[0])->GetComponent<Profile>()->age == 0);
+
+	pContext->Release();
+}
+
+// counts the calls that take memory from the system
+class CountingChunkMemoryAllocator : public StandardChunkMemoryAllocator
+{
+public:
+	virtual void* Malloc(size_t sizeBytes) override
+	{
+		allocationCount++;
+		allocatedBytes += sizeBytes;
+		return StandardChunkMemoryAllocator::Malloc(sizeBytes);
+	}
+	// counts the new size, which is an upper bound of the bytes added
+	virtual void* Realloc(void* ptr, std::size_t new_size) override
+	{
+		allocationCount++;
+		allocatedBytes += new_size;
+		return StandardChunkMemoryAllocator::Realloc(ptr, new_size);
+	}
+	virtual void* MallocAligned(size_t sizeBytes, size_t alignment) override
+	{
+		allocationCount++;
+		alignedBytes += GetAlignedAllocationSize(sizeBytes, alignment);
+		allocatedBytes += GetAlignedAllocationSize(sizeBytes, alignment);
+		return StandardChunkMemoryAllocator::MallocAligned(sizeBytes, alignment);
+	}
+	int allocationCount = 0;
+	// the bytes of the aligned allocations, and of all of them
+	size_t alignedBytes = 0;
+	size_t allocatedBytes = 0;
+};
+
+TEST_CASE("Reserve room for entities", "Reserve")
+{
+	World* pWorld = World::GetInstance();
+	CountingChunkMemoryAllocator allocator;
+	pWorld->SetChunkMemoryAllocator(&allocator);
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Transform>();
+	EntityContext* pContext = pWorld->CreateContext();
+	pContext->EnableStableEntityIDs();
+
+	// no chunk is allocated while the reserved entities are created
+	const int n = 5000;
+	pContext->Reserve(pArchetype, n);
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	const int chunkCount = pStorage->GetChunkCount();
+	const int countPerChunk = (int)pStorage->GetEntityCountPerChunk();
+	REQUIRE(chunkCount == (n + countPerChunk - 1) / countPerChunk);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == chunkCount);
+	int allocationCount = allocator.allocationCount;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+		entityIds.push_back(pContext->CreateEntity(pArchetype, Profile("Reserved", i))->GetEntityID());
+	REQUIRE(allocator.allocationCount == allocationCount);
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+
+	// the empty blocks of the partially filled chunks are counted, and the released chunks are allocated again
+	for (int i = 0; i < n; i++)
+		pContext->GetEntity(entityIds[i])->Release();
+	pContext->Trim();
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 0);
+	pContext->CreateEntity(pArchetype, Profile("First", 0));
+	pContext->Reserve(pArchetype, countPerChunk - 1);
+	REQUIRE(pStorage->GetChunkCount() == 1);
+	pContext->Reserve(pArchetype, countPerChunk);
+	REQUIRE(pStorage->GetChunkCount() == 2);
+	REQUIRE(pStorage->GetAllocatedChunkCount() == 2);
+	allocationCount = allocator.allocationCount;
+	for (int i = 1; i <= countPerChunk; i++)
+		pContext->CreateEntity(pArchetype, Profile("Second", i));
+	REQUIRE(allocator.allocationCount == allocationCount);
+	int sum = 0;
+	pContext->ForEach<Profile>([&sum](Entity* pEntity, Profile* pProfile) { sum += pProfile->age; });
+	REQUIRE(sum == countPerChunk * (countPerChunk + 1) / 2);
+	pContext->Release();
+
+	// growing chunks of a packed storage
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy::EntityCount(MAX_ENTITY_COUNT_PER_CHUNK).Growing(16));
+	EntityArchetype* pPackedArchetype = pWorld->CreateArchetype<Transform, Velocity, Description>();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Packed);
+	pContext = pWorld->CreateContext();
+	pContext->Reserve<Transform, Velocity, Description>(n);
+	pStorage = pContext->GetEntityComponentStorage(pPackedArchetype);
+	allocationCount = allocator.allocationCount;
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity(pPackedArchetype)->GetComponent<Transform>()->yaw = (float)i;
+	REQUIRE(allocator.allocationCount == allocationCount);
+	int count = 0;
+	pContext->ForEach<Transform>([&count](Entity* pEntity, Transform* pTransform) { count += (int)(pTransform->yaw == (float)count); });
+	REQUIRE(count == n);
+	pContext->Release();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Default);
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy());
+	pWorld->SetChunkMemoryAllocator(nullptr);
+}
+
+
+TEST_CASE("Hot and cold components", "ColdComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Transform, Description>();
+	REQUIRE(pArchetype->IsComponentCold<Description>());
+	REQUIRE(pArchetype->IsComponentCold<Profile>() == false);
+	pArchetype->SetComponentCold<Profile>();
+	REQUIRE(pArchetype->IsComponentCold<Profile>());
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		sprintf_s(pEntity->GetComponent<Description>()->text, "Entity %d", i);
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// the cold components aren't in the chunk memory any more
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->GetChunkSize() < pStorage->GetEntityCountPerChunk() * sizeof(Profile));
+	REQUIRE(pStorage->GetColdChunkSize() >= pStorage->GetEntityCountPerChunk() * (sizeof(Profile) + sizeof(Description)));
+
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		char text[256];
+		sprintf_s(text, "Entity %d", i);
+		correctness &= (int)(pEntity->GetComponent<Profile>()->age == i);
+		correctness &= (int)(pEntity->GetComponent<Transform>()->yaw == (float)i);
+		correctness &= (int)(strcmp(pEntity->GetComponent<Description>()->text, text) == 0);
+	}
+	REQUIRE(correctness);
+
+	// iterating the hot components never touches the cold memory
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+	{
+		EntityComponentChunk* pChunk = pStorage->GetChunk(i);
+		const byte* pBegin = pChunk->GetMemory();
+		const byte* pEnd = pBegin + pStorage->GetChunkSize();
+		pChunk->ForEachOccupiedRange(0, MAX_ENTITY_COUNT_PER_CHUNK, [&](int rangeStart, int rangeEnd) {
+			for (int j = rangeStart; j < rangeEnd; j++) {
+				Entity* pEntity = pChunk->GetEntity((uint16_t)j);
+				const byte* pTransform = (const byte*)pEntity->GetComponent<Transform>();
+				const byte* pProfile = (const byte*)pEntity->GetComponent<Profile>();
+				const byte* pDescription = (const byte*)pEntity->GetComponent<Description>();
+				correctness &= (int)(pTransform >= pBegin && pTransform + sizeof(Transform) <= pEnd);
+				correctness &= (int)(pProfile < pBegin || pProfile >= pEnd);
+				correctness &= (int)(pDescription < pBegin || pDescription >= pEnd);
+			}
+		});
+	}
+	REQUIRE(correctness);
+
+	float sum = 0;
+	pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+		sum += pTransform->yaw;
+	});
+	REQUIRE(sum == (float)(n * (n - 1) / 2));
+
+	// cold components are moved and copied like the hot ones
+	Entity* pEntity = pContext->GetEntity(entityIds[10]);
+	Entity* pExtended = pEntity->Extend<Velocity>();
+	REQUIRE(pExtended->GetComponent<Profile>()->age == 10);
+	REQUIRE(strcmp(pExtended->GetComponent<Description>()->text, "Entity 10") == 0);
+
+	pContext->Release();
+}
+
+
+TEST_CASE("Tag components", "TagComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, IsEnemy>();
+	EntityArchetype* pUntagged = pWorld->CreateArchetype<Transform>();
+	REQUIRE(pArchetype != pUntagged);
+	REQUIRE(pArchetype->ContainComponent<IsEnemy>());
+
+	// the tag takes no memory in the blocks
+	REQUIRE(EntityComponentChunk::CalculateBlockSize(pArchetype) == EntityComponentChunk::CalculateBlockSize(pUntagged));
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	IsEnemy::constructCount = 0;
+	for (int i = 0; i < n; i++)
+	{
+		EntityArchetype* pEntityArchetype = (i % 3 == 0) ? pArchetype : pUntagged;
+		Entity* pEntity = pContext->CreateEntity(pEntityArchetype);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	// and is never constructed
+	REQUIRE(IsEnemy::constructCount == 0);
+
+	Entity* pEntity = pContext->GetEntity(entityIds[0]);
+	REQUIRE(pEntity->ContainComponent<IsEnemy>());
+	REQUIRE(pEntity->GetComponent<IsEnemy>() != nullptr);
+	REQUIRE(pContext->GetEntity(entityIds[1])->ContainComponent<IsEnemy>() == false);
+
+	// queries match the tagged entities only
+	int count = 0;
+	float sum = 0;
+	pContext->ForEach<Transform, IsEnemy>([&](Entity* pEntity, Transform* pTransform, IsEnemy* pIsEnemy) {
+		count++;
+		sum += pTransform->yaw;
+	});
+	REQUIRE(count == n / 3);
+	REQUIRE(sum == (float)(3 * (n / 3) * (n / 3 - 1) / 2));
+
+	// moving between archetypes keeps the data
+	Entity* pExtended = pContext->GetEntity(entityIds[3])->Extend<Velocity>();
+	REQUIRE(pExtended->ContainComponent<IsEnemy>());
+	REQUIRE(pExtended->GetComponent<Transform>()->yaw == 3.0f);
+	REQUIRE(IsEnemy::constructCount == 0);
+
+	pContext->Release();
+}
+
+TEST_CASE("Shared components", "SharedComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Team>();
+	REQUIRE(pArchetype->GetSharedComponentCount() == 1);
+	// the shared component takes no memory in the blocks
+	REQUIRE(EntityComponentChunk::CalculateBlockSize(pArchetype) == EntityComponentChunk::CalculateBlockSize(pWorld->CreateArchetype<Transform>()));
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = (i % 4 == 3) ? pContext->CreateEntity(pArchetype) : pContext->CreateEntity(pArchetype, Team(i % 4));
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)(pEntity->GetComponent<Team>()->id == ((i % 4 == 3) ? 0 : i % 4));
+		correctness &= (int)(pEntity->GetComponent<Transform>()->yaw == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// each batch sees the single value of its chunk
+	int counts[3] = { 0 };
+	pContext->ForEachBatch<Transform, Team>([&](Entity* pEntity, int count, Transform* pTransform, Team* pTeam) {
+		for (int i = 0; i < count; i++)
+			correctness &= (int)(pEntity[i].GetComponent<Team>() == pTeam);
+		counts[pTeam->id] += count;
+	});
+	REQUIRE(correctness);
+	REQUIRE(counts[0] == n / 2);
+	REQUIRE(counts[1] == n / 4);
+	REQUIRE(counts[2] == n / 4);
+
+	// changing the value moves the entity into another chunk
+	Entity* pEntity = pContext->GetEntity(entityIds[1]);
+	Entity* pMoved = pEntity->SetSharedComponent(Team(5));
+	REQUIRE(pMoved != pEntity);
+	REQUIRE(pMoved->GetComponent<Team>()->id == 5);
+	REQUIRE(pMoved->GetComponent<Transform>()->yaw == 1.0f);
+	REQUIRE(pContext->GetEntity(entityIds[1]) == pMoved);
+	REQUIRE(pMoved->SetSharedComponent(Team(5)) == pMoved);
+
+	// the value is kept by the new entities
+	Entity* pExtended = pMoved->Extend<Velocity>();
+	REQUIRE(pExtended->GetComponent<Team>()->id == 5);
+	Entity* pCloned = pMoved->Clone();
+	REQUIRE(pCloned->GetComponent<Team>()->id == 5);
+	REQUIRE(pCloned->GetComponent<Transform>()->yaw == 1.0f);
+
+	// entities are only packed together with the ones of the same value
+	for (int i = 0; i < n; i += 2)
+		pContext->GetEntity(entityIds[i])->Release();
+	REQUIRE(pContext->Maintain(1000000));
+	pContext->ForEachBatch<Transform, Team>([&](Entity* pEntity, int count, Transform* pTransform, Team* pTeam) {
+		for (int i = 0; i < count; i++) {
+			int index = (int)pTransform[i].yaw;
+			int expectedId = (index == 1) ? 5 : ((index % 4 == 3) ? 0 : index % 4);
+			correctness &= (int)(pEntity[i].GetComponent<Team>() == pTeam && pTeam->id == expectedId);
+		}
+	});
+	REQUIRE(correctness);
+
+	pContext->Release();
+}
+
+TEST_CASE("Chunk components", "ChunkComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, YawBounds>();
+	REQUIRE(EntityComponentChunk::CalculateBlockSize(pArchetype) == EntityComponentChunk::CalculateBlockSize(pWorld->CreateArchetype<Transform>()));
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity(pArchetype)->GetComponent<Transform>()->yaw = (float)i;
+
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->GetChunkCount() > 2);
+	REQUIRE(pStorage->GetChunk(0)->GetChunkComponent<YawBounds>()->maxYaw == -FLT_MAX);
+
+	// the batches write the value of their chunk
+	pContext->ForEachBatch<Transform, YawBounds>([](Entity* pEntity, int count, Transform* pTransform, YawBounds* pBounds) {
+		for (int i = 0; i < count; i++) {
+			pBounds->minYaw = std::min(pBounds->minYaw, pTransform[i].yaw);
+			pBounds->maxYaw = std::max(pBounds->maxYaw, pTransform[i].yaw);
+		}
+	});
+	const YawBounds* pFirstBounds = pStorage->GetChunk(0)->GetChunkComponent<YawBounds>();
+	REQUIRE(pFirstBounds->minYaw == 0.0f);
+	REQUIRE(pFirstBounds->maxYaw == (float)(pStorage->GetEntityCountPerChunk() - 1));
+
+	// the chunks out of the range are skipped as a whole
+	const float limit = 1000.0f;
+	int visitedChunkCount = 0;
+	int count = 0;
+	int correctness = 1;
+	pContext->ForEachBatchFiltered<Transform>([&](const EntityComponentChunk* pChunk) {
+		return pChunk->GetChunkComponent<YawBounds>()->minYaw < limit;
+	}, [&](Entity* pEntity, int batchCount, Transform* pTransform) {
+		visitedChunkCount += 1;
+		for (int i = 0; i < batchCount; i++)
+			correctness &= (int)(pTransform[i].yaw < limit + pStorage->GetEntityCountPerChunk());
+		count += batchCount;
+	});
+	REQUIRE(correctness);
+	REQUIRE(visitedChunkCount < pStorage->GetChunkCount());
+	REQUIRE(count == visitedChunkCount * (int)pStorage->GetEntityCountPerChunk());
+	REQUIRE(count >= (int)limit);
+
+	// the chunk components stay with the chunk
+	Entity* pEntity = pStorage->GetChunk(0)->GetEntity(0);
+	REQUIRE(pEntity->GetComponent<YawBounds>() == pStorage->GetChunk(0)->GetChunkComponent<YawBounds>());
+	Entity* pExtended = pEntity->Extend<Velocity>();
+	REQUIRE(pExtended->GetComponent<YawBounds>()->maxYaw == -FLT_MAX);
+
+	pContext->Release();
+}
+
+struct GameClock
+{
+	float	deltaTime = 0;
+	int		frame = 0;
+
+	GameClock(float dt) : deltaTime(dt) {}
+};
+
+struct MovedCounter
+{
+	int		count = 0;
+};
+
+TEST_CASE("Singletons of a context", "Singleton")
+{
+	World* pWorld = World::GetInstance();
+	EntityContext* pContext = pWorld->CreateContext();
+	REQUIRE(pContext->GetSingleton<GameClock>() == nullptr);
+
+	GameClock* pClock = pContext->SetSingleton<GameClock>(0.5f);
+	pContext->SetSingleton<MovedCounter>();
+	REQUIRE(pContext->GetSingleton<GameClock>() == pClock);
+	REQUIRE(pContext->GetSingleton<GameClock>()->deltaTime == 0.5f);
+
+	// set again with a new value
+	pClock = pContext->SetSingleton<GameClock>(0.25f);
+	REQUIRE(pContext->GetSingleton<GameClock>()->deltaTime == 0.25f);
+
+	// other contexts have their own ones
+	EntityContext* pOtherContext = pWorld->CreateContext();
+	REQUIRE(pOtherContext->GetSingleton<GameClock>() == nullptr);
+	pOtherContext->Release();
+
+	const int n = 1000;
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity<Transform>();
+
+	// the clock is read and the counter is written by the callbacks
+	using MoveSingletons = Singletons<const GameClock, MovedCounter>;
+	MoveSingletons singletons(pContext);
+	pContext->ForEach<Transform>([](MoveSingletons* pSingletons, Entity* pEntity, Transform* pTransform) {
+		pTransform->yaw += pSingletons->Get<const GameClock>()->deltaTime;
+		pSingletons->Get<MovedCounter>()->count += 1;
+	}, &singletons);
+	REQUIRE(pContext->GetSingleton<MovedCounter>()->count == n);
+
+	DeferredJob<true, MoveSingletons, Transform> job([](MoveSingletons* pSingletons, Entity* pEntity, Transform* pTransform) {
+		pTransform->yaw += pSingletons->Get<const GameClock>()->deltaTime;
+		pSingletons->Get<MovedCounter>()->count += 1;
+	});
+	job.Execute(pContext, &singletons);
+	REQUIRE(pContext->GetSingleton<MovedCounter>()->count == 2 * n);
+
+	// setting a singleton again keeps the object the Singletons refer to
+	REQUIRE(pContext->SetSingleton<MovedCounter>() == singletons.Get<MovedCounter>());
+	REQUIRE(singletons.Get<MovedCounter>()->count == 0);
+	REQUIRE(pContext->SetSingleton<GameClock>(0.5f) == singletons.Get<const GameClock>());
+	REQUIRE(singletons.Get<const GameClock>()->deltaTime == 0.5f);
+	pContext->SetSingleton<GameClock>(0.25f);
+
+	// writing a singleton needs a non-const context
+	REQUIRE(std::is_constructible_v<Singletons<const GameClock>, const EntityContext*>);
+	REQUIRE(!std::is_constructible_v<MoveSingletons, const EntityContext*>);
+	REQUIRE(std::is_same_v<decltype(static_cast<const EntityContext*>(pContext)->GetSingleton<GameClock>()), const GameClock*>);
+
+	float sum = 0;
+	pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+		sum += pTransform->yaw;
+	});
+	REQUIRE(sum == 0.5f * n);
+
+	pContext->RemoveSingleton<MovedCounter>();
+	REQUIRE(pContext->GetSingleton<MovedCounter>() == nullptr);
+	pContext->Release();
+}
+
+TEST_CASE("Sparse components", "SparseComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Transform>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	Entity* pOther = pContext->CreateEntity<Velocity>();
+	REQUIRE(pOther->AddSparseComponent<Stunned>(100.0f)->duration == 100.0f);
+
+	// adding a sparse component keeps the entity where it is
+	for (int i = 0; i < n; i += 3)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		Stunned* pStunned = pEntity->AddSparseComponent<Stunned>((float)i);
+		REQUIRE(pStunned->duration == (float)i);
+		REQUIRE(pContext->GetEntity(entityIds[i]) == pEntity);
+		REQUIRE(pEntity->GetArchetype() == pArchetype);
+	}
+	REQUIRE(pContext->GetSparseComponentSet<Stunned>()->GetCount() == (n + 2) / 3 + 1);
+
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		bool bStunned = (i % 3 == 0);
+		correctness &= (int)(pEntity->ContainComponent<Stunned>() == bStunned);
+		correctness &= (int)((pEntity->GetComponent<Stunned>() != nullptr) == bStunned);
+		if (bStunned)
+			correctness &= (int)(pEntity->GetComponent<Stunned>()->duration == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// queried together with the components of the archetypes
+	int count = 0;
+	int sum = 0;
+	pContext->ForEach<Profile, Stunned>([&](Entity* pEntity, Profile* pProfile, Stunned* pStunned) {
+		correctness &= (int)(pStunned->duration == (float)pProfile->age);
+		correctness &= (int)(pEntity->GetComponent<Profile>() == pProfile);
+		sum += pProfile->age;
+		count += 1;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == (n + 2) / 3);
+	int expectedSum = 0;
+	for (int i = 0; i < n; i += 3)
+		expectedSum += i;
+	REQUIRE(sum == expectedSum);
+
+	// the callback may remove the component of its entity
+	int removedCount = 0;
+	int runtimeArg = 6;
+	pWorld->ForEach<Stunned, Profile>([&removedCount](int* pArg, Entity* pEntity, Stunned* pStunned, Profile* pProfile) {
+		if (pProfile->age % *pArg == 0) {
+			pEntity->RemoveSparseComponent<Stunned>();
+			removedCount += 1;
+		}
+	}, &runtimeArg);
+	REQUIRE(removedCount == (n + 5) / 6);
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		bool bStunned = (i % 3 == 0 && i % 6 != 0);
+		correctness &= (int)(pEntity->ContainComponent<Stunned>() == bStunned);
+		if (bStunned)
+			correctness &= (int)(pEntity->GetComponent<Stunned>()->duration == (float)i);
+	}
+	REQUIRE(correctness);
+	REQUIRE(pContext->GetEntity(entityIds[0])->RemoveSparseComponent<Stunned>() == false);
+
+	// the sparse components follow the entity when it's cloned, extended or moved
+	Entity* pEntity = pContext->GetEntity(entityIds[3]);
+	Entity* pCloned = pEntity->Clone();
+	EntityID clonedId = pCloned->GetEntityID();
+	REQUIRE(pCloned->GetComponent<Stunned>()->duration == 3.0f);
+	Entity* pExtended = pEntity->Extend<Velocity>();
+	REQUIRE(pExtended->GetComponent<Stunned>()->duration == 3.0f);
+	pExtended->GetComponent<Stunned>()->duration = 30.0f;
+	REQUIRE(pEntity->GetComponent<Stunned>()->duration == 3.0f);
+
+	for (int i = 1; i < n; i += 3)
+		pContext->GetEntity(entityIds[i])->Release();
+	REQUIRE(pContext->Maintain(1000000));
+	for (int i = 0; i < n; i += 3)
+	{
+		Entity* pMovedEntity = pContext->GetEntity(entityIds[i]);
+		if (i % 6 != 0)
+			correctness &= (int)(pMovedEntity->GetComponent<Stunned>()->duration == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// and go away with it
+	size_t stunnedCount = pContext->GetSparseComponentSet<Stunned>()->GetCount();
+	pContext->GetEntity(entityIds[3])->Release();
+	pContext->GetEntity(clonedId)->Release();
+	REQUIRE(pContext->GetSparseComponentSet<Stunned>()->GetCount() == stunnedCount - 2);
+
+	pContext->Release();
+}
+
+TEST_CASE("Enabled entities and components", "Enabled")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Transform, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// disable some entities, and the velocity of some others
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		REQUIRE(pEntity->IsEnabled());
+		REQUIRE(pEntity->IsEnabled<Velocity>());
+		if (i % 4 == 1)
+			pEntity->SetEnabled(false);
+		if (i % 5 == 2)
+			REQUIRE(pEntity->SetEnabled<Velocity>(false));
+	}
+	Entity* pFirst = pContext->GetEntity(entityIds[1]);
+	REQUIRE(pFirst->SetEnabled<Description>(false) == false);
+	REQUIRE(pFirst->IsEnabled<Description>() == false);
+	REQUIRE(pFirst->IsEnabled() == false);
+	REQUIRE(pFirst->IsEnabled<Profile>());
+	REQUIRE(pFirst->IsValid());
+	REQUIRE(pContext->GetEntity(entityIds[1]) == pFirst);
+
+	auto isEnabled = [](int i) { return i % 4 != 1; };
+	auto isMoving = [](int i) { return i % 4 != 1 && i % 5 != 2; };
+	int expectedCount = 0, expectedSum = 0;
+	int expectedMovingCount = 0, expectedMovingSum = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (isEnabled(i)) {
+			expectedCount += 1;
+			expectedSum += i;
+		}
+		if (isMoving(i)) {
+			expectedMovingCount += 1;
+			expectedMovingSum += i;
+		}
+	}
+
+	int correctness = 1;
+	int count = 0;
+	int sum = 0;
+	pContext->ForEach<Profile>([&](Entity* pEntity, Profile* pProfile) {
+		correctness &= (int)isEnabled(pProfile->age);
+		correctness &= (int)(pEntity->GetComponent<Profile>() == pProfile);
+		count += 1;
+		sum += pProfile->age;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == expectedCount);
+	REQUIRE(sum == expectedSum);
+
+	// the ones with the velocity disabled are skipped only when it's iterated
+	count = 0;
+	sum = 0;
+	pContext->ForEachBatch<Profile, Velocity>([&](Entity* pEntity, int entityCount, Profile* pProfile, Velocity* pVelocity) {
+		for (int i = 0; i < entityCount; i++) {
+			correctness &= (int)isMoving(pProfile->age);
+			correctness &= (int)(pEntity->GetComponent<Velocity>() == pVelocity);
+			count += 1;
+			sum += pProfile->age;
+			AdvancePointers(pEntity, pProfile, pVelocity);
+		}
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == expectedMovingCount);
+	REQUIRE(sum == expectedMovingSum);
+
+	const int threadCount = 3;
+	std::atomic<int> parallelCount(0);
+	std::atomic<int> parallelSum(0);
+	ParallelJob<false, Profile, Velocity> job([&](Entity* pEntity, Profile* pProfile, Velocity* pVelocity) {
+		parallelCount++;
+		parallelSum.fetch_add(pProfile->age);
+	});
+	job.Prepare(pContext, threadCount);
+	std::thread threads[threadCount];
+	for (int i = 0; i < threadCount; i++)
+		threads[i] = std::thread([&]() { job.Execute(); });
+	for (int i = 0; i < threadCount; i++)
+		threads[i].join();
+	REQUIRE(parallelCount.load() == expectedMovingCount);
+	REQUIRE(parallelSum.load() == expectedMovingSum);
+
+	// and when they are queried with sparse components
+	for (int i = 0; i < n; i += 2)
+		pContext->GetEntity(entityIds[i])->AddSparseComponent<Stunned>((float)i);
+	count = 0;
+	pContext->ForEach<Stunned, Velocity>([&](Entity* pEntity, Stunned* pStunned, Velocity* pVelocity) {
+		correctness &= (int)isMoving((int)pStunned->duration);
+		count += 1;
+	});
+	REQUIRE(correctness);
+	int expectedStunnedCount = 0;
+	for (int i = 0; i < n; i += 2)
+		expectedStunnedCount += (int)isMoving(i);
+	REQUIRE(count == expectedStunnedCount);
+
+	// the bits are kept when the entity is cloned, extended or moved
+	Entity* pDisabled = pContext->GetEntity(entityIds[1]);
+	Entity* pCloned = pDisabled->Clone();
+	EntityID clonedId = pCloned->GetEntityID();
+	REQUIRE(pCloned->IsEnabled() == false);
+	Entity* pStill = pContext->GetEntity(entityIds[2]);
+	Entity* pExtended = pStill->Extend<Description>();
+	REQUIRE(pExtended->IsEnabled());
+	REQUIRE(pExtended->IsEnabled<Velocity>() == false);
+	REQUIRE(pExtended->IsEnabled<Description>());
+	pExtended->Release();
+
+	for (int i = 0; i < n; i += 3)
+		pContext->GetEntity(entityIds[i])->Release();
+	REQUIRE(pContext->Maintain(1000000));
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 3 == 0)
+			continue;
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)(pEntity->GetComponent<Profile>()->age == i);
+		correctness &= (int)(pEntity->IsEnabled() == isEnabled(i));
+		correctness &= (int)(pEntity->IsEnabled<Velocity>() == (i % 5 != 2));
+	}
+	REQUIRE(correctness);
+	REQUIRE(pContext->GetEntity(clonedId)->IsEnabled() == false);
+
+	// the callback may disable the entity it's called with, and a new entity is always enabled
+	pContext->ForEach<Profile>([](Entity* pEntity, Profile* pProfile) {
+		pEntity->SetEnabled(false);
+	});
+	count = 0;
+	pContext->ForEach<Profile>([&count](Entity* pEntity, Profile* pProfile) { count += 1; });
+	REQUIRE(count == 0);
+	Entity* pNew = pContext->CreateEntity(pArchetype, Profile("New", -1));
+	REQUIRE(pNew->IsEnabled());
+	REQUIRE(pNew->IsEnabled<Velocity>());
+	pContext->GetEntity(entityIds[1])->SetEnabled(true);
+	count = 0;
+	pContext->ForEach<Profile>([&count](Entity* pEntity, Profile* pProfile) { count += 1; });
+	REQUIRE(count == 2);
+	pContext->Release();
+
+	// in a packed storage the last entity is moved into the released block with its bits
+	EntityArchetype* pPackedArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Packed);
+	pContext = pWorld->CreateContext();
+	std::vector<EntityID> packedIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pPackedArchetype, Profile("Packed", i));
+		pEntity->SetEnabled(i % 3 != 0);
+		packedIds.push_back(pEntity->GetEntityID());
+	}
+	for (int i = 0; i < n; i += 7)
+		pContext->GetEntity(packedIds[i])->Release();
+	expectedCount = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 7 == 0)
+			continue;
+		correctness &= (int)(pContext->GetEntity(packedIds[i])->IsEnabled() == (i % 3 != 0));
+		expectedCount += (int)(i % 3 != 0);
+	}
+	REQUIRE(correctness);
+	count = 0;
+	pContext->ForEach<Profile>([&](Entity* pEntity, Profile* pProfile) {
+		correctness &= (int)(pProfile->age % 3 != 0 && pProfile->age % 7 != 0);
+		count += 1;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == expectedCount);
+	pContext->Release();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Default);
+}
+
+TEST_CASE("Components laid out in lanes", "LaneComponent")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Particle, Transform>();
+	const int laneWidth = 8;
+	pArchetype->SetLaneWidth(laneWidth);
+	REQUIRE(pArchetype->IsComponentLaned(pArchetype->GetComponentIndex<Particle>()));
+	REQUIRE(pArchetype->IsComponentLaned(pArchetype->GetComponentIndex<Transform>()) == false);
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Particle((float)i, (float)(2 * i), (float)(3 * i)));
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	Entity* pDefault = pContext->CreateEntity(pArchetype);
+	Particle particle;
+	REQUIRE(pDefault->LoadComponent(&particle));
+	REQUIRE(particle.mass == 1.0f);
+	pDefault->Release();
+
+	// laned components are only read and written by value
+	REQUIRE(pContext->GetEntity(entityIds[0])->GetComponent<Particle>() == nullptr);
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)pEntity->LoadComponent(&particle);
+		correctness &= (int)(particle.x == (float)i && particle.y == (float)(2 * i) && particle.z == (float)(3 * i) && particle.mass == 1.0f);
+	}
+	REQUIRE(correctness);
+
+	for (int i = 0; i < n; i += 3)
+		pContext->GetEntity(entityIds[i])->Release();
+
+	// each field of a group is a vector of the lanes
+	float sumX = 0;
+	float sumZ = 0;
+	int count = 0;
+	pContext->ForEachLaneGroup<Particle>([&](Entity* pEntities, uint32_t laneMask, float* pParticles) {
+		correctness &= (int)check_aligned_address(pParticles, laneWidth * sizeof(float));
+		for (int lane = 0; lane < laneWidth; lane++) {
+			if (laneMask & (1u << lane)) {
+				correctness &= (int)pEntities[lane].IsValid();
+				sumX += pParticles[0 * laneWidth + lane];
+				sumZ += pParticles[2 * laneWidth + lane];
+				count += 1;
+			}
+		}
+	});
+	REQUIRE(correctness);
+	float expectedSumX = 0;
+	for (int i = 0; i < n; i++) {
+		if (i % 3 != 0)
+			expectedSumX += (float)i;
+	}
+	REQUIRE(count == n - (n + 2) / 3);
+	REQUIRE(sumX == expectedSumX);
+	REQUIRE(sumZ == 3 * expectedSumX);
+
+	// the values follow the entities into other archetypes
+	Entity* pEntity = pContext->GetEntity(entityIds[10]);
+	REQUIRE(pEntity->SetComponent(Particle(1.0f, 2.0f, 3.0f)));
+	Entity* pExtended = pEntity->Extend<Velocity>();
+	REQUIRE(pExtended->GetComponent<Particle>()->z == 3.0f);
+	REQUIRE(pExtended->GetComponent<Transform>()->yaw == 10.0f);
+	Entity* pCloned = pEntity->Clone();
+	REQUIRE(pCloned->LoadComponent(&particle));
+	REQUIRE(particle.y == 2.0f);
+	Entity* pLaned = pContext->CreateEntity(pArchetype);
+	pContext->CopyEntityData(pLaned, pExtended);
+	REQUIRE(pLaned->LoadComponent(&particle));
+	REQUIRE(particle.x == 1.0f);
+
+	// entities are moved with their lanes
+	REQUIRE(pContext->Maintain(1000000));
+	correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 3 == 0 || i == 10)
+			continue;
+		Entity* pMovedEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)pMovedEntity->LoadComponent(&particle);
+		correctness &= (int)(particle.x == (float)i && particle.z == (float)(3 * i));
+		correctness &= (int)(pMovedEntity->GetComponent<Transform>()->yaw == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// the generic iterations skip the archetypes where the component is laid out in lanes,
+	// only the extended entity has it in a column
+	count = 0;
+	pContext->ForEach<Particle>([&](Entity* pEntity, Particle* pParticle) {
+		correctness &= (int)(pEntity->GetArchetype() != pArchetype && pParticle->z == 3.0f);
+		count += 1;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == 1);
+	count = 0;
+	pContext->ForEachBatch<Transform, Particle>([&count](Entity* pEntity, int entityCount, Transform* pTransform, Particle* pParticle) {
+		count += entityCount;
+	});
+	REQUIRE(count == 1);
+	std::atomic<int> parallelCount(0);
+	ParallelJob<false, Particle> job([&parallelCount](Entity* pEntity, Particle* pParticle) { parallelCount++; });
+	job.Prepare(pContext, 2);
+	std::thread threads[2];
+	for (int i = 0; i < 2; i++)
+		threads[i] = std::thread([&]() { job.Execute(); });
+	for (int i = 0; i < 2; i++)
+		threads[i].join();
+	REQUIRE(parallelCount.load() == 1);
+
+	// the other components of the laned archetypes are still iterated
+	count = 0;
+	pContext->ForEach<Transform>([&count](Entity* pEntity, Transform* pTransform) { count += 1; });
+	REQUIRE(count == n - (n + 2) / 3 + 3);
+
+	pContext->Release();
+	pArchetype->SetLaneWidth(0);
+}
+
+TEST_CASE("Components laid out in rows", "RowLayout")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity, SimdVector, Description, IsEnemy>();
+	pArchetype->SetRowLayout();
+	REQUIRE(pArchetype->IsComponentInRow(pArchetype->GetComponentIndex<Profile>()));
+	REQUIRE(pArchetype->IsComponentInRow(pArchetype->GetComponentIndex<SimdVector>()));
+	REQUIRE(pArchetype->IsComponentInRow(pArchetype->GetComponentIndex<Description>()) == false);
+	REQUIRE(pArchetype->IsComponentInRow(pArchetype->GetComponentIndex<IsEnemy>()) == false);
+	REQUIRE(pArchetype->GetRowSize() % alignof(SimdVector) == 0);
+	REQUIRE(pArchetype->GetRowSize() >= sizeof(Profile) + sizeof(Velocity) + sizeof(SimdVector));
+
+	EntityContext* pContext = pWorld->CreateContext();
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		pEntity->GetComponent<Velocity>()->Magnitude = (float)i;
+		pEntity->GetComponent<SimdVector>()->values[15] = (float)i;
+		sprintf_s(pEntity->GetComponent<Description>()->text, "Entity %d", i);
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// all the components of an entity are in one row
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		const byte* pProfile = (const byte*)pEntity->GetComponent<Profile>();
+		const byte* pVelocity = (const byte*)pEntity->GetComponent<Velocity>();
+		const byte* pVector = (const byte*)pEntity->GetComponent<SimdVector>();
+		const byte* pRowBegin = std::min({ pProfile, pVelocity, pVector });
+		const byte* pRowEnd = std::max({ pProfile + sizeof(Profile), pVelocity + sizeof(Velocity), pVector + sizeof(SimdVector) });
+		correctness &= (int)(pRowEnd - pRowBegin <= (ptrdiff_t)pArchetype->GetRowSize());
+		correctness &= (int)check_aligned_address(pVector, alignof(SimdVector));
+		correctness &= (int)(((const Profile*)pProfile)->age == i);
+		correctness &= (int)(((const Velocity*)pVelocity)->Magnitude == (float)i);
+		correctness &= (int)(((const SimdVector*)pVector)->values[15] == (float)i);
+	}
+	REQUIRE(correctness);
+
+	for (int i = 0; i < n; i += 3)
+		pContext->GetEntity(entityIds[i])->Release();
+	int expectedCount = 0;
+	int expectedSum = 0;
+	for (int i = 0; i < n; i++) {
+		if (i % 3 != 0) {
+			expectedCount += 1;
+			expectedSum += i;
+		}
+	}
+
+	// ForEach still walks the rows correctly
+	int count = 0;
+	int sum = 0;
+	pContext->ForEach<Profile, SimdVector>([&](Entity* pEntity, Profile* pProfile, SimdVector* pVector) {
+		correctness &= (int)(pEntity->GetComponent<Profile>() == pProfile);
+		correctness &= (int)(pVector->values[15] == (float)pProfile->age);
+		sum += pProfile->age;
+		count += 1;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == expectedCount);
+	REQUIRE(sum == expectedSum);
+
+	// a batch of the row components is a single entity
+	count = 0;
+	pContext->ForEachBatch<Velocity>([&](Entity* pEntity, int entityCount, Velocity* pVelocity) {
+		correctness &= (int)(entityCount == 1 && pEntity->GetComponent<Velocity>() == pVelocity);
+		count += entityCount;
+	});
+	REQUIRE(correctness);
+	REQUIRE(count == expectedCount);
+
+	// while the cold components are still iterated in runs
+	int maxBatchCount = 0;
+	pContext->ForEachBatch<Description>([&](Entity* pEntity, int entityCount, Description* pDescription) {
+		maxBatchCount = std::max(maxBatchCount, entityCount);
+	});
+	REQUIRE(maxBatchCount > 1);
+
+	std::atomic<int> parallelSum(0);
+	ParallelJob<false, Profile> job1([&parallelSum](Entity* pEntity, Profile* pProfile) {
+		parallelSum.fetch_add(pProfile->age);
+	});
+	job1.Prepare(pContext, 3);
+	std::thread threads[3];
+	for (int i = 0; i < 3; i++)
+		threads[i] = std::thread([&]() { job1.Execute(); });
+	for (int i = 0; i < 3; i++)
+		threads[i].join();
+	REQUIRE(parallelSum.load() == expectedSum);
+
+	// the rows are moved and copied like the columns
+	Entity* pEntity = pContext->GetEntity(entityIds[10]);
+	Entity* pExtended = pEntity->Extend<Transform>();
+	REQUIRE(pExtended->GetComponent<Profile>()->age == 10);
+	REQUIRE(pExtended->GetComponent<SimdVector>()->values[15] == 10.0f);
+	Entity* pCloned = pContext->GetEntity(entityIds[11])->Clone();
+	REQUIRE(pCloned->GetComponent<Velocity>()->Magnitude == 11.0f);
+	REQUIRE(strcmp(pCloned->GetComponent<Description>()->text, "Entity 11") == 0);
+
+	REQUIRE(pContext->Maintain(1000000));
+	correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 3 == 0 || i == 10)
+			continue;
+		Entity* pMovedEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)(pMovedEntity->GetComponent<Profile>()->age == i);
+		correctness &= (int)(pMovedEntity->GetComponent<SimdVector>()->values[15] == (float)i);
+	}
+	REQUIRE(correctness);
+
+	pContext->Release();
+	pArchetype->SetRowLayout(false);
+}
+
+TEST_CASE("Cache line aligned component columns", "Alignment")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Velocity, SimdVector, Profile>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 2500;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("Test", i));
+		SimdVector* pVector = pEntity->GetComponent<SimdVector>();
+		for (int j = 0; j < 16; j++)
+			pVector->values[j] = (float)i;
+	}
+
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->GetChunkSize() <= MAX_STORAGE_CHUNK_SIZE);
+
+	// every column starts at a cache line, and ends inside the chunk
+	int correctness = 1;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+	{
+		EntityComponentChunk* pChunk = pStorage->GetChunk(i);
+		const byte* pBegin = pChunk->GetMemory();
+		const byte* pEnd = pBegin + pStorage->GetChunkSize();
+		Entity* pFirst = pChunk->GetEntity(0);
+		Entity* pLast = pChunk->GetEntity((uint16_t)(pStorage->GetEntityCountPerChunk() - 1));
+		correctness &= (int)((const byte*)pFirst >= pBegin && (const byte*)(pLast + 1) <= pEnd);
+		correctness &= (int)((uintptr_t)pFirst->GetComponent<Velocity>() % CACHE_LINE_SIZE == 0);
+		correctness &= (int)((uintptr_t)pFirst->GetComponent<SimdVector>() % CACHE_LINE_SIZE == 0);
+		correctness &= (int)((uintptr_t)pFirst->GetComponent<Profile>() % CACHE_LINE_SIZE == 0);
+		correctness &= (int)((const byte*)(pLast->GetComponent<Velocity>() + 1) <= pEnd);
+		correctness &= (int)((const byte*)(pLast->GetComponent<SimdVector>() + 1) <= pEnd);
+		correctness &= (int)((const byte*)(pLast->GetComponent<Profile>() + 1) <= pEnd);
+	}
+	REQUIRE(correctness);
+
+	pContext->ForEach<SimdVector, Profile>([&correctness](Entity* pEntity, SimdVector* pVector, Profile* pProfile) {
+		correctness &= (int)((uintptr_t)pVector % alignof(SimdVector) == 0);
+		correctness &= (int)(pVector->values[15] == (float)pProfile->age);
+	});
+	REQUIRE(correctness);
+
+	pContext->Release();
+}
+
+
+TEST_CASE("Chunk size policies", "ChunkSizePolicy")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype1 = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityArchetype* pArchetype2 = pWorld->CreateArchetype<Transform, Velocity>();
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy::Bytes(16 * 1024));
+	pArchetype2->SetChunkSizePolicy(ChunkSizePolicy::EntityCount(100));
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 3000;
+	int expectedSum = 0;
+	for (int i = 0; i < n; i++)
+	{
+		pContext->CreateEntity(pArchetype1, Profile("Test", i));
+		Entity* pEntity = pContext->CreateEntity(pArchetype2);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		expectedSum += i;
+	}
+
+	EntityComponentStorage* pStorage1 = pContext->GetEntityComponentStorage(pArchetype1);
+	EntityComponentStorage* pStorage2 = pContext->GetEntityComponentStorage(pArchetype2);
+	REQUIRE(pStorage1->GetChunkSize() <= 16 * 1024);
+	REQUIRE(pStorage1->GetEntityCountPerChunk() < MAX_ENTITY_COUNT_PER_CHUNK);
+	REQUIRE(pStorage1->GetChunkCount() == (n + pStorage1->GetEntityCountPerChunk() - 1) / pStorage1->GetEntityCountPerChunk());
+	REQUIRE(pStorage2->GetEntityCountPerChunk() == 100);
+	REQUIRE(pStorage2->GetChunkCount() == n / 100);
+
+	int sum = 0;
+	pContext->ForEach<Profile>([&sum](Entity* pEntity, Profile* pProfile) {
+		sum += pProfile->age;
+	});
+	REQUIRE(sum == expectedSum);
+
+	const int threadCount = 4;
+	std::atomic<int> count(0);
+	std::atomic<int> parallelSum(0);
+	ParallelJob<false, Transform> job([&count, &parallelSum](Entity* pEntity, Transform* pTransform) {
+		parallelSum.fetch_add((int)pTransform->yaw);
+		count++;
+	});
+	job.Prepare(pContext, threadCount);
+	std::thread threads[threadCount];
+	for (int i = 0; i < threadCount; i++) {
+		threads[i] = std::thread([&]() { job.Execute(); });
+	}
+	for (int i = 0; i < threadCount; i++) {
+		threads[i].join();
+	}
+	REQUIRE(count.load() == n);
+	REQUIRE(parallelSum.load() == expectedSum);
+
+	pContext->Release();
+	pArchetype2->ResetChunkSizePolicy();
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy());
+}
+
+
+TEST_CASE("Growing chunks", "ChunkSizePolicy")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pSmallArchetype = pWorld->CreateArchetype<Profile, Transform, Velocity>();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity>();
+	EntityArchetype* pPackedArchetype = pWorld->CreateArchetype<Transform, Velocity, Description>();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Packed);
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy().Growing(16));
+	CountingChunkMemoryAllocator allocator;
+	pWorld->SetChunkMemoryAllocator(&allocator);
+	EntityContext* pContext = pWorld->CreateContext();
+
+	// a rarely used archetype only takes a small chunk
+	pContext->CreateEntity(pSmallArchetype, Profile("Test", 1));
+	EntityComponentStorage* pSmallStorage = pContext->GetEntityComponentStorage(pSmallArchetype);
+	REQUIRE(pSmallStorage->GetChunkCount() == 1);
+	REQUIRE(pSmallStorage->GetChunk(0)->GetBlockCount() == 16);
+	REQUIRE(pSmallStorage->GetChunk(0)->GetMemorySize() * 8 < pSmallStorage->GetChunkSize());
+	// but no less than the alignment of the chunks, which is what the allocator really gives out
+	size_t smallChunkBytes = allocator.alignedBytes;
+	REQUIRE(smallChunkBytes == StandardChunkMemoryAllocator::GetAlignedAllocationSize(
+		pSmallStorage->GetChunk(0)->GetMemorySize(), std::max<size_t>(CACHE_LINE_SIZE, ENTITY_HANDLE_ALIGNMENT)));
+	REQUIRE(smallChunkBytes >= ENTITY_HANDLE_ALIGNMENT);
+	REQUIRE(smallChunkBytes * 4 <= pSmallStorage->GetChunkSize());
+	// and the whole storage, with its chunk directory and layouts, takes little more than the chunk
+	size_t storageBytes = allocator.allocatedBytes + sizeof(EntityComponentStorage)
+		+ pSmallStorage->GetChunkLayoutCount() * sizeof(ChunkLayout);
+	// the first page of the directory holds only the first chunk
+	REQUIRE(allocator.allocatedBytes - smallChunkBytes <= sizeof(EntityComponentChunk) + 64);
+	REQUIRE(storageBytes < 2 * smallChunkBytes);
+
+	const int n = 3000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+		pContext->CreateEntity(pPackedArchetype)->GetComponent<Transform>()->yaw = (float)i;
+	}
+
+	// each chunk is twice as large as the one before, until the full size
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	size_t expectedBlockCount = 16;
+	size_t blockCount = 0;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+	{
+		REQUIRE(pStorage->GetChunk(i)->GetBlockCount() == expectedBlockCount);
+		blockCount += expectedBlockCount;
+		expectedBlockCount = std::min(expectedBlockCount * 2, pStorage->GetEntityCountPerChunk());
+	}
+	REQUIRE(blockCount >= n);
+	REQUIRE(blockCount - pStorage->GetChunk(pStorage->GetChunkCount() - 1)->GetBlockCount() < n);
+
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+		correctness &= (int)(pContext->GetEntity(entityIds[i])->GetComponent<Transform>()->yaw == (float)i);
+	REQUIRE(correctness);
+
+	for (int i = 0; i < n; i += 2)
+	{
+		pContext->GetEntity(entityIds[i])->Release();
+	}
+	int expectedSum = 0;
+	for (int i = 1; i < n; i += 2)
+		expectedSum += i;
+
+	int sum = 0;
+	pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+		sum += (int)pTransform->yaw;
+	});
+	REQUIRE(sum == expectedSum + n * (n - 1) / 2);
+
+	const int threadCount = 4;
+	std::atomic<int> count(0);
+	std::atomic<int> parallelSum(0);
+	ParallelJob<false, Transform, Velocity> job([&count, &parallelSum](Entity* pEntity, Transform* pTransform, Velocity* pVelocity) {
+		parallelSum.fetch_add((int)pTransform->yaw);
+		count++;
+	});
+	job.Prepare(pContext, threadCount);
+	std::thread threads[threadCount];
+	for (int i = 0; i < threadCount; i++) {
+		threads[i] = std::thread([&]() { job.Execute(); });
+	}
+	for (int i = 0; i < threadCount; i++) {
+		threads[i].join();
+	}
+	// and the entity of the small archetype
+	REQUIRE(count.load() == n / 2 + n + 1);
+	REQUIRE(parallelSum.load() == expectedSum + n * (n - 1) / 2);
+
+	// entities are moved between chunks of different sizes
+	REQUIRE(pStorage->IsFragmented());
+	REQUIRE(pStorage->Defragment(1000000));
+	REQUIRE(pStorage->IsFragmented() == false);
+	for (int i = 1; i < n; i += 2)
+		correctness &= (int)(pContext->GetEntity(entityIds[i])->GetComponent<Transform>()->yaw == (float)i);
+	REQUIRE(correctness);
+
+	// the chunks created again at the same indexes have the same sizes
+	pStorage->Trim();
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity(pArchetype);
+	expectedBlockCount = 16;
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+	{
+		correctness &= (int)(pStorage->GetChunk(i)->GetBlockCount() == expectedBlockCount);
+		expectedBlockCount = std::min(expectedBlockCount * 2, pStorage->GetEntityCountPerChunk());
+	}
+	REQUIRE(correctness);
+
+	pContext->Release();
+	pWorld->SetChunkSizePolicy(ChunkSizePolicy());
+	pWorld->SetChunkMemoryAllocator(nullptr);
+}
+
+
+TEST_CASE("Thread caching chunk allocator", "ThreadCachingChunkMemoryAllocator")
+{
+	World* pWorld = World::GetInstance();
+	ThreadCachingChunkMemoryAllocator allocator(1024 * 1024, 4);
+	pWorld->SetChunkMemoryAllocator(&allocator);
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity>();
+
+	// one context per worker thread
+	const int threadCount = 4;
+	const int n = 10 * MAX_ENTITY_COUNT_PER_CHUNK;
+	EntityContext* contexts[threadCount];
+	for (int i = 0; i < threadCount; i++)
+		contexts[i] = pWorld->CreateContext();
+
+	std::atomic<int> correctness(1);
+	std::thread threads[threadCount];
+	for (int i = 0; i < threadCount; i++) {
+		threads[i] = std::thread([&, i]() {
+			EntityContext* pContext = contexts[i];
+			for (int round = 0; round < 3; round++) {
+				std::vector<EntityID> entityIds;
+				for (int j = 0; j < n; j++) {
+					Entity* pEntity = pContext->CreateEntity(pArchetype);
+					pEntity->GetComponent<Transform>()->yaw = (float)j;
+					entityIds.push_back(pEntity->GetEntityID());
+				}
+				int64_t sum = 0;
+				pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+					sum += (int64_t)pTransform->yaw;
+				});
+				if (sum != (int64_t)n * (n - 1) / 2)
+					correctness = 0;
+				// give all the chunks back to the allocator
+				for (EntityID eid : entityIds)
+					pContext->GetEntity(eid)->Release();
+				pContext->Trim();
+			}
+		});
+	}
+	for (int i = 0; i < threadCount; i++)
+		threads[i].join();
+	REQUIRE(correctness.load());
+
+	// the later rounds reuse the chunks released by the earlier ones
+	ThreadCachingChunkMemoryAllocator::Stats stats = allocator.GetStats();
+	REQUIRE(stats.arenaCount > 0);
+	REQUIRE(stats.threadCacheHits > 0);
+	REQUIRE(stats.surplusBlockCount > 0);
+	REQUIRE(stats.arenaBytes <= (size_t)threadCount * 2 * 1024 * 1024);
+	// the threads that exited before the others registered might have been dropped already
+	REQUIRE((stats.threadCacheCount > 0 && stats.threadCacheCount <= threadCount));
+
+	for (int i = 0; i < threadCount; i++)
+		contexts[i]->Release();
+	pWorld->SetChunkMemoryAllocator(nullptr);
+
+	// the caches of the exited threads are dropped when another thread registers its own
+	void* pBlock = allocator.MallocAligned(4096, 64);
+	allocator.FreeAligned(pBlock);
+	REQUIRE(allocator.GetStats().threadCacheCount == 1);
+
+	// and a destroyed allocator's cache is dropped by the thread once it uses another allocator
+	size_t cacheCount = ThreadCachingChunkMemoryAllocator::GetCallingThreadCacheCount();
+	ThreadCachingChunkMemoryAllocator* pAllocator = new ThreadCachingChunkMemoryAllocator(1024 * 1024, 4);
+	pAllocator->FreeAligned(pAllocator->MallocAligned(4096, 64));
+	REQUIRE(ThreadCachingChunkMemoryAllocator::GetCallingThreadCacheCount() == cacheCount + 1);
+	delete pAllocator;
+	ThreadCachingChunkMemoryAllocator otherAllocator(1024 * 1024, 4);
+	otherAllocator.FreeAligned(otherAllocator.MallocAligned(4096, 64));
+	REQUIRE(ThreadCachingChunkMemoryAllocator::GetCallingThreadCacheCount() == cacheCount + 1);
+}
+
+TEST_CASE("Compact entity handles", "Entity")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+
+	// a handle, a generation id and a free list entry per entity, besides the components
+	REQUIRE(sizeof(Entity) == 1);
+	REQUIRE(EntityComponentChunk::CalculateBlockSize(pArchetype) == 
+		sizeof(Entity) + sizeof(EntityGenID) + sizeof(uint16_t) + sizeof(Transform) + sizeof(Velocity));
+
+	const int n = 3 * MAX_ENTITY_COUNT_PER_CHUNK;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+
+	// handles are found by their addresses, and resolve to their EntityIDs and components
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->GetEntity(entityIds[i]);
+		correctness &= (int)(pEntity != nullptr && pEntity->IsValid());
+		correctness &= (int)(pEntity == pStorage->GetChunk(i / MAX_ENTITY_COUNT_PER_CHUNK)->GetEntity((uint16_t)(i % MAX_ENTITY_COUNT_PER_CHUNK)));
+		correctness &= (int)(pEntity->GetEntityID() == entityIds[i]);
+		correctness &= (int)(pEntity->GetArchetype() == pArchetype);
+		correctness &= (int)(pEntity->GetContext() == pContext);
+		correctness &= (int)(pEntity->GetComponent<Transform>()->yaw == (float)i);
+	}
+	REQUIRE(correctness);
+
+	// the released handle becomes invalid, and the reused block gets a new generation
+	Entity* pEntity = pContext->GetEntity(entityIds[5]);
+	pEntity->Release();
+	REQUIRE(!pEntity->IsValid());
+	REQUIRE(pContext->GetEntity(entityIds[5]) == nullptr);
+	Entity* pNewEntity = pContext->CreateEntity(pArchetype);
+	REQUIRE(pNewEntity == pEntity);
+	REQUIRE(pNewEntity->IsValid());
+	REQUIRE(pNewEntity->GetEntityID() != entityIds[5]);
+	REQUIRE(pContext->GetEntity(entityIds[5]) == nullptr);
+
+	pContext->Release();
+}
+
+TEST_CASE("EntityID layout", "EntityIDLayout")
+{
+	// every part is parsed back from the EntityID composed by the layout
+	EntityGenID maxGenId = (EntityGenID)GEN_ID_MASK;
+	uint8_t maxContextId = (uint8_t)(MAX_CONTEXT_COUNT - 1);
+	uint16_t maxStorageIndex = (uint16_t)(MAX_STORAGE_COUNT_PER_CONTEXT - 1);
+	uint16_t maxChunkIndex = (uint16_t)(MAX_CHUNK_COUNT_PER_STORAGE - 1);
+	uint16_t maxBlockIndex = (uint16_t)(MAX_ENTITY_COUNT_PER_CHUNK - 1);
+	EntityID eid = Entity::ComposeEntityID(maxGenId, maxContextId, maxStorageIndex, maxChunkIndex, maxBlockIndex);
+
+	EntityGenID genid;
+	uint8_t contextId;
+	uint16_t storageIndex, chunkIndex, blockIndex;
+	Entity::ParseEntityID(eid, &genid, &contextId, &storageIndex, &chunkIndex, &blockIndex);
+	REQUIRE(genid == maxGenId);
+	REQUIRE(contextId == maxContextId);
+	REQUIRE(storageIndex == maxStorageIndex);
+	REQUIRE(chunkIndex == maxChunkIndex);
+	REQUIRE(blockIndex == maxBlockIndex);
+	REQUIRE(Entity::ExtractContextIdFromEntityID(eid) == maxContextId);
+
+	eid = Entity::ComposeEntityID(1, 0, 0, 0, 0);
+	Entity::ParseEntityID(eid, &genid, &contextId, &storageIndex, &chunkIndex, &blockIndex);
+	REQUIRE((genid == 1 && contextId == 0 && storageIndex == 0 && chunkIndex == 0 && blockIndex == 0));
+
+	// the generation ids wrap around
+	REQUIRE(is_newer_gen_id(1, 0));
+	REQUIRE(is_newer_gen_id(0, maxGenId));
+	REQUIRE(!is_newer_gen_id(maxGenId, 0));
+	REQUIRE(!is_newer_gen_id(5, 5));
+
+	// a released entity's EntityID isn't resolved to the next one in the same block
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile>();
+	EntityContext* pContext = pWorld->CreateContext();
+	Entity* pEntity = pContext->CreateEntity(pArchetype);
+	EntityID oldEntityId = pEntity->GetEntityID();
+	pEntity->Release();
+	pEntity = pContext->CreateEntity(pArchetype);
+	REQUIRE(pEntity->GetEntityID() != oldEntityId);
+	REQUIRE(pWorld->GetEntity(oldEntityId) == nullptr);
+	REQUIRE(pWorld->GetEntity(pEntity->GetEntityID()) == pEntity);
+
+	// creating entities past the chunks the layout can address fails cleanly
+	EntityArchetype* pSmallArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	pSmallArchetype->SetChunkSizePolicy(ChunkSizePolicy::EntityCount(1));
+	std::vector<Entity*> entities;
+	for (int i = 0; i < MAX_CHUNK_COUNT_PER_STORAGE; i++)
+		entities.push_back(pContext->CreateEntity(pSmallArchetype, Profile("Test", i)));
+	REQUIRE(std::find(entities.begin(), entities.end(), nullptr) == entities.end());
+	REQUIRE(pContext->CreateEntity(pSmallArchetype) == nullptr);
+	REQUIRE(entities[0]->Clone() == nullptr);
+	REQUIRE(!pContext->Reserve(pSmallArchetype, 1));
+	REQUIRE(pContext->GetEntityComponentStorage(pSmallArchetype)->GetChunkCount() == MAX_CHUNK_COUNT_PER_STORAGE);
+	// the entities created before aren't touched
+	REQUIRE(pWorld->GetEntity(entities.back()->GetEntityID()) == entities.back());
+	REQUIRE(entities.back()->GetComponent<Profile>()->age == MAX_CHUNK_COUNT_PER_STORAGE - 1);
+	// a released entity makes room for one more
+	entities.back()->Release();
+	REQUIRE(pContext->CreateEntity(pSmallArchetype) != nullptr);
+	pContext->Release();
+	pSmallArchetype->ResetChunkSizePolicy();
+
+	// and so does creating contexts past the ones the layout can address
+	std::vector<EntityContext*> contexts;
+	while (EntityContext* pNewContext = pWorld->CreateContext())
+		contexts.push_back(pNewContext);
+	REQUIRE(contexts.size() <= (size_t)MAX_CONTEXT_COUNT);
+	REQUIRE(pWorld->CreateContext() == nullptr);
+	for (EntityContext* pOldContext : contexts)
+		pOldContext->Release();
+}
+
+TEST_CASE("Stable EntityIDs", "EntityIDTable")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityArchetype* pPackedArchetype = pWorld->CreateArchetype<Profile, Transform>();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Packed);
+	EntityContext* pContext = pWorld->CreateContext();
+	pContext->EnableStableEntityIDs();
+	REQUIRE(pContext->HasStableEntityIDs());
+
+	const int n = 5000;
+	std::vector<EntityID> entityIds, packedEntityIds;
+	for (int i = 0; i < n; i++)
+	{
+		entityIds.push_back(pContext->CreateEntity(pArchetype, Profile("Test", i))->GetEntityID());
+		packedEntityIds.push_back(pContext->CreateEntity(pPackedArchetype, Profile("Packed", i))->GetEntityID());
+	}
+
+	// releasing moves the last entity of the packed storage, and defragmenting moves the rest
+	for (int i = 0; i < n; i++)
+	{
+		if (i % 3 != 0) {
+			pContext->GetEntity(entityIds[i])->Release();
+			pContext->GetEntity(packedEntityIds[i])->Release();
+		}
+	}
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	REQUIRE(pStorage->IsFragmented());
+	pStorage->Defragment(1000000);
+	REQUIRE(!pStorage->IsFragmented());
+
+	// the EntityIDs still refer to the moved entities, and never to others
+	int correctness = 1;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pWorld->GetEntity(entityIds[i]);
+		Entity* pPackedEntity = pWorld->GetEntity(packedEntityIds[i]);
+		if (i % 3 != 0) {
+			correctness &= (int)(pEntity == nullptr && pPackedEntity == nullptr);
+		}
+		else {
+			correctness &= (int)(pEntity != nullptr && pEntity->GetComponent<Profile>()->age == i);
+			correctness &= (int)(pEntity != nullptr && pEntity->GetEntityID() == entityIds[i]);
+			correctness &= (int)(pPackedEntity != nullptr && pPackedEntity->GetComponent<Profile>()->age == i);
+			correctness &= (int)(pPackedEntity != nullptr && pPackedEntity->GetEntityID() == packedEntityIds[i]);
+		}
+	}
+	REQUIRE(correctness);
+
+	// the slots of the released entities are reused with new generations
+	Entity* pEntity = pContext->CreateEntity(pArchetype, Profile("New", n));
+	EntityID eid = pEntity->GetEntityID();
+	REQUIRE(std::find(entityIds.begin(), entityIds.end(), eid) == entityIds.end());
+	REQUIRE(std::find(packedEntityIds.begin(), packedEntityIds.end(), eid) == packedEntityIds.end());
+	REQUIRE(pContext->GetEntity(eid) == pEntity);
+
+	// adding and removing components moves an entity to another archetype and keeps its EntityID
+	EntityID movedId = entityIds[0];
+	pContext->GetEntity(movedId)->AddSparseComponent<Stunned>(5.0f);
+	Entity* pMoved = pContext->GetEntity(movedId)->AddComponents(Transform(Vector3(1.0f, 2.0f, 3.0f), Vector3(1.0f, 1.0f, 1.0f), 45.0f));
+	REQUIRE(pMoved->GetArchetype() == pWorld->CreateArchetype<Profile, Velocity, Transform>());
+	REQUIRE(pMoved->GetEntityID() == movedId);
+	REQUIRE(pContext->GetEntity(movedId) == pMoved);
+	REQUIRE(pMoved->GetComponent<Profile>()->age == 0);
+	REQUIRE(pMoved->GetComponent<Transform>()->yaw == 45.0f);
+	REQUIRE(pMoved->GetComponent<Stunned>()->duration == 5.0f);
+	pMoved = pMoved->RemoveComponents<Velocity>();
+	REQUIRE(pMoved->GetArchetype() == pWorld->CreateArchetype<Profile, Transform>());
+	REQUIRE(pContext->GetEntity(movedId) == pMoved);
+	REQUIRE(pMoved->GetComponent<Stunned>()->duration == 5.0f);
+	REQUIRE(pContext->GetSparseComponentSet<Stunned>()->GetCount() == 1);
+	// adding components it has already leaves it in place
+	REQUIRE(pMoved->AddComponents<Profile>() == nullptr);
+	REQUIRE(pContext->GetEntity(movedId) == pMoved);
+	// while Extend and Remove keep the entity and give the copy they return a new EntityID
+	Entity* pCopy = pMoved->Extend<Velocity>();
+	REQUIRE(pCopy->GetEntityID() != movedId);
+	REQUIRE(pContext->GetEntity(movedId) == pMoved);
+	REQUIRE(pContext->GetEntity(pCopy->GetEntityID()) == pCopy);
+
+	pContext->Release();
+	pPackedArchetype->SetStorageMode(EntityStorageMode::Default);
+}
+
+TEST_CASE("Look up entities while the storage grows", "ChunkDirectory")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+
+	const int n = 4 * MAX_ENTITY_COUNT_PER_CHUNK;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+		entityIds.push_back(pContext->CreateEntity(pArchetype, Profile("Existing", i))->GetEntityID());
+	EntityComponentChunk* pFirstChunk = pStorage->GetChunk(0);
+
+	// resolve the existing entities on another thread while new chunks are created
+	std::atomic<bool> bSpawning(true);
+	std::atomic<int> correctness(1);
+	std::thread reader([&]() {
+		do {
+			for (int i = 0; i < n; i++) {
+				Entity* pEntity = pContext->GetEntity(entityIds[i]);
+				if (pEntity == nullptr || pEntity->GetComponent<Profile>()->age != i)
+					correctness = 0;
+			}
+		} while (bSpawning.load());
+	});
+	// and while the first entities of other archetypes create new storages in the context
+	std::function<void()> createStorages[] = {
+		[=]() { pContext->CreateEntity<Transform>(); },
+		[=]() { pContext->CreateEntity<Description>(); },
+		[=]() { pContext->CreateEntity<Transform, Description>(); },
+		[=]() { pContext->CreateEntity<Profile, Transform>(); },
+		[=]() { pContext->CreateEntity<Profile, Description>(); },
+		[=]() { pContext->CreateEntity<Velocity, Description>(); },
+		[=]() { pContext->CreateEntity<Transform, Velocity, Description>(); },
+		[=]() { pContext->CreateEntity<Profile, Transform, Description>(); },
+	};
+	const int storageCount = (int)(sizeof(createStorages) / sizeof(createStorages[0]));
+	// several pages, or all the chunks the EntityID layout can address
+	const int chunkCount = std::min<int>(192, MAX_CHUNK_COUNT_PER_STORAGE);
+	for (int i = n; i < chunkCount * MAX_ENTITY_COUNT_PER_CHUNK; i++) {
+		pContext->CreateEntity(pArchetype, Profile("New", i));
+		int storageIndex = (i - n) / MAX_ENTITY_COUNT_PER_CHUNK;
+		if ((i - n) % MAX_ENTITY_COUNT_PER_CHUNK == 0 && storageIndex < storageCount)
+			createStorages[storageIndex]();
+	}
+	bSpawning = false;
+	reader.join();
+	REQUIRE(correctness.load());
+	REQUIRE(pStorage->GetChunkCount() == chunkCount);
+	int createdCount = 0;
+	pContext->ForEach<Transform>([&createdCount, pContext](Entity* pEntity, Transform* pTransform) {
+		createdCount += (int)(pContext->GetEntity(pEntity->GetEntityID()) == pEntity);
+	});
+	REQUIRE(createdCount == 5);
+
+	// chunks are never moved
+	REQUIRE(pStorage->GetChunk(0) == pFirstChunk);
+	REQUIRE(pFirstChunk->GetUsedCount() == MAX_ENTITY_COUNT_PER_CHUNK);
+
+	pContext->Release();
+}
+
+TEST_CASE("Look up entities while holes are refilled", "ChunkDirectory")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+
+	const int n = 4 * (int)pStorage->GetEntityCountPerChunk();
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+		entityIds.push_back(pContext->CreateEntity(pArchetype, Profile("Existing", i))->GetEntityID());
+	// half of the entities are released, and the others moved into the first chunks
+	for (int i = 1; i < n; i += 2)
+		pContext->GetEntity(entityIds[i])->Release();
+	REQUIRE(pStorage->Defragment(1000000));
+	REQUIRE(!pStorage->IsFragmented());
+
+	// resolve every fourth entity on another thread, while the others are released
+	// and new entities are created in the holes they leave
+	std::atomic<bool> bSpawning(true);
+	std::atomic<int> correctness(1);
+	std::thread reader([&]() {
+		do {
+			for (int i = 0; i < n; i += 4) {
+				Entity* pEntity = pContext->GetEntity(entityIds[i]);
+				if (pEntity == nullptr || pEntity->GetComponent<Profile>()->age != i)
+					correctness = 0;
+			}
+		} while (bSpawning.load());
+	});
+	std::vector<EntityID> newEntityIds;
+	for (int i = 2; i < n; i += 4) {
+		pContext->GetEntity(entityIds[i])->Release();
+		newEntityIds.push_back(pContext->CreateEntity(pArchetype, Profile("New", n + i))->GetEntityID());
+	}
+	bSpawning = false;
+	reader.join();
+	REQUIRE(correctness.load());
+	for (size_t i = 0; i < newEntityIds.size(); i++)
+		correctness &= (int)(pContext->GetEntity(newEntityIds[i])->GetComponent<Profile>()->age == n + 2 + 4 * (int)i);
+	REQUIRE(correctness.load());
+	// the new entities took the holes instead of new chunks
+	REQUIRE(pStorage->GetChunkCount() == 4);
+
+	pContext->Release();
+}
+
+TEST_CASE("Chunk memory pool", "ChunkMemoryPool")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetypeA = pWorld->CreateArchetype<Profile, Velocity>();
+	EntityArchetype* pArchetypeB = pWorld->CreateArchetype<Transform, Velocity>();
+	EntityContext* pContext = pWorld->CreateContext();
+	EntityComponentStorage* pStorageA = pContext->GetEntityComponentStorage(pArchetypeA);
+	EntityComponentStorage* pStorageB = pContext->GetEntityComponentStorage(pArchetypeB);
+
+	// a step covering both chunk sizes puts them in the same size class
+	size_t step = std::max(pStorageA->GetChunkSize(), pStorageB->GetChunkSize());
+	pWorld->EnableChunkMemoryPool(step);
+	ChunkMemoryPool* pPool = pWorld->GetChunkMemoryPool();
+	REQUIRE(pPool->IsEnabled());
+	REQUIRE(pPool->GetSizeClass(pStorageA->GetChunkSize()) == pPool->GetSizeClass(pStorageB->GetChunkSize()));
+
+	const int chunkCount = 8;
+	const int n = chunkCount * MAX_ENTITY_COUNT_PER_CHUNK;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+		entityIds.push_back(pContext->CreateEntity(pArchetypeA, Profile("Pooled", i))->GetEntityID());
+	for (EntityID eid : entityIds)
+		pContext->GetEntity(eid)->Release();
+	pContext->Trim();
+
+	// the memory released by the storage of A is kept in the pool
+	ChunkMemoryPool::Stats stats = pPool->GetStats();
+	REQUIRE(stats.missCount >= (size_t)chunkCount);
+	REQUIRE(stats.pooledBlockCount >= (size_t)chunkCount);
+	REQUIRE(stats.pooledBytes == stats.pooledBlockCount * step);
+
+	// and reused by the storage of B
+	size_t hitCount = stats.hitCount;
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity(pArchetypeB)->GetComponent<Transform>()->yaw = (float)i;
+	stats = pPool->GetStats();
+	REQUIRE(stats.hitCount - hitCount == (size_t)pStorageB->GetAllocatedChunkCount());
+	float sum = 0;
+	pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+		sum += pTransform->yaw > 0 ? 1.0f : 0.0f;
+	});
+	REQUIRE(sum == (float)(n - 1));
+
+	// the pooled memory goes back to the allocator
+	pWorld->Trim();
+	REQUIRE(pPool->GetStats().pooledBytes == 0);
+
+	pContext->Release();
+	REQUIRE(pPool->GetStats().pooledBlockCount > 0);
+	pWorld->DisableChunkMemoryPool();
+	REQUIRE(!pPool->IsEnabled());
+	REQUIRE(pPool->GetStats().pooledBytes == 0);
+}
+
+#if defined(__linux__)
+TEST_CASE("Huge page chunk allocator", "HugePageChunkMemoryAllocator")
+{
+	World* pWorld = World::GetInstance();
+	HugePageChunkMemoryAllocator allocator;
+	pWorld->SetChunkMemoryAllocator(&allocator);
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity, SimdVector>();
+	EntityContext* pContext = pWorld->CreateContext();
+
+	const int n = 5000;
+	std::vector<EntityID> entityIds;
+	for (int i = 0; i < n; i++)
+	{
+		Entity* pEntity = pContext->CreateEntity(pArchetype);
+		pEntity->GetComponent<Transform>()->yaw = (float)i;
+		entityIds.push_back(pEntity->GetEntityID());
+	}
+	size_t mappedBytes = allocator.GetMappedBytes();
+	REQUIRE(mappedBytes >= (size_t)HugePageChunkMemoryAllocator::HUGE_PAGE_SIZE);
+
+	// the columns are still aligned
+	EntityComponentStorage* pStorage = pContext->GetEntityComponentStorage(pArchetype);
+	for (int i = 0; i < pStorage->GetChunkCount(); i++)
+		REQUIRE((uintptr_t)pStorage->GetChunk(i)->GetMemory() % CACHE_LINE_SIZE == 0);
+
+	float sum = 0;
+	pContext->ForEach<Transform>([&sum](Entity* pEntity, Transform* pTransform) {
+		sum += pTransform->yaw;
+	});
+	REQUIRE(sum == (float)(n * (n - 1) / 2));
+
+	// released chunks are reused, no more region is mapped
+	for (EntityID eid : entityIds)
+		pContext->GetEntity(eid)->Release();
+	pContext->Trim();
+	for (int i = 0; i < n; i++)
+		pContext->CreateEntity(pArchetype);
+	REQUIRE(allocator.GetMappedBytes() == mappedBytes);
+
+	pContext->Release();
+	pWorld->SetChunkMemoryAllocator(nullptr);
+}
+
+// run it with the tag: [.benchmark]
+TEST_CASE("Benchmark ForEach with huge pages", "[.benchmark]")
+{
+	World* pWorld = World::GetInstance();
+	EntityArchetype* pArchetype = pWorld->CreateArchetype<Transform, Velocity>();
+	const int n = 2000000;
+	const int iterations = 20;
+
+	auto run = [&](const char* name) {
+		EntityContext* pContext = pWorld->CreateContext();
+		for (int i = 0; i < n; i++)
+			pContext->CreateEntity(pArchetype);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int k = 0; k < iterations; k++) {
+			pContext->ForEach<Transform, Velocity>([](Entity* pEntity, Transform* pTransform, Velocity* pVelocity) {
+				pTransform->position.x += pVelocity->Direction.x * pVelocity->Magnitude;
+			});
+		}
+		auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+		printf("%s: %.3f ns per entity\n", name, elapsed / ((double)n * iterations));
+		pContext->Release();
+	};
+
+	run("StandardChunkMemoryAllocator");
+
+	HugePageChunkMemoryAllocator allocator;
+	pWorld->SetChunkMemoryAllocator(&allocator);
+	run(allocator.IsHugeTLBUsed() ? "HugePageChunkMemoryAllocator (MAP_HUGETLB)" : "HugePageChunkMemoryAllocator (MADV_HUGEPAGE)");
+	pWorld->SetChunkMemoryAllocator(nullptr);
+}
+#endif
+
 
 int main(int argc, char* argv[]) {
 	int result = Catch::Session().run(argc, argv);